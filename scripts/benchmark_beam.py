@@ -0,0 +1,85 @@
+"""Compare the native beam search with the Python greedy (and beam) search of `sound_law.evaluate.greedy_benchmark`.
+
+The environment is built from a cognate file with `sound_law.evaluate.benchmark_env`. The Python searches go through an
+adapter that exposes every complete action of a state (see `expand_all_actions`) and applies actions one by one, which
+creates a tree node for every action that is tried. The native search scores the actions of every state in the beam with a
+one-step lookahead and only creates the nodes that are kept. A beam of size 1 is the greedy search, and should find
+the same rules.
+"""
+import time
+from argparse import ArgumentParser
+
+from sound_law.data.alphabet import NULL_ID
+from sound_law.evaluate.benchmark_env import load_pairs, make_env
+from sound_law.evaluate.greedy_benchmark import (beam_search_find_rules,
+                                                 greedily_find_rules)
+from sound_law.rl.mcts_cpp import PyBeamSearch
+
+# Indexed by `SpecialType`.
+RTYPES = ['basic', 'CLL', 'CLR', 'VS', 'GBJ', 'GBW']
+
+
+class EnvAdapter:
+    """Expose a `PyEnv` through the interface used by `greedy_benchmark`. Actions are tuples in the order of
+    `expand_all_actions`."""
+
+    def __init__(self, env):
+        self.env = env
+        self.start = env.start
+        self.end = env.end
+
+    def apply_action(self, state, act):
+        before, st, after, pre, d_pre, post, d_post = act
+        return self.env.apply_action(state, before, after, RTYPES[st], pre, d_pre, post, d_post)
+
+    def get_state_edit_dist(self, state, end_state) -> float:
+        return state.dist
+
+    def get_possible_actions(self, state):
+        # Stopping is not a rule.
+        return [tuple(act) for act in self.env.expand_all_actions(state) if act[0] != NULL_ID]
+
+
+def replay(env, actions):
+    state = env.start
+    for act in actions:
+        state = env.apply_action(state, act)
+    return state.dist
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser()
+    parser.add_argument('--data_path', default='data/proto_germanic_cogs.tsv')
+    parser.add_argument('--lang', default='ang', help='Daughter language to use.')
+    parser.add_argument('--num_words', type=int, default=100)
+    parser.add_argument('--num_threads', type=int, default=1)
+    parser.add_argument('--num_rules', type=int, default=3)
+    parser.add_argument('--beam_size', type=int, default=5)
+    parser.add_argument('--python_beam', action='store_true', help='Run the Python beam search as well (slow).')
+    args = parser.parse_args()
+
+    src, tgt = load_pairs(args.data_path, args.lang, args.num_words)
+    env, abc = make_env(src, tgt, False)
+    adapter = EnvAdapter(env)
+    print(f'#words: {len(src)}, #units: {len(abc)}, start dist: {env.start.dist:.3f}')
+
+    start = time.perf_counter()
+    rules = greedily_find_rules(adapter, args.num_rules, adapter.get_possible_actions)
+    elapsed = time.perf_counter() - start
+    print(f'python greedy: dist {replay(adapter, rules):.3f} in {elapsed:.3f}s')
+
+    for beam_size in [1, args.beam_size]:
+        start = time.perf_counter()
+        beam = PyBeamSearch(env, beam_size, args.num_threads).search(env.start, args.num_rules)
+        elapsed = time.perf_counter() - start
+        node, actions = beam[0]
+        print(f'native beam ({beam_size}): dist {node.dist:.3f} in {elapsed:.3f}s')
+        if beam_size == 1 and [tuple(act) for act in actions] != rules:
+            print('  rules differ from the python greedy search')
+
+    if args.python_beam:
+        start = time.perf_counter()
+        dist, rules, _ = beam_search_find_rules(adapter, args.num_rules, args.beam_size,
+                                                 adapter.get_possible_actions)
+        elapsed = time.perf_counter() - start
+        print(f'python beam ({args.beam_size}): dist {dist:.3f} in {elapsed:.3f}s')
@@ -0,0 +1,55 @@
+"""Measure the throughput of node expansion on real data.
+
+Builds an environment from a cognate file (Proto-Germanic to one daughter language by default), with an `Alphabet`
+of the units that occur in it, then runs a short search with deferred expansion so that tree node expansion can
+be timed on its own. Two numbers are reported:
+    1. tree nodes expanded per second (root actions of new states, derived from their parents);
+    2. paths selected per second. Selection expands the mini nodes along every path, which goes through
+       `update_affected` for every unit at every site, and dominates the selection time.
+"""
+import time
+from argparse import ArgumentParser
+
+import numpy as np
+
+from sound_law.evaluate.benchmark_env import load_pairs, make_env
+from sound_law.rl.mcts_cpp import PyMcts, PyMctsOpt
+
+
+if __name__ == "__main__":
+    parser = ArgumentParser()
+    parser.add_argument('--data_path', default='data/proto_germanic_cogs.tsv')
+    parser.add_argument('--lang', default='ang', help='Daughter language to use.')
+    parser.add_argument('--num_words', type=int, default=500)
+    parser.add_argument('--num_threads', type=int, default=1)
+    parser.add_argument('--num_rounds', type=int, default=20, help='Number of select/evaluate/backup rounds.')
+    parser.add_argument('--batch_size', type=int, default=50)
+    args = parser.parse_args()
+
+    src, tgt = load_pairs(args.data_path, args.lang, args.num_words)
+    env, abc = make_env(src, tgt, True)
+    num_abc = len(abc)
+    print(f'#words: {len(src)}, #units: {num_abc}')
+    mcts = PyMcts(env, PyMctsOpt(5.0, 3, 1.0, args.num_threads, 1.0, False, False, False, 0))
+    meta_priors = np.full([6, num_abc], 1.0 / num_abc, dtype='float32')
+    special_priors = np.full([6], 1.0 / 6, dtype='float32')
+
+    env.evaluate(env.start, meta_priors, special_priors)
+    states = list()
+    expand_time = select_time = 0.0
+    for _ in range(args.num_rounds):
+        start = time.perf_counter()
+        paths, _ = mcts.select(env.start, args.batch_size, 0, 10)
+        select_time += time.perf_counter() - start
+        for path in paths:
+            node = path.get_last_node()
+            if not node.stopped and not node.done and node.is_leaf():
+                start = time.perf_counter()
+                env.ensure_expanded(node)
+                expand_time += time.perf_counter() - start
+                env.evaluate(node, meta_priors, special_priors)
+                states.append(node)
+        mcts.backup(paths, [0.0] * len(paths))
+    num_paths = args.num_rounds * args.batch_size
+    print(f'tree nodes: {len(states)} in {expand_time:.3f}s, {len(states) / max(expand_time, 1e-9):.1f} nodes/s')
+    print(f'selection: {num_paths} paths in {select_time:.3f}s, {num_paths / max(select_time, 1e-9):.1f} paths/s')
@@ -0,0 +1,112 @@
+"""Check that a Python thread keeps making progress while the main thread is searching.
+
+Builds a synthetic environment, then runs select/evaluate/backup/play in the main thread while a background thread
+counts how many pure-Python iterations it gets through. With the GIL released around the C++ calls, the count should
+be close to the count obtained when the main thread is idle.
+"""
+import sys
+import threading
+import time
+
+import numpy as np
+
+from sound_law.rl.mcts_cpp import (PyActionSpaceOpt, PyEnv, PyEnvOpt,
+                                   PyMcts, PyMctsOpt, PyPS_SAMPLE_AC,
+                                   PyStressed, PyUnstressed, PyWordSpaceOpt)
+
+
+def make_env(num_abc: int, num_words: int, length: int, rng):
+
+    def random_vocab():
+        arr = np.zeros([num_words, length], dtype='uint16')
+        arr[:, 0] = 2
+        arr[:, length - 1] = 3
+        arr[:, 1:length - 1] = rng.randint(7, num_abc - 3, size=[num_words, length - 2])
+        return arr
+
+    lengths = np.full([num_words], length, dtype='long')
+    env_opt = PyEnvOpt(random_vocab(), lengths, random_vocab(), lengths, 1.0, 0.02)
+    as_opt = PyActionSpaceOpt(0, 1, 2, 3, 4, 5, 6, num_abc - 5, num_abc - 4, 1, 0.0, num_abc)
+    dist_mat = np.abs(np.arange(num_abc)[:, None] - np.arange(num_abc)[None]).astype('float32')
+    is_vowel = np.zeros(num_abc, dtype=bool)
+    is_vowel[num_abc - 3:] = True
+    stress = np.zeros(num_abc, dtype='int32')
+    stress[num_abc - 2] = PyStressed
+    stress[num_abc - 1] = PyUnstressed
+    unit2base = np.arange(num_abc, dtype='uint16')
+    unit2base[num_abc - 2:] = num_abc - 3
+    unit2stressed = np.arange(num_abc, dtype='uint16')
+    unit2stressed[num_abc - 3] = num_abc - 2
+    unit2unstressed = np.arange(num_abc, dtype='uint16')
+    unit2unstressed[num_abc - 3] = num_abc - 1
+    ws_opt = PyWordSpaceOpt(dist_mat, 1.0, True, is_vowel, ~is_vowel, stress,
+                            unit2base, unit2stressed, unit2unstressed)
+    env = PyEnv(env_opt, as_opt, ws_opt)
+    for i in range(7, num_abc):
+        for j in range(max(7, i - 3), min(num_abc, i + 4)):
+            if i != j:
+                env.register_permissible_change(i, j)
+        env.register_permissible_change(i, 1)
+    return env
+
+
+def search(env, mcts, meta_priors, special_priors, num_steps: int, num_batches: int, batch_size: int):
+    root = env.start
+    env.evaluate(root, meta_priors, special_priors)
+    played = None
+    for step in range(num_steps):
+        for _ in range(num_batches):
+            paths, _ = mcts.select(root, batch_size, step, num_steps, played)
+            for path in paths:
+                node = path.get_last_node()
+                if not node.stopped and not node.done and node.is_leaf():
+                    env.evaluate(node, meta_priors, special_priors)
+            mcts.backup(paths, [0.0] * len(paths))
+        new_path = mcts.play(root, step, PyPS_SAMPLE_AC, 1.0)
+        if played is None:
+            played = new_path
+        else:
+            played.merge(new_path)
+        root = played.get_last_node()
+        if root.stopped or root.done:
+            break
+
+
+def count_in_background(fn) -> int:
+    count = 0
+    done = threading.Event()
+
+    def spin():
+        nonlocal count
+        while not done.is_set():
+            count += 1
+
+    thread = threading.Thread(target=spin)
+    thread.start()
+    fn()
+    done.set()
+    thread.join()
+    return count
+
+
+if __name__ == "__main__":
+    num_words = int(sys.argv[1]) if len(sys.argv) > 1 else 100
+    num_threads = int(sys.argv[2]) if len(sys.argv) > 2 else 4
+    num_abc = 60
+
+    meta_priors = np.full([6, num_abc], 1.0 / num_abc, dtype='float32')
+    special_priors = np.full([6], 1.0 / 6, dtype='float32')
+
+    def run():
+        env = make_env(num_abc, num_words, 8, np.random.RandomState(0))
+        mcts = PyMcts(env, PyMctsOpt(5.0, 3, 1.0, num_threads, 1.0, False, False, False, 0))
+        search(env, mcts, meta_priors, special_priors, 5, 10, 50)
+
+    start = time.time()
+    busy = count_in_background(run)
+    duration = time.time() - start
+    idle = count_in_background(lambda: time.sleep(duration))
+    print(f'search time: {duration:.3f}s')
+    print(f'background iterations during search: {busy}')
+    print(f'background iterations while idle:    {idle}')
+    print(f'ratio: {busy / max(idle, 1):.3f}')
@@ -0,0 +1,59 @@
+"""Compare root-parallel search with the virtual-loss (tree-parallel) scheme across thread counts.
+
+For every configuration, runs a few moves of search on the same synthetic environment and reports simulations per second
+and the distance to the target after the last move (lower is better).
+"""
+import sys
+import time
+
+import numpy as np
+
+from benchmark_nogil import make_env
+from sound_law.rl.mcts_cpp import PyMcts, PyMctsOpt, PyPS_MAX
+
+
+def run(num_words: int, num_threads: int, root_parallel: bool, num_steps: int, num_batches: int, batch_size: int):
+    num_abc = 60
+    env = make_env(num_abc, num_words, 8, np.random.RandomState(0))
+    mcts = PyMcts(env, PyMctsOpt(5.0, 3, 1.0, num_threads, 1.0, False, False, False, 0,
+                                 root_parallel=root_parallel))
+    meta_priors = np.full([6, num_abc], 1.0 / num_abc, dtype='float32')
+    special_priors = np.full([6], 1.0 / 6, dtype='float32')
+
+    root = env.start
+    env.evaluate(root, meta_priors, special_priors)
+    played = None
+    num_sims = 0
+    search_time = 0.0
+    for step in range(num_steps):
+        start = time.time()
+        for _ in range(num_batches):
+            paths, _ = mcts.select(root, batch_size, step, num_steps, played)
+            for path in paths:
+                node = path.get_last_node()
+                if not node.stopped and not node.done and node.is_leaf():
+                    env.evaluate(node, meta_priors, special_priors)
+            mcts.backup(paths, [0.0] * len(paths))
+            num_sims += len(paths)
+        search_time += time.time() - start
+        new_path = mcts.play(root, step, PyPS_MAX, 1.0)
+        if played is None:
+            played = new_path
+        else:
+            played.merge(new_path)
+        root = played.get_last_node()
+        if root.stopped or root.done:
+            break
+    return num_sims / search_time, root.dist
+
+
+if __name__ == "__main__":
+    num_words = int(sys.argv[1]) if len(sys.argv) > 1 else 100
+    thread_counts = [int(n) for n in sys.argv[2].split(',')] if len(sys.argv) > 2 else [1, 2, 4, 8]
+
+    print(f'{"mode":<16}{"threads":>8}{"sims/s":>12}{"final dist":>12}')
+    for num_threads in thread_counts:
+        for root_parallel in [False, True]:
+            sims_per_sec, dist = run(num_words, num_threads, root_parallel, 5, 20, 64)
+            mode = 'root-parallel' if root_parallel else 'virtual-loss'
+            print(f'{mode:<16}{num_threads:>8}{sims_per_sec:>12.1f}{dist:>12.2f}')
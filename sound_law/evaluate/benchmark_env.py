@@ -0,0 +1,84 @@
+"""Build a `PyEnv` from a cognate file for benchmarks, without the data pipeline of training."""
+
+import csv
+import unicodedata
+
+import numpy as np
+
+import sound_law.main  # pylint: disable=unused-import # Registers `use_mcts`, which is read by `Alphabet`.
+from dev_misc.arglib import set_argument
+from sound_law.data.alphabet import (ANY_ID, ANY_S_ID, ANY_UNS_ID, EMP_ID,
+                                     EOT_ID, NULL_ID, PAD_ID, SOT_ID, Alphabet)
+from sound_law.data.cognate import add_stress_on_first
+from sound_law.rl.mcts_cpp import (PyActionSpaceOpt, PyEnv, PyEnvOpt,
+                                   PyNoStress, PyWordSpaceOpt)
+
+
+def segment(form: str) -> list:
+    """Split a form into units. Combining marks (length, accents, etc.) stay with the preceding character."""
+    units = list()
+    for c in unicodedata.normalize('NFD', form):
+        if units and (unicodedata.combining(c) or c in 'ːˑ'):
+            units[-1] += c
+        elif not c.isspace():
+            units.append(c)
+    return units
+
+
+def load_pairs(path: str, lang: str, num_words: int):
+    """Load at most `num_words` pairs of (Proto-Germanic, `lang`) forms split into units, one per cognate set."""
+    src = list()
+    tgt = list()
+    seen = set()
+    with open(path, encoding='utf8') as fin:
+        reader = csv.reader(fin, delimiter='\t')
+        next(reader)
+        for row in reader:
+            if len(row) != 3 or row[1] != lang or row[0] in seen or not row[2]:
+                continue
+            seen.add(row[0])
+            src.append(segment(row[0]))
+            tgt.append(segment(row[2]))
+            if len(src) == num_words:
+                break
+    return src, tgt
+
+
+def make_env(src, tgt, defer_expansion: bool):
+    """Build the environment with the alphabet of `src` and `tgt`. Return the environment and the alphabet."""
+    # Units are not merged by their phonological features, as in MCTS training.
+    set_argument('use_mcts', True, _force=True)
+    # Glides are needed for GBJ/GBW.
+    abc = Alphabet('all', src + tgt + [['j', 'w']], None)
+    num_abc = len(abc)
+
+    def to_arr(words):
+        words = [add_stress_on_first(w) for w in words]
+        max_len = max(len(w) for w in words) + 2
+        arr = np.full([len(words), max_len], PAD_ID, dtype='uint16')
+        lengths = np.zeros([len(words)], dtype='long')
+        for i, w in enumerate(words):
+            ids = [SOT_ID] + [abc[u] for u in w] + [EOT_ID]
+            arr[i, :len(ids)] = ids
+            lengths[i] = len(ids)
+        return arr, lengths
+
+    s_arr, s_lengths = to_arr(src)
+    t_arr, t_lengths = to_arr(tgt)
+    env_opt = PyEnvOpt(s_arr, s_lengths, t_arr, t_lengths, 1.0, 0.02)
+    as_opt = PyActionSpaceOpt(NULL_ID, EMP_ID, SOT_ID, EOT_ID, ANY_ID, ANY_S_ID, ANY_UNS_ID,
+                              abc['j'], abc['w'], 1, 0.0, num_abc, defer_expansion=defer_expansion)
+    # Changing the base unit or the vowel/consonant class costs 1 each.
+    dist_mat = (abc.unit2base[:, None] != abc.unit2base[None]).astype('float32')
+    dist_mat += (abc.is_vowel[:, None] != abc.is_vowel[None]).astype('float32')
+    ws_opt = PyWordSpaceOpt(dist_mat, 1.0, True, abc.is_vowel, abc.is_consonant, abc.unit_stress,
+                            abc.unit2base, abc.unit2stressed, abc.unit2unstressed)
+    env = PyEnv(env_opt, as_opt, ws_opt)
+    # Every unit can be deleted, or changed into an unstressed unit of the same class.
+    first = len(abc.special_ids)
+    for i in range(first, num_abc):
+        for j in range(first, num_abc):
+            if i != j and abc.is_vowel[i] == abc.is_vowel[j] and abc.unit_stress[j] == PyNoStress:
+                env.register_permissible_change(i, j)
+        env.register_permissible_change(i, EMP_ID)
+    return env, abc
@@ -7,7 +7,7 @@ import bisect
 import random
 import string
 from dataclasses import dataclass, field
-from typing import ClassVar, List, Set, Dict, Optional, Union
+from typing import Callable, ClassVar, List, Set, Dict, Optional, Union
 import pandas as pd
 
 # from dev_misc import add_argument, g
@@ -55,8 +55,10 @@ def get_possible_actions(state: VocabState) -> List[SoundChangeAction]:
     return ['a', 'b', 'c', 'd', 'e', 'f', 'g']
 
 
-def greedily_find_rules(env: SoundChangeEnv, n_rules: int) -> List[SoundChangeAction]:
-    '''Greedily finds the n best rules evolving in a certain SoundChangeEnv, where best is greedily defined as decreasing the edit distance the most'''
+def greedily_find_rules(env: SoundChangeEnv, n_rules: int,
+                        get_actions: Callable[[VocabState], List[SoundChangeAction]] = get_possible_actions) -> List[SoundChangeAction]:
+    '''Greedily finds the n best rules evolving in a certain SoundChangeEnv, where best is greedily defined as decreasing the edit distance the most.
+    `get_actions` returns the actions to try at a given state.'''
     curr_state = env.start
     end_state = env.end
     chosen_rules = []
@@ -68,7 +70,7 @@ def greedily_find_rules(env: SoundChangeEnv, n_rules: int) -> List[SoundChangeAc
         best_distance = None
         best_act = None
         # find all viable rules
-        possible_actions = get_possible_actions(curr_state)
+        possible_actions = get_actions(curr_state)
         for act in possible_actions:
             # evaluate this rule
             act_state = env.apply_action(curr_state, act)
@@ -84,8 +86,9 @@ def greedily_find_rules(env: SoundChangeEnv, n_rules: int) -> List[SoundChangeAc
     return chosen_rules
 
 
-def beam_search_find_rules(env: SoundChangeEnv, n_rules: int, beam_width: int) -> List[SoundChangeAction]:
-    '''Desc'''
+def beam_search_find_rules(env: SoundChangeEnv, n_rules: int, beam_width: int,
+                           get_actions: Callable[[VocabState], List[SoundChangeAction]] = get_possible_actions) -> List[SoundChangeAction]:
+    '''Desc. `get_actions` returns the actions to try at a given state.'''
     curr_state = env.start
     end_state = env.end
     chosen_rules = []
@@ -100,7 +103,7 @@ def beam_search_find_rules(env: SoundChangeEnv, n_rules: int, beam_width: int) -
         new_beams = []
         for beam in curr_beams:
             beam_dist, beam_actions, beam_state = beam
-            possible_actions = get_possible_actions(beam_state) # should pull this out of the for loop if it turns out this function is state-invariant
+            possible_actions = get_actions(beam_state) # should pull this out of the for loop if it turns out this function is state-invariant
             for new_act in possible_actions:
                 new_state = env.apply_action(beam_state, new_act)
                 new_dist = dist_from_end(new_state)
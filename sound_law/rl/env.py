@@ -99,6 +99,15 @@ class SoundChangeEnv(PyEnv):
             raise RuntimeError(f'None of the rules in the block applies.')
         return curr_state
 
+    @staticmethod
+    def _pack_actions(actions: List[SoundChangeAction]):
+        return [(action.before_id, action.after_id, action.rtype, action.pre_id, action.d_pre_id, action.post_id,
+                 action.d_post_id) for action in actions]
+
+    def apply_rules(self, start_ids_batch: List[List[List[int]]], rules: List[SoundChangeAction], num_threads: int = 1):
+        """Apply the whole cascade of `rules` to many vocabularies at once. See `PyEnv.apply_rules`."""
+        return super().apply_rules(start_ids_batch, self._pack_actions(rules), num_threads)
+
     def get_state_edit_dist(self, state1: VocabState, state2: VocabState) -> float:
         return super().get_state_edit_dist(state1, state2)
 
@@ -111,3 +120,6 @@ class SoundChangeEnv(PyEnv):
                                         action.d_pre_id,
                                         action.post_id,
                                         action.d_post_id)
+
+    def get_num_affected_batch(self, state: VocabState, actions: List[SoundChangeAction]) -> np.ndarray:
+        return super().get_num_affected_batch(state, self._pack_actions(actions))
@@ -13,14 +13,15 @@ from dev_misc import LT, NDA, add_argument, g, get_tensor, get_zeros
 from dev_misc.devlib.named_tensor import NoName
 from dev_misc.trainlib import Tracker
 from dev_misc.utils import ScopedCache, pad_for_log
+from sound_law.data.alphabet import PAD_ID
 from sound_law.rl.action import SoundChangeAction
 from sound_law.rl.agent import AgentInputs, AgentOutputs, BasePG
 from sound_law.rl.env import SoundChangeEnv
 from sound_law.rl.trajectory import Trajectory, VocabState
 
 # pylint: disable=no-name-in-module
-from .mcts_cpp import (PyMcts, PyPS_MAX, PyPS_SAMPLE_AC,
-                       parallel_stack_ids)
+from .mcts_cpp import (PyEpisodeRunner, PyEvaluationCache, PyMcts, PyPS_MAX,
+                       PyPS_SAMPLE_AC, PySearchController, PyStateBatcher)
 
 # pylint: enable=no-name-in-module
 
@@ -43,70 +44,195 @@ class Mcts(PyMcts):
     add_argument('play_strategy', default='max', dtype=str,
                  choices=['max', 'sample_ac', 'sample_mv'], msg='Play strategy.')
     add_argument('exponent', default=1.0, dtype=float, msg='The exponent for sample_ac play strategy.')
+    add_argument('retain_subtree', default=False, dtype=bool,
+                 msg='Flag to keep the subtree of the played action across moves and evict its siblings. Visits already in the subtree count towards `num_mcts_sims`.')
+    add_argument('root_parallel', default=False, dtype=bool,
+                 msg='Flag to search with one private stats overlay per worker (merged before playing) instead of sharing stats with virtual losses.')
+    add_argument('search_time_budget', default=0.0, dtype=float,
+                 msg='Stop searching for a move after this many seconds. Disabled if not positive.')
+    add_argument('search_stable_batches', default=0, dtype=int,
+                 msg='Stop searching for a move once the most visited root action stays the same for this many batches. Disabled if zero.')
+    add_argument('search_kl_threshold', default=0.0, dtype=float,
+                 msg='Stop searching for a move once the KL divergence between root visit distributions of consecutive batches is below this. Disabled if not positive.')
+    add_argument('search_min_sims', default=0, dtype=int,
+                 msg='Minimum number of simulations per move before any early stopping criterion applies.')
+    add_argument('num_lockstep_episodes', default=1, dtype=int,
+                 msg='Number of episodes to step in lockstep so that their leaves are evaluated in one batch.')
+    add_argument('native_episodes', default=False, dtype=bool,
+                 msg='Flag to run whole episodes in C++, calling back into Python only for evaluation.')
+    add_argument('eval_cache_size', default=0, dtype=int,
+                 msg='Number of evaluated states whose priors and values are cached across episodes. Disabled if zero.')
+    add_argument('pipeline_evaluation', default=False, dtype=bool,
+                 msg='Flag to select the next batch in the background while the current batch is being evaluated.')
 
     def __init__(self, *args, agent: BasePG = None, **kwargs):
         self.agent = agent
+        # Ids and alignments are packed as int16 to cut the host-to-device transfer per batch.
+        self.batch_dtype = 'int16' if len(self.env.abc) <= np.iinfo(np.int16).max else 'int32'
+        self.state_batcher = PyStateBatcher(g.num_workers, PAD_ID, self.env.max_end_length)
+        self.eval_cache = None
+        if g.eval_cache_size > 0:
+            self.eval_cache = PyEvaluationCache(g.eval_cache_size, len(self.env.abc), g.use_finite_horizon)
         if g.play_strategy == 'max':
             self.play_strategy = PyPS_MAX
         else:
             self.play_strategy = PyPS_SAMPLE_AC
 
     def reset(self):
-        # Clear priors first and then stats -- stats are needed to speed up clearing.
-        self.env.clear_priors(self.env.start, True)
-        self.env.clear_stats(self.env.start, True)
+        # Stats and priors are cleared lazily. Use `env.clear_priors` and `env.clear_stats` to clear them eagerly.
+        self.env.new_epoch()
         logging.debug(f'#trie nodes {self.env.evict(500000)}')
+        if self.eval_cache is not None:
+            logging.debug(f'#eval cache entries {self.eval_cache.size}, hit rate {self.eval_cache.hit_rate:.3f}')
+
+    def clear_eval_cache(self):
+        """Drop all cached evaluations. This should be called whenever the weights of the agent change."""
+        if self.eval_cache is not None:
+            self.eval_cache.clear()
 
     def evaluate(self, states, steps: Optional[Union[int, LT]] = None) -> List[float]:
         """Expand and evaluate the leaf node."""
+        values, outstanding_states, meta_priors, special_priors = self._run_agent(states, steps=steps)
+        # NOTE(j_luo) Duplicate states (due to exploration collapse) or visited states (due to rollout truncation) are skipped.
+        # All evaluated states share one block of priors.
+        self.evaluate_batch(outstanding_states,
+                            np.ascontiguousarray(meta_priors, dtype='float32'),
+                            np.ascontiguousarray(special_priors, dtype='float32'))
+        return values
+
+    def _run_agent(self, states, steps: Optional[Union[int, LT]] = None):
+        """Run the agent on `states` without touching the tree. Return the values for all states, and the states that
+        need evaluation together with their meta and special priors."""
         values = [None] * len(states)
         outstanding_idx = list()
         outstanding_states = list()
+        # Map every state that needs the agent to its row among `outstanding_states`.
+        state2row = dict()
+        rows = list()
+        per_state_steps = steps is not None and not isinstance(steps, int)
         # Deal with end states first.
         for i, state in enumerate(states):
             if state.stopped or state.done:
                 # NOTE(j_luo) This value is used for backup. If already reaching the end state, the final reward is either accounted for by the step reward, or by the value network. Therefore, we need to set it to 0.0 here.
                 values[i] = 0.0
             else:
-                outstanding_idx.append(i)
-                outstanding_states.append(state)
+                # Duplicate states (with the same step) are only run once.
+                key = (state.node_id, steps[i].item() if per_state_steps else None)
+                if key not in state2row:
+                    state2row[key] = len(outstanding_states)
+                    outstanding_idx.append(i)
+                    outstanding_states.append(state)
+                rows.append((i, state2row[key]))
 
+        num_abc = len(self.env.abc)
+        meta_priors = np.zeros([0, 6, num_abc], dtype='float32')
+        special_priors = np.zeros([0, 6], dtype='float32')
         # Collect states that need evaluation.
         if outstanding_states:
-            almts1 = almts2 = None
-            if g.use_alignment:
-                id_seqs, almts1, almts2 = parallel_stack_ids(
-                    outstanding_states, g.num_workers, True, self.env.max_end_length)
-                almts1 = get_tensor(almts1).rename('batch', 'word', 'pos')
-                almts2 = get_tensor(almts2).rename('batch', 'word', 'pos')
-            else:
-                id_seqs = parallel_stack_ids(outstanding_states, g.num_workers, False, self.env.max_end_length)
-            id_seqs = get_tensor(id_seqs).rename('batch', 'word', 'pos')
-            if steps is not None and not isinstance(steps, int):
+            if per_state_steps:
                 steps = steps[outstanding_idx]
+            meta_priors, special_priors, agent_values = self._evaluate_states(outstanding_states, steps)
 
-            # TODO(j_luo) Scoped might be wrong here.
-            # with ScopedCache('state_repr'):
-            # NOTE(j_luo) Don't forget to call exp().
-            priors = self.agent.get_policy(id_seqs, almts=(almts1, almts2)).exp()
-            with NoName(priors):
-                meta_priors = priors[:, [0, 2, 3, 4, 5, 6]].cpu().numpy()
-                special_priors = priors[:, 1].cpu().numpy()
-            if g.use_value_guidance:
-                agent_values = self.agent.get_values(id_seqs, steps=steps).cpu().numpy()
-            else:
-                agent_values = np.zeros([len(id_seqs)], dtype='float32')
-
-            for i, state, mp, sp, v in zip(outstanding_idx, outstanding_states, meta_priors, special_priors, agent_values):
+            for i, row in rows:
                 # NOTE(j_luo) Values should be returned even if states are duplicates or have been visited.
-                values[i] = v
-                # NOTE(j_luo) Skip duplicate states (due to exploration collapse) or visited states (due to rollout truncation).
-                if not state.is_leaf():
-                    continue
+                values[i] = agent_values[row]
+        return values, outstanding_states, meta_priors, special_priors
 
-                # print(mp[1, 111])
-                self.env.evaluate(state, mp, sp)
-        return values
+    def _evaluate_states(self, states, steps):
+        """Run the agent on `states`, or read their outputs from the evaluation cache if possible. Return meta priors,
+        special priors and values as numpy arrays."""
+        if self.eval_cache is None:
+            return self._evaluate_packed(*self._stack_ids(states), steps)
+
+        n = len(states)
+        if steps is None:
+            cache_steps = np.full([n], -1, dtype='long')
+        elif isinstance(steps, int):
+            cache_steps = np.full([n], steps, dtype='long')
+        else:
+            cache_steps = np.ascontiguousarray(steps.cpu().numpy(), dtype='long')
+        found, meta_priors, special_priors, values = self.eval_cache.lookup(states, cache_steps)
+        missing = np.where(~found)[0]
+        if len(missing) > 0:
+            missing_states = [states[i] for i in missing]
+            missing_steps = steps
+            if steps is not None and not isinstance(steps, int):
+                missing_steps = steps[missing.tolist()]
+            mp, sp, v = self._evaluate_packed(*self._stack_ids(missing_states), missing_steps)
+            mp = np.ascontiguousarray(mp, dtype='float32')
+            sp = np.ascontiguousarray(sp, dtype='float32')
+            v = np.ascontiguousarray(v, dtype='float32')
+            self.eval_cache.insert(missing_states, cache_steps[missing], mp, sp, v)
+            meta_priors[missing] = mp
+            special_priors[missing] = sp
+            values[missing] = v
+        return meta_priors, special_priors, values
+
+    def _stack_ids(self, states) -> Tuple[NDA, Optional[NDA], Optional[NDA]]:
+        if g.use_alignment:
+            return self.state_batcher.stack(states, True, self.batch_dtype)
+        id_seqs = self.state_batcher.stack(states, False, self.batch_dtype)
+        return id_seqs, None, None
+
+    def _evaluate_packed(self, id_seqs: NDA, almts1: Optional[NDA], almts2: Optional[NDA], steps):
+        """Run the agent on packed states. Return meta priors, special priors and values as numpy arrays."""
+        # Packed arrays are narrow integers, and are only widened after being moved to the device.
+        if almts1 is not None:
+            almts1 = get_tensor(almts1).long().rename('batch', 'word', 'pos')
+            almts2 = get_tensor(almts2).long().rename('batch', 'word', 'pos')
+        id_seqs = get_tensor(id_seqs).long().rename('batch', 'word', 'pos')
+
+        # TODO(j_luo) Scoped might be wrong here.
+        # with ScopedCache('state_repr'):
+        # NOTE(j_luo) Don't forget to call exp().
+        priors = self.agent.get_policy(id_seqs, almts=(almts1, almts2)).exp()
+        with NoName(priors):
+            meta_priors = priors[:, [0, 2, 3, 4, 5, 6]].cpu().numpy()
+            special_priors = priors[:, 1].cpu().numpy()
+        if g.use_value_guidance:
+            agent_values = self.agent.get_values(id_seqs, steps=steps).cpu().numpy()
+        else:
+            agent_values = np.zeros([len(id_seqs)], dtype='float32')
+        return meta_priors, special_priors, agent_values
+
+    def _evaluate_native(self, id_seqs: NDA, almts1: Optional[NDA], almts2: Optional[NDA], steps: NDA):
+        """Evaluation callback for `PyEpisodeRunner`."""
+        steps = get_tensor(steps) if g.use_finite_horizon else None
+        return self._evaluate_packed(id_seqs, almts1, almts2, steps)
+
+    def _collect_native_episodes(self, init_state: VocabState,
+                                 tracker: Optional[Tracker] = None,
+                                 num_episodes: int = 0,
+                                 is_eval: bool = False) -> List[Trajectory]:
+        """Collect episodes with `PyEpisodeRunner`, which runs the whole loop in C++ and only calls back for evaluation."""
+        if g.pipeline_evaluation:
+            raise ValueError(f'Cannot use `pipeline_evaluation` with native episodes.')
+        if g.retain_subtree:
+            raise ValueError(f'Cannot use `retain_subtree` with native episodes since every move runs all simulations.')
+        if g.search_time_budget > 0.0 or g.search_stable_batches > 0 or g.search_kl_threshold > 0.0:
+            raise ValueError(f'Cannot stop the search early with native episodes.')
+        if g.num_lockstep_episodes > 1:
+            raise ValueError(f'Cannot use `num_lockstep_episodes` with native episodes.')
+        ps = PyPS_MAX if is_eval else self.play_strategy
+        runner = PyEpisodeRunner(self, self._evaluate_native, g.num_mcts_sims, g.expansion_batch_size,
+                                 g.max_rollout_length, ps, g.exponent, not is_eval, g.dirichlet_alpha, g.noise_ratio,
+                                 len(self.env.abc), g.use_alignment, self.env.max_end_length, g.random_seed)
+        if self.eval_cache is not None:
+            runner.set_cache(self.eval_cache)
+        trajectories = list()
+        for ei in range(num_episodes):
+            self.reset()
+            played_path = runner.run(init_state)
+            trajectory = Trajectory(played_path, self.env.max_end_length)
+            if ei % g.episode_check_interval == 0:
+                logging.debug(pad_for_log(str(trajectory)))
+            trajectories.append(trajectory)
+            if tracker is not None:
+                num_steps = len(trajectory)
+                tracker.update('mcts', incr=g.num_mcts_sims // g.expansion_batch_size * g.expansion_batch_size * num_steps)
+                tracker.update('rollout', incr=num_steps)
+                tracker.update('episode')
+        return trajectories
 
     def add_noise(self, state: VocabState):
         """Add Dirichlet noise to `state`, usually the root."""
@@ -116,6 +242,138 @@ class Mcts(PyMcts):
         special_noise = noise[6, :6]
         self.env.add_noise(state, meta_noise, special_noise, g.noise_ratio)
 
+    def _get_search_controller(self, root: VocabState) -> Optional[PySearchController]:
+        """Return a controller that stops the search for this move early, or None if no stopping criterion is used."""
+        if g.search_time_budget > 0.0 or g.search_stable_batches > 0 or g.search_kl_threshold > 0.0:
+            return PySearchController(root,
+                                      time_budget=g.search_time_budget,
+                                      num_stable_batches=g.search_stable_batches,
+                                      kl_threshold=g.search_kl_threshold,
+                                      min_sims=g.search_min_sims)
+        return None
+
+    def _simulate(self, root: VocabState, num_batches: int, depth: int, played_path,
+                  tracker: Optional[Tracker] = None) -> int:
+        """Run at most `num_batches` batches of simulations. Return the number of simulations used."""
+        controller = self._get_search_controller(root)
+        num_sims = 0
+        for _ in range(num_batches):
+            paths, steps = self.select(root, g.expansion_batch_size, depth, g.max_rollout_length, played_path)
+            steps = get_tensor(steps) if g.use_finite_horizon else None
+            new_states = [path.get_last_node() for path in paths]
+            values = self.evaluate(new_states, steps=steps)
+            self.backup(paths, values)
+            num_sims += len(paths)
+            if tracker is not None:
+                tracker.update('mcts', incr=g.expansion_batch_size)
+            if controller is not None:
+                if g.root_parallel:
+                    self.merge_overlays()
+                if controller.update(len(paths)):
+                    break
+        return num_sims
+
+    def _pipelined_simulate(self, root: VocabState, num_batches: int, depth: int, played_path,
+                            tracker: Optional[Tracker] = None) -> int:
+        """Run at most `num_batches` batches of simulations, selecting batch i + 1 in the background while batch i is
+        being evaluated by the agent. Priors and values are applied by `complete`, which never overlaps with selection.
+        Return the number of simulations used."""
+        if num_batches == 0:
+            return 0
+        controller = self._get_search_controller(root)
+        num_sims = 0
+        stop = False
+        self.submit(root, g.expansion_batch_size, depth, g.max_rollout_length, played_path)
+        for bi in range(num_batches):
+            paths, steps = self.retrieve()
+            if bi + 1 < num_batches and not stop:
+                self.submit(root, g.expansion_batch_size, depth, g.max_rollout_length, played_path)
+            steps = get_tensor(steps) if g.use_finite_horizon else None
+            new_states = [path.get_last_node() for path in paths]
+            values, outstanding_states, meta_priors, special_priors = self._run_agent(new_states, steps=steps)
+            self.complete(outstanding_states,
+                          np.ascontiguousarray(meta_priors),
+                          np.ascontiguousarray(special_priors),
+                          values)
+            num_sims += len(paths)
+            if tracker is not None:
+                tracker.update('mcts', incr=g.expansion_batch_size)
+            if controller is not None:
+                if g.root_parallel:
+                    self.merge_overlays()
+                stop = controller.update(len(paths)) or stop
+            # A batch that is already in flight has to be completed to remove its virtual losses.
+            if stop and self.num_pending == 0:
+                break
+        return num_sims
+
+    def _collect_lockstep_episodes(self, init_state: VocabState,
+                                   tracker: Optional[Tracker] = None,
+                                   num_episodes: int = 0,
+                                   is_eval: bool = False) -> List[Trajectory]:
+        """Collect episodes in groups of `num_lockstep_episodes`. Episodes in one group share the same `Env` (and
+        therefore evaluations and pruning) but have their own roots, played paths and stats. They are stepped in
+        lockstep, and all their leaves are evaluated in one batch. Episodes at the same root share one draw of noise."""
+        if g.retain_subtree:
+            raise ValueError(f'Cannot use `retain_subtree` with lockstep episodes since they share the same tree.')
+        if g.root_parallel:
+            raise ValueError(f'Cannot use `root_parallel` with lockstep episodes.')
+
+        trajectories = list()
+        for gi in range(0, num_episodes, g.num_lockstep_episodes):
+            k = min(g.num_lockstep_episodes, num_episodes - gi)
+            self.reset()
+            self.start_lockstep(k)
+            roots = [init_state] * k
+            played_paths = [None] * k
+            steps = 0 if g.use_finite_horizon else None
+            self.evaluate(roots[:1], steps=steps)
+            active = list(range(k))
+            for ri in range(g.max_rollout_length):
+                if not active:
+                    break
+                if not is_eval:
+                    # Noise is added to the priors of the node, so it is only added once per node.
+                    for root in {roots[i].node_id: roots[i] for i in active}.values():
+                        self.add_noise(root)
+                active_roots = [roots[i] for i in active]
+                active_paths = [played_paths[i] for i in active]
+                for _ in range(g.num_mcts_sims // g.expansion_batch_size):
+                    selected = self.select_lockstep(active_roots, g.expansion_batch_size, [ri] * len(active),
+                                                    g.max_rollout_length, active_paths, active)
+                    paths = [path for root_paths, _ in selected for path in root_paths]
+                    steps = np.concatenate([root_steps for _, root_steps in selected])
+                    steps = get_tensor(steps) if g.use_finite_horizon else None
+                    new_states = [path.get_last_node() for path in paths]
+                    values = self.evaluate(new_states, steps=steps)
+                    self.backup(paths, values)
+                    if tracker is not None:
+                        tracker.update('mcts', incr=g.expansion_batch_size * len(active))
+
+                ps = PyPS_MAX if is_eval else self.play_strategy
+                for i in active:
+                    new_path = self.play(roots[i], ri, ps, g.exponent, i)
+                    if played_paths[i] is None:
+                        played_paths[i] = new_path
+                    else:
+                        played_paths[i].merge(new_path)
+                    roots[i] = played_paths[i].get_last_node()
+                if tracker is not None:
+                    tracker.update('rollout', incr=len(active))
+                active = [i for i in active if not (roots[i].stopped or roots[i].done)]
+
+            for i, played_path in enumerate(played_paths):
+                ei = gi + i
+                # Trajectories read the shared stats.
+                self.store_episode_stats(i)
+                trajectory = Trajectory(played_path, self.env.max_end_length)
+                if ei % g.episode_check_interval == 0:
+                    logging.debug(pad_for_log(str(trajectory)))
+                trajectories.append(trajectory)
+                if tracker is not None:
+                    tracker.update('episode')
+        return trajectories
+
     def collect_episodes(self, init_state: VocabState,
                          tracker: Optional[Tracker] = None,
                          num_episodes: int = 0,
@@ -128,6 +386,14 @@ class Mcts(PyMcts):
         else:
             self.train()
         num_episodes = num_episodes or g.num_episodes
+        if g.native_episodes and not no_simulation:
+            with self.agent.policy_grad(False), self.agent.value_grad(False):
+                return self._collect_native_episodes(init_state, tracker=tracker, num_episodes=num_episodes,
+                                                     is_eval=is_eval)
+        if g.num_lockstep_episodes > 1 and not no_simulation:
+            with self.agent.policy_grad(False), self.agent.value_grad(False):
+                return self._collect_lockstep_episodes(init_state, tracker=tracker, num_episodes=num_episodes,
+                                                       is_eval=is_eval)
         # if no_simulation:
         #     breakpoint()  # BREAKPOINT(j_luo)
         with self.agent.policy_grad(False), self.agent.value_grad(False):
@@ -149,16 +415,16 @@ class Mcts(PyMcts):
                     else:
                         # Run many simulations before take one action. Simulations take place in batches. Each batch
                         # would be evaluated and expanded after batched selection.
-                        num_batches = g.num_mcts_sims // g.expansion_batch_size
-                        for _ in range(num_batches):
-                            paths, steps = self.select(root, g.expansion_batch_size, ri,
-                                                       g.max_rollout_length, played_path)
-                            steps = get_tensor(steps) if g.use_finite_horizon else None
-                            new_states = [path.get_last_node() for path in paths]
-                            values = self.evaluate(new_states, steps=steps)
-                            self.backup(paths, values)
-                            if tracker is not None:
-                                tracker.update('mcts', incr=g.expansion_batch_size)
+                        num_sims = g.num_mcts_sims
+                        if g.retain_subtree:
+                            # Reuse the visits from previous moves, but always run at least one batch.
+                            num_sims = max(g.expansion_batch_size, num_sims - root.visit_count)
+                        num_batches = num_sims // g.expansion_batch_size
+                        if g.pipeline_evaluation:
+                            num_sims = self._pipelined_simulate(root, num_batches, ri, played_path, tracker=tracker)
+                        else:
+                            num_sims = self._simulate(root, num_batches, ri, played_path, tracker=tracker)
+                        logging.debug(f'{num_sims} simulations used at step {ri}.')
                         if ri == 0 and ei % g.episode_check_interval == 0:
                             k = min(20, root.num_actions)
                             logging.debug(pad_for_log(str(get_tensor(root.action_counts).topk(k))))
@@ -3,6 +3,7 @@
 from libcpp.vector cimport vector
 from libcpp.pair cimport pair
 from libcpp cimport bool
+from libc.stdint cimport uint64_t, int16_t, int32_t
 
 cdef extern from "mcts_cpp/word.cpp": pass
 cdef extern from "mcts_cpp/action.cpp": pass
@@ -10,6 +11,10 @@ cdef extern from "mcts_cpp/env.cpp": pass
 cdef extern from "mcts_cpp/node.cpp": pass
 cdef extern from "mcts_cpp/mcts.cpp": pass
 cdef extern from "mcts_cpp/lru_cache.cpp": pass
+cdef extern from "mcts_cpp/episode.cpp": pass
+cdef extern from "mcts_cpp/eval_cache.cpp": pass
+cdef extern from "mcts_cpp/state_batcher.cpp": pass
+cdef extern from "mcts_cpp/beam.cpp": pass
 
 cdef extern from "mcts_cpp/ctpl.h": pass
 
@@ -89,9 +94,26 @@ cdef extern from "mcts_cpp/action.hpp":
         int site_threshold
         float dist_threshold
         size_t num_abc
+        bool defer_expansion
 
         ActionSpaceOpt()
 
+    cdef cppclass ActionVec nogil:
+        abc_t &operator[](size_t)
+
+    cdef cppclass Lookahead nogil:
+        vector[ActionVec] actions
+        vector[float] dists
+
+    cdef cppclass Rule nogil:
+        abc_t before_id
+        abc_t after_id
+        abc_t pre_id
+        abc_t d_pre_id
+        abc_t post_id
+        abc_t d_post_id
+        SpecialType st
+
     cdef cppclass ActionSpace nogil:
         ActionSpaceOpt opt
 
@@ -104,6 +126,11 @@ cdef extern from "mcts_cpp/env.hpp":
 
         EnvOpt()
 
+    cdef cppclass CascadeResult nogil:
+        VocabIdSeq ids
+        vector[float] dists
+        vector[bool] applied
+
     cdef cppclass Env nogil:
         Env(EnvOpt, ActionSpaceOpt, WordSpaceOpt)
 
@@ -112,20 +139,28 @@ cdef extern from "mcts_cpp/env.hpp":
         TreeNode *end
 
         size_t evict(size_t)
+        size_t evict_siblings(TreeNode *, TreeNode *)
+        vector[CascadeResult] apply_rules(vector[VocabIdSeq], vector[Rule], size_t) except +
+        void new_epoch()
         void register_permissible_change(abc_t, abc_t)
+        void ensure_expanded(TreeNode *)
         void evaluate(TreeNode *, vector[vector[float]], vector[float])
+        void evaluate(vector[TreeNode *], const float *, const float *, size_t)
         void register_cl_map(abc_t, abc_t)
         void register_gbj_map(abc_t, abc_t)
         void register_gbw_map(abc_t, abc_t)
         float get_edit_dist(IdSeq, IdSeq)
         TreeNode *apply_action(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType) except +
         int get_num_affected(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType) except +
+        vector[int] get_num_affected(TreeNode *, vector[Rule]) except +
         void clear_stats(TreeNode *, bool)
         void clear_priors(TreeNode *, bool)
         size_t get_num_words()
         void add_noise(TreeNode *, vector[vector[float]], vector[float], float)
         size_t get_max_end_length()
         vector[vector[abc_t]] expand_all_actions(TreeNode *)
+        vector[vector[ActionVec]] enumerate_actions(TreeNode *, vector[size_t], bool, size_t) except +
+        Lookahead get_lookahead(TreeNode *, size_t) except +
 
 cdef extern from "mcts_cpp/node.hpp":
 
@@ -187,12 +222,31 @@ cdef extern from "mcts_cpp/mcts.hpp":
         float virtual_loss
         int num_threads
         SelectionOpt selection_opt
+        uint64_t seed
+        bool retain_subtree
+        bool root_parallel
 
         MctsOpt()
 
+    cdef cppclass SearchControlOpt nogil:
+        float time_budget
+        int num_stable_batches
+        float kl_threshold
+        int min_sims
+
+        SearchControlOpt()
+
+    cdef cppclass SearchController nogil:
+        SearchController(TreeNode *, SearchControlOpt)
+
+        bool update(int)
+        int get_num_sims()
+        float get_elapsed()
+
     cdef cppclass Path nogil:
         Path()
         Path(Path)
+        Path(TreeNode *, int)
 
         int get_depth()
         vector[BNptr] get_all_nodes()
@@ -209,12 +263,108 @@ cdef extern from "mcts_cpp/mcts.hpp":
 
         vector[Path] select(TreeNode *, int, int, int)
         vector[Path] select(TreeNode *, int, int, int, Path)
+        void start_lockstep(size_t) except +
+        vector[vector[Path]] select_lockstep(vector[TNptr], int, vector[int], int, vector[Path], vector[int]) except +
+        void store_episode_stats(int) except +
         TreeNode * select_one_pi_step(TreeNode *)
         TreeNode * select_one_random_step(TreeNode *)
         void eval()
         void train()
         void backup(vector[Path], vector[float])
+        void evaluate(vector[TNptr], const float *, const float *, size_t)
         Path play(TreeNode *, int, PlayStrategy, float)
+        Path play(TreeNode *, int, PlayStrategy, float, int)
+        void submit(TreeNode *, int, int, int)
+        void submit(TreeNode *, int, int, int, Path)
+        vector[Path] retrieve()
+        void complete(vector[TNptr], const float *, const float *, size_t, vector[float])
+        size_t get_num_pending()
+        void merge_overlays()
+
+cdef extern from "mcts_cpp/eval_cache.hpp":
+    cdef cppclass EvaluationCache nogil:
+        EvaluationCache(size_t, size_t, bool)
+
+        size_t capacity
+        size_t num_abc
+        bool use_step
+
+        bool lookup(TreeNode *, int, float *, float *, float &)
+        void insert(TreeNode *, int, const float *, const float *, float)
+        void clear()
+        size_t size()
+        size_t get_num_hits()
+        size_t get_num_misses()
+
+cdef extern from "mcts_cpp/state_batcher.hpp":
+    cdef cppclass StateBatcher nogil:
+        StateBatcher(size_t, abc_t, size_t)
+
+        size_t max_end_length
+
+        size_t get_max_length(vector[TNptr])
+        void pack[T](vector[TNptr], size_t, T *, T *, T *)
+
+cdef extern from "mcts_cpp/beam.hpp":
+    cdef cppclass BeamSearchOpt nogil:
+        size_t beam_size
+        int num_threads
+
+    cdef cppclass Hypothesis nogil:
+        TreeNode *node
+        vector[ActionVec] actions
+
+    cdef cppclass BeamSearch nogil:
+        BeamSearchOpt opt
+
+        BeamSearch(Env *, BeamSearchOpt)
+
+        vector[Hypothesis] step(vector[Hypothesis]) except +
+        vector[Hypothesis] search(TreeNode *, int) except +
+
+cdef extern from "mcts_cpp/episode.hpp":
+    cdef cppclass EpisodeOpt nogil:
+        int num_sims
+        int batch_size
+        int max_rollout_length
+        PlayStrategy play_strategy
+        float exponent
+        bool add_noise
+        float dirichlet_alpha
+        float noise_ratio
+        size_t num_abc
+        abc_t pad_id
+        bool use_alignment
+        size_t max_end_length
+        uint64_t seed
+
+        EpisodeOpt()
+
+    cdef cppclass EvaluationBatch nogil:
+        size_t size
+        size_t num_words
+        size_t max_length
+        size_t max_end_length
+
+        vector[int16_t] ids
+        vector[int16_t] almts1
+        vector[int16_t] almts2
+        vector[long] steps
+
+        vector[float] meta_priors
+        vector[float] special_priors
+        vector[float] values
+
+        bool failed
+
+    ctypedef void (*EvaluateFn)(void *, EvaluationBatch &) noexcept
+
+    cdef cppclass EpisodeRunner nogil:
+        EpisodeRunner(Env *, Mcts *, EpisodeOpt) except +
+
+        void register_callback(EvaluateFn, void *)
+        void set_cache(EvaluationCache *)
+        Path run(TreeNode *) except +
 
 # Convertible types between numpy and c++ template.
 ctypedef fused convertible:
@@ -7,6 +7,7 @@ import numpy as np
 cimport numpy as np
 from cython.parallel import prange
 from cython.operator cimport dereference as deref, preincrement as inc
+from libc.string cimport memcpy
 cimport cython
 
 import sound_law.data.alphabet as alphabet
@@ -75,6 +76,15 @@ cdef class PyTreeNode:
     def dist(self) -> float:
         return self.ptr.get_dist()
 
+    @property
+    def node_id(self) -> int:
+        """Identity of the underlying node. Wrappers of the same node share the same id."""
+        return <size_t>self.ptr
+
+    @property
+    def visit_count(self) -> int:
+        return (<BaseNode *>self.ptr).get_visit_count()
+
     def is_leaf(self) -> bool:
         return self.ptr.is_leaf()
 
@@ -132,7 +142,7 @@ cdef class PyEnvOpt:
 cdef class PyActionSpaceOpt:
     cdef ActionSpaceOpt c_obj
 
-    def __cinit__(self, abc_t null_id, abc_t emp_id, abc_t sot_id, abc_t eot_id, abc_t any_id, abc_t any_s_id, abc_t any_uns_id, abc_t glide_j, abc_t glide_w, int site_threshold, float dist_threshold, size_t num_abc):
+    def __cinit__(self, abc_t null_id, abc_t emp_id, abc_t sot_id, abc_t eot_id, abc_t any_id, abc_t any_s_id, abc_t any_uns_id, abc_t glide_j, abc_t glide_w, int site_threshold, float dist_threshold, size_t num_abc, bool defer_expansion=False):
         self.c_obj = ActionSpaceOpt()
         self.c_obj.null_id = null_id
         self.c_obj.emp_id = emp_id
@@ -146,6 +156,7 @@ cdef class PyActionSpaceOpt:
         self.c_obj.site_threshold = site_threshold
         self.c_obj.dist_threshold = dist_threshold
         self.c_obj.num_abc = num_abc
+        self.c_obj.defer_expansion = defer_expansion
 
 cdef class PyWordSpaceOpt:
     cdef WordSpaceOpt c_obj
@@ -189,11 +200,17 @@ cdef class PyMctsOpt:
                   float heur_c,
                   bool add_noise,
                   bool use_num_misaligned,
-                  bool use_max_value):
+                  bool use_max_value,
+                  uint64_t seed = 0,
+                  bool retain_subtree = False,
+                  bool root_parallel = False):
         self.c_obj = MctsOpt()
         self.c_obj.game_count = game_count
         self.c_obj.virtual_loss = virtual_loss
         self.c_obj.num_threads = num_threads
+        self.c_obj.seed = seed
+        self.c_obj.retain_subtree = retain_subtree
+        self.c_obj.root_parallel = root_parallel
 
         cdef SelectionOpt sel_obj = SelectionOpt()
         sel_obj.puct_c = puct_c
@@ -219,6 +236,36 @@ cdef SpecialType to_special_type(rtype: str):
         st = GBW
     return st
 
+cdef vector[Rule] pack_rules(rules):
+    """Convert tuples of (before_id, after_id, rtype, pre_id, d_pre_id, post_id, d_post_id) into rules."""
+    cdef vector[Rule] c_rules = vector[Rule]()
+    cdef Rule rule
+    for before_id, after_id, rtype, pre_id, d_pre_id, post_id, d_post_id in rules:
+        rule.before_id = before_id
+        rule.after_id = after_id
+        rule.pre_id = pre_id
+        rule.d_pre_id = d_pre_id
+        rule.post_id = post_id
+        rule.d_post_id = d_post_id
+        rule.st = to_special_type(rtype)
+        c_rules.push_back(rule)
+    return c_rules
+
+cdef vector[TNptr] get_batch_ptrs(py_nodes, const float[:, :, ::1] meta_priors, const float[:, ::1] special_priors):
+    """Return the pointers of `py_nodes`, checking first that their priors are of shape [n, 6, num_abc] and [n, 6]."""
+    cdef size_t n = len(py_nodes)
+    if meta_priors.shape[0] != n or meta_priors.shape[1] != 6:
+        raise ValueError(f'Expected meta priors of shape [{n}, 6, num_abc], but got '
+                         f'{(meta_priors.shape[0], meta_priors.shape[1], meta_priors.shape[2])}.')
+    if special_priors.shape[0] != n or special_priors.shape[1] != 6:
+        raise ValueError(f'Expected special priors of shape [{n}, 6], but got '
+                         f'{(special_priors.shape[0], special_priors.shape[1])}.')
+    cdef vector[TNptr] nodes = vector[TNptr]()
+    cdef size_t i
+    for i in range(n):
+        nodes.push_back(get_ptr(py_nodes[i]))
+    return nodes
+
 cdef class PyEnv:
     cdef Env *ptr
 
@@ -259,7 +306,10 @@ cdef class PyEnv:
                      abc_t post_id,
                      abc_t d_post_id):
         cdef SpecialType st = to_special_type(rtype)
-        cdef TreeNode *new_node = self.ptr.apply_action(py_node.ptr, before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st)
+        cdef TreeNode *node = py_node.ptr
+        cdef TreeNode *new_node
+        with nogil:
+            new_node = self.ptr.apply_action(node, before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st)
         tnode_cls = type(self).tnode_cls
         return wrap_node(tnode_cls, new_node)
 
@@ -275,9 +325,49 @@ cdef class PyEnv:
         cdef SpecialType st = to_special_type(rtype)
         return self.ptr.get_num_affected(py_node.ptr, before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st)
 
+    def get_num_affected_batch(self, PyTreeNode py_node, rules):
+        """Count the sites affected by every rule (see `apply_rules` for the format). Nothing is added to the tree."""
+        cdef vector[Rule] c_rules = pack_rules(rules)
+        cdef TreeNode *node = py_node.ptr
+        cdef vector[int] counts
+        with nogil:
+            counts = self.ptr.get_num_affected(node, c_rules)
+        return np.asarray(counts, dtype='long')
+
+    def apply_rules(self, start_ids_batch, rules, size_t num_threads=1):
+        """Apply the cascade `rules` to every vocabulary in `start_ids_batch` (a list of lists of id sequences), in
+        parallel across vocabularies. Every rule is a tuple of (before_id, after_id, rtype, pre_id, d_pre_id, post_id,
+        d_post_id). Rules that do not affect any site are skipped.
+
+        Return the final id sequences of every vocabulary, distances [n, num_rules + 1] (before any rule and after
+        every rule) and whether every rule has been applied [n, num_rules]."""
+        cdef vector[VocabIdSeq] c_start_ids = start_ids_batch
+        cdef vector[Rule] c_rules = pack_rules(rules)
+        cdef vector[CascadeResult] results
+        with nogil:
+            results = self.ptr.apply_rules(c_start_ids, c_rules, num_threads)
+
+        cdef size_t n = results.size()
+        cdef size_t m = c_rules.size()
+        dists = np.zeros([n, m + 1], dtype='float32')
+        applied = np.zeros([n, m], dtype='bool')
+        cdef float[:, ::1] dists_view = dists
+        cdef size_t i, j
+        final_ids = list()
+        for i in range(n):
+            final_ids.append(results[i].ids)
+            for j in range(m + 1):
+                dists_view[i, j] = results[i].dists[j]
+            for j in range(m):
+                applied[i, j] = results[i].applied[j]
+        return final_ids, dists, applied
+
     def evict(self, size_t until_size):
         return self.ptr.evict(until_size)
 
+    def evict_siblings(self, PyTreeNode old_root, PyTreeNode new_root):
+        return self.ptr.evict_siblings(old_root.ptr, new_root.ptr)
+
     def register_permissible_change(self, abc_t unit1, abc_t unit2):
         self.ptr.register_permissible_change(unit1, unit2)
 
@@ -296,15 +386,34 @@ cdef class PyEnv:
     def clear_priors(self, PyTreeNode py_node, bool recursive):
         self.ptr.clear_priors(py_node.ptr, recursive)
 
+    def new_epoch(self):
+        self.ptr.new_epoch()
+
     @property
     def num_words(self) -> int:
         return self.ptr.get_num_words()
 
+    def ensure_expanded(self, PyTreeNode py_node):
+        """Expand a node whose expansion might have been deferred. This is needed before reading its actions."""
+        cdef TreeNode *node = py_node.ptr
+        with nogil:
+            self.ptr.ensure_expanded(node)
+
     def evaluate(self, PyTreeNode py_node, float[:, ::1] np_meta_priors, float[::1] np_special_priors):
         cdef long[::1] lengths = np.full([6], np_meta_priors.shape[1], dtype='long')
         cdef vector[vector[float]] meta_priors = np2nested(np_meta_priors, lengths)
         cdef vector[float] special_priors = np2vector(np_special_priors)
-        self.ptr.evaluate(py_node.ptr, meta_priors, special_priors)
+        cdef TreeNode *node = py_node.ptr
+        with nogil:
+            self.ptr.evaluate(node, meta_priors, special_priors)
+
+    def evaluate_batch(self, py_nodes, const float[:, :, ::1] meta_priors, const float[:, ::1] special_priors):
+        """Evaluate all nodes that are still leaves. Priors are stored once for the whole batch and shared by the nodes."""
+        cdef vector[TNptr] nodes = get_batch_ptrs(py_nodes, meta_priors, special_priors)
+        if nodes.size() == 0:
+            return
+        with nogil:
+            self.ptr.evaluate(nodes, &meta_priors[0, 0, 0], &special_priors[0, 0], meta_priors.shape[2])
 
     def add_noise(self, PyTreeNode py_tnode, float[:, ::1] meta_noise, float[::1] special_noise, float noise_ratio):
         cdef long[::1] lengths = np.full([6], meta_noise.shape[1], dtype='long')
@@ -315,7 +424,56 @@ cdef class PyEnv:
         return self.ptr.get_max_end_length()
 
     def expand_all_actions(self, PyTreeNode py_tnode):
-        return self.ptr.expand_all_actions(py_tnode.ptr)
+        cdef TreeNode *node = py_tnode.ptr
+        cdef vector[vector[abc_t]] actions
+        with nogil:
+            actions = self.ptr.expand_all_actions(node)
+        return actions
+
+    def iter_all_actions(self, PyTreeNode py_tnode, bool materialize=False, size_t num_threads=1):
+        """Generate the actions of `expand_all_actions` (in the same order) as arrays of [k, 7], one for every root
+        action. `num_threads` root actions are enumerated at a time in parallel (on threads kept by the environment across
+        chunks), so only their actions are held in memory. Unless `materialize`, no mini node is added to the tree."""
+        cdef TreeNode *node = py_tnode.ptr
+        with nogil:
+            self.ptr.ensure_expanded(node)
+        num_threads = max(num_threads, 1)
+        cdef size_t num_roots = node.get_num_actions()
+        cdef vector[size_t] indices
+        cdef vector[vector[ActionVec]] chunk
+        cdef abc_t[:, ::1] arr
+        cdef size_t start, i, j, k
+        for start in range(0, num_roots, num_threads):
+            indices.clear()
+            for i in range(start, min(start + num_threads, num_roots)):
+                indices.push_back(i)
+            with nogil:
+                chunk = self.ptr.enumerate_actions(node, indices, materialize, num_threads)
+            for i in range(chunk.size()):
+                arr = np.zeros([chunk[i].size(), 7], dtype='uint16')
+                for j in range(chunk[i].size()):
+                    for k in range(7):
+                        arr[j, k] = chunk[i][j][k]
+                yield np.asarray(arr)
+
+    def get_lookahead(self, PyTreeNode py_tnode, size_t num_threads=1):
+        """Return every complete action (in the order of `expand_all_actions`) as an array of [k, 7], and the distance
+        of the state it leads to as an array of [k]. No node is created."""
+        cdef TreeNode *node = py_tnode.ptr
+        cdef Lookahead lookahead
+        with nogil:
+            lookahead = self.ptr.get_lookahead(node, num_threads)
+        cdef size_t n = lookahead.actions.size()
+        actions = np.zeros([n, 7], dtype='uint16')
+        dists = np.zeros([n], dtype='float32')
+        cdef abc_t[:, ::1] actions_view = actions
+        cdef float[::1] dists_view = dists
+        cdef size_t i, k
+        for i in range(n):
+            for k in range(7):
+                actions_view[i, k] = lookahead.actions[i][k]
+            dists_view[i] = lookahead.dists[i]
+        return actions, dists
 
 cdef inline TreeNode *get_ptr(PyTreeNode py_node):
     return py_node.ptr
@@ -350,6 +508,15 @@ cdef class PyPath:
     cdef Path get_c_obj(PyPath py_path):
         return deref(py_path.ptr)
 
+cdef object wrap_paths(vector[Path] paths_vec, tnode_cls):
+    cdef vector[int] steps_vec = vector[int](paths_vec.size())
+    paths = []
+    for i in range(paths_vec.size()):
+        steps_vec[i] = paths_vec[i].get_depth()
+        paths.append(PyPath.from_c_obj(paths_vec[i], tnode_cls))
+    steps = np.asarray(steps_vec, dtype='long')
+    return paths, steps
+
 cdef class PyMcts:
     cdef Mcts *ptr
 
@@ -364,17 +531,87 @@ cdef class PyMcts:
 
     def select(self, PyTreeNode py_tnode, int num_sims, int start_depth, int depth_limit, PyPath old_path = None):
         cdef vector[Path] paths_vec
+        cdef TreeNode *node = py_tnode.ptr
+        cdef Path *old = NULL
+        if old_path is not None:
+            old = old_path.ptr
+        with nogil:
+            if old == NULL:
+                paths_vec = self.ptr.select(node, num_sims, start_depth, depth_limit)
+            else:
+                paths_vec = self.ptr.select(node, num_sims, start_depth, depth_limit, deref(old))
+        return wrap_paths(paths_vec, type(py_tnode))
+
+    def start_lockstep(self, size_t num_episodes):
+        """Start a group of `num_episodes` lockstep episodes, each with its own stats. Call it after `reset`."""
+        self.ptr.start_lockstep(num_episodes)
+
+    def select_lockstep(self, py_roots, int num_sims, vector[int] start_depths, int depth_limit, py_old_paths,
+                        vector[int] episode_ids):
+        """Select `num_sims` paths for each root in one dispatch, with the stats of the episode given by `episode_ids`.
+        `py_old_paths` can contain None for roots at depth 0. Return a list of (paths, steps), one per root."""
+        cdef size_t n = len(py_roots)
+        cdef vector[TNptr] roots = vector[TNptr]()
+        cdef vector[Path] old_paths = vector[Path]()
+        cdef size_t i
+        for i in range(n):
+            roots.push_back(get_ptr(py_roots[i]))
+            if py_old_paths[i] is None:
+                old_paths.push_back(Path(roots[i], 0))
+            else:
+                old_paths.push_back(PyPath.get_c_obj(py_old_paths[i]))
+        cdef vector[vector[Path]] paths_vec
+        with nogil:
+            paths_vec = self.ptr.select_lockstep(roots, num_sims, start_depths, depth_limit, old_paths, episode_ids)
+        return [wrap_paths(paths_vec[i], type(py_roots[i])) for i in range(n)]
+
+    def store_episode_stats(self, int episode_id):
+        """Overwrite the shared stats with the stats of one lockstep episode, e.g., to gather its trajectory."""
+        self.ptr.store_episode_stats(episode_id)
+
+    def submit(self, PyTreeNode py_tnode, int num_sims, int start_depth, int depth_limit, PyPath old_path = None):
+        """Start selecting a batch in the background. Use `retrieve` to get it, and `complete` to finish it."""
         if old_path is None:
-            paths_vec = self.ptr.select(py_tnode.ptr, num_sims, start_depth, depth_limit)
+            self.ptr.submit(py_tnode.ptr, num_sims, start_depth, depth_limit)
         else:
-            paths_vec = self.ptr.select(py_tnode.ptr, num_sims, start_depth, depth_limit, deref(old_path.ptr))
-        cdef vector[int] steps_vec = vector[int](paths_vec.size())
-        paths = []
-        for i in range(paths_vec.size()):
-            steps_vec[i] = paths_vec[i].get_depth()
-            paths.append(PyPath.from_c_obj(paths_vec[i], type(py_tnode)))
-        steps = np.asarray(steps_vec, dtype='long')
-        return paths, steps
+            self.ptr.submit(py_tnode.ptr, num_sims, start_depth, depth_limit, deref(old_path.ptr))
+
+    def retrieve(self):
+        """Return the paths and steps of the oldest batch that has not been completed."""
+        cdef vector[Path] paths_vec
+        with nogil:
+            paths_vec = self.ptr.retrieve()
+        return wrap_paths(paths_vec, type(self.env).tnode_cls)
+
+    def evaluate_batch(self, py_nodes, const float[:, :, ::1] meta_priors, const float[:, ::1] special_priors):
+        """Evaluate `py_nodes` with meta priors of shape [B, 6, V] and special priors of shape [B, 6]. Non-leaves and
+        duplicates are skipped, and the rest are evaluated in parallel."""
+        cdef vector[TNptr] nodes = get_batch_ptrs(py_nodes, meta_priors, special_priors)
+        if nodes.size() == 0:
+            return
+        with nogil:
+            self.ptr.evaluate(nodes, &meta_priors[0, 0, 0], &special_priors[0, 0], meta_priors.shape[2])
+
+    def complete(self, py_nodes, const float[:, :, ::1] meta_priors, const float[:, ::1] special_priors,
+                 vector[float] values):
+        """Evaluate `py_nodes` with their priors and back up `values` for the oldest batch."""
+        cdef vector[TNptr] nodes = get_batch_ptrs(py_nodes, meta_priors, special_priors)
+        cdef const float *mp = NULL
+        cdef const float *sp = NULL
+        if nodes.size() > 0:
+            mp = &meta_priors[0, 0, 0]
+            sp = &special_priors[0, 0]
+        with nogil:
+            self.ptr.complete(nodes, mp, sp, meta_priors.shape[2], values)
+
+    @property
+    def num_pending(self) -> int:
+        return self.ptr.get_num_pending()
+
+    def merge_overlays(self):
+        """Fold the stats overlays of root-parallel workers into the shared stats. This is done by `play` already."""
+        with nogil:
+            self.ptr.merge_overlays()
 
     def select_one_pi_step(self, PyTreeNode py_tnode):
         return wrap_node(type(py_tnode), self.ptr.select_one_pi_step(py_tnode.ptr))
@@ -392,10 +629,14 @@ cdef class PyMcts:
         cdef vector[Path] paths = vector[Path]()
         for py_p in py_paths:
             paths.push_back(PyPath.get_c_obj(py_p))
-        self.ptr.backup(paths, values)
+        with nogil:
+            self.ptr.backup(paths, values)
 
-    def play(self, PyTreeNode py_tnode, int start_depth, int play_strategy, float exponent):
+    def play(self, PyTreeNode py_tnode, int start_depth, int play_strategy, float exponent, int episode_id = -1):
+        """Play one step from `py_tnode`. Lockstep episodes play with their own stats given by `episode_id`."""
         cdef PlayStrategy ps
+        cdef TreeNode *node = py_tnode.ptr
+        cdef Path path
         if play_strategy == PyPS_MAX:
             ps = MAX
         elif play_strategy == PyPS_SAMPLE_AC:
@@ -403,7 +644,12 @@ cdef class PyMcts:
         elif play_strategy == PyPS_SAMPLE_MV:
             ps = SAMPLE_MV
 
-        return PyPath.from_c_obj(self.ptr.play(py_tnode.ptr, start_depth, ps, exponent), type(py_tnode))
+        with nogil:
+            if episode_id < 0:
+                path = self.ptr.play(node, start_depth, ps, exponent)
+            else:
+                path = self.ptr.play(node, start_depth, ps, exponent, episode_id)
+        return PyPath.from_c_obj(path, type(py_tnode))
         # cdef FullActionPath full_action = self.ptr.play(py_tnode.ptr)
         # return wrap_node(type(py_tnode), full_action.first.first), full_action.first.second, full_action.second
 
@@ -419,6 +665,339 @@ cdef class PyMcts:
     # def set_logging_options(self, int verbose_level, bool log_to_file):
     #     self.ptr.set_logging_options(verbose_level, log_to_file)
 
+cdef class PySearchController:
+    """Decide when to stop searching for one move, based on a time budget and/or the convergence of the root."""
+    cdef SearchController *ptr
+
+    def __cinit__(self,
+                  PyTreeNode py_root,
+                  float time_budget = 0.0,
+                  int num_stable_batches = 0,
+                  float kl_threshold = 0.0,
+                  int min_sims = 0):
+        cdef SearchControlOpt opt = SearchControlOpt()
+        opt.time_budget = time_budget
+        opt.num_stable_batches = num_stable_batches
+        opt.kl_threshold = kl_threshold
+        opt.min_sims = min_sims
+        self.ptr = new SearchController(py_root.ptr, opt)
+
+    def __dealloc__(self):
+        del self.ptr
+
+    def update(self, int num_sims) -> bool:
+        """Record a finished batch of `num_sims` simulations. Return whether the search should stop."""
+        return self.ptr.update(num_sims)
+
+    @property
+    def num_sims(self) -> int:
+        return self.ptr.get_num_sims()
+
+    @property
+    def elapsed(self) -> float:
+        return self.ptr.get_elapsed()
+
+cdef inline object wrap_long_array(vector[long] &vec, shape):
+    return np.asarray(<long[:vec.size()]> vec.data()).reshape(shape)
+
+cdef inline object wrap_short_array(vector[int16_t] &vec, shape):
+    return np.asarray(<int16_t[:vec.size()]> vec.data()).reshape(shape)
+
+cdef void evaluate_callback(void *context, EvaluationBatch &batch) noexcept with gil:
+    cdef PyEpisodeRunner runner = <PyEpisodeRunner>context
+    cdef size_t n = batch.size
+    cdef const float[:, :, ::1] meta_priors
+    cdef const float[:, ::1] special_priors
+    cdef const float[::1] values
+    try:
+        ids = wrap_short_array(batch.ids, [n, batch.num_words, batch.max_length])
+        almts1 = almts2 = None
+        if runner.use_alignment:
+            almts1 = wrap_short_array(batch.almts1, [n, batch.num_words, batch.max_length])
+            almts2 = wrap_short_array(batch.almts2, [n, batch.num_words, batch.max_end_length])
+        steps = wrap_long_array(batch.steps, [n])
+        py_meta_priors, py_special_priors, py_values = runner.evaluate_fn(ids, almts1, almts2, steps)
+        meta_priors = np.ascontiguousarray(py_meta_priors, dtype='float32')
+        special_priors = np.ascontiguousarray(py_special_priors, dtype='float32')
+        values = np.ascontiguousarray(py_values, dtype='float32')
+        assert meta_priors.size == batch.meta_priors.size()
+        assert special_priors.size == batch.special_priors.size()
+        assert values.size == batch.values.size()
+        memcpy(batch.meta_priors.data(), &meta_priors[0, 0, 0], batch.meta_priors.size() * sizeof(float))
+        memcpy(batch.special_priors.data(), &special_priors[0, 0], batch.special_priors.size() * sizeof(float))
+        memcpy(batch.values.data(), &values[0], batch.values.size() * sizeof(float))
+    except BaseException as e:
+        runner.error = e
+        batch.failed = True
+
+cdef class PyEvaluationCache:
+    """Bounded LRU cache of agent outputs keyed by state (and step if `use_step`). Priors are stored as bfloat16. Call
+    `clear` whenever the weights of the agent change."""
+    cdef EvaluationCache *ptr
+
+    def __cinit__(self, size_t capacity, size_t num_abc, bool use_step):
+        self.ptr = new EvaluationCache(capacity, num_abc, use_step)
+
+    def __dealloc__(self):
+        del self.ptr
+
+    def lookup(self, py_nodes, long[::1] steps):
+        """Return a mask of the nodes found in the cache, and their meta priors, special priors and values. Rows of nodes
+        that are not found are zeros."""
+        cdef size_t n = len(py_nodes)
+        cdef size_t num_abc = self.ptr.num_abc
+        cdef vector[TNptr] nodes = vector[TNptr]()
+        cdef size_t i
+        for i in range(n):
+            nodes.push_back(get_ptr(py_nodes[i]))
+        found_arr = np.zeros([n], dtype='uint8')
+        meta_priors_arr = np.zeros([n, 6, num_abc], dtype='float32')
+        special_priors_arr = np.zeros([n, 6], dtype='float32')
+        values_arr = np.zeros([n], dtype='float32')
+        cdef unsigned char[::1] found = found_arr
+        cdef float[:, :, ::1] meta_priors = meta_priors_arr
+        cdef float[:, ::1] special_priors = special_priors_arr
+        cdef float[::1] values = values_arr
+        if n > 0:
+            with nogil:
+                for i in range(n):
+                    found[i] = self.ptr.lookup(nodes[i], steps[i], &meta_priors[i, 0, 0], &special_priors[i, 0], values[i])
+        return found_arr.view(np.bool_), meta_priors_arr, special_priors_arr, values_arr
+
+    def insert(self, py_nodes, long[::1] steps, const float[:, :, ::1] meta_priors, const float[:, ::1] special_priors,
+               const float[::1] values):
+        cdef size_t n = len(py_nodes)
+        cdef vector[TNptr] nodes = vector[TNptr]()
+        cdef size_t i
+        for i in range(n):
+            nodes.push_back(get_ptr(py_nodes[i]))
+        if n > 0:
+            with nogil:
+                for i in range(n):
+                    self.ptr.insert(nodes[i], steps[i], &meta_priors[i, 0, 0], &special_priors[i, 0], values[i])
+
+    def clear(self):
+        """Drop all entries and reset the hit and miss counters."""
+        self.ptr.clear()
+
+    @property
+    def size(self) -> int:
+        return self.ptr.size()
+
+    @property
+    def num_hits(self) -> int:
+        return self.ptr.get_num_hits()
+
+    @property
+    def num_misses(self) -> int:
+        return self.ptr.get_num_misses()
+
+    @property
+    def hit_rate(self) -> float:
+        cdef size_t total = self.ptr.get_num_hits() + self.ptr.get_num_misses()
+        return self.ptr.get_num_hits() / total if total > 0 else 0.0
+
+ctypedef fused index_t:
+    int16_t
+    int32_t
+
+cdef void pack_states(StateBatcher *batcher, vector[TNptr] &nodes, size_t max_length, index_t[:, :, ::1] ids,
+                      index_t[:, :, ::1] almts1, index_t[:, :, ::1] almts2):
+    cdef index_t *almts1_ptr = NULL
+    cdef index_t *almts2_ptr = NULL
+    if almts1 is not None:
+        almts1_ptr = &almts1[0, 0, 0]
+        almts2_ptr = &almts2[0, 0, 0]
+    with nogil:
+        batcher.pack(nodes, max_length, &ids[0, 0, 0], almts1_ptr, almts2_ptr)
+
+cdef class PyStateBatcher:
+    """Pack states into padded id and alignment arrays of int16 or int32 in parallel. Use int16 unless the alphabet is
+    too large, since the arrays are copied to the device for every evaluation batch."""
+    cdef StateBatcher *ptr
+
+    def __cinit__(self, int num_threads, abc_t pad_id, size_t max_end_length):
+        self.ptr = new StateBatcher(num_threads, pad_id, max_end_length)
+
+    def __dealloc__(self):
+        del self.ptr
+
+    def get_max_length(self, py_nodes) -> int:
+        cdef vector[TNptr] nodes = vector[TNptr]()
+        for node in py_nodes:
+            nodes.push_back(get_ptr(node))
+        cdef size_t ret
+        with nogil:
+            ret = self.ptr.get_max_length(nodes)
+        return ret
+
+    def pack(self, py_nodes, ids, almts1=None, almts2=None):
+        """Write into caller-provided C-contiguous arrays: ids of shape [n, num_words, max_length] and, optionally,
+        alignments of shape [n, num_words, max_length] and [n, num_words, max_end_length]. Padding is written as well,
+        so the arrays do not need to be initialized."""
+        cdef size_t n = len(py_nodes)
+        if n == 0:
+            return
+        if (almts1 is None) != (almts2 is None):
+            raise ValueError('Both alignment arrays should be provided, or neither.')
+        cdef vector[TNptr] nodes = vector[TNptr]()
+        for node in py_nodes:
+            nodes.push_back(get_ptr(node))
+        # Nothing is checked on the C++ side, so the shapes have to be right before packing.
+        cdef size_t nw = nodes[0].size()
+        if ids.ndim != 3 or ids.shape[0] != n or ids.shape[1] != nw:
+            raise ValueError(f'Expected ids of shape [{n}, {nw}, max_length], but got {ids.shape}.')
+        cdef size_t max_length = ids.shape[2]
+        cdef size_t longest
+        with nogil:
+            longest = self.ptr.get_max_length(nodes)
+        if max_length < longest:
+            raise ValueError(f'Ids have max_length {max_length}, but the longest word has length {longest}.')
+        if almts1 is not None:
+            if almts1.shape != (n, nw, max_length):
+                raise ValueError(f'Expected almts1 of shape {(n, nw, max_length)}, but got {almts1.shape}.')
+            if almts2.shape != (n, nw, self.ptr.max_end_length):
+                raise ValueError(
+                    f'Expected almts2 of shape {(n, nw, self.ptr.max_end_length)}, but got {almts2.shape}.')
+        if ids.dtype == np.int16:
+            pack_states[int16_t](self.ptr, nodes, max_length, ids, almts1, almts2)
+        elif ids.dtype == np.int32:
+            pack_states[int32_t](self.ptr, nodes, max_length, ids, almts1, almts2)
+        else:
+            raise TypeError(f'Unsupported dtype {ids.dtype}.')
+
+    def stack(self, py_nodes, bool use_alignment, dtype='int16'):
+        """Return packed ids (and alignments if `use_alignment`) of `py_nodes`."""
+        cdef size_t n = len(py_nodes)
+        cdef size_t nw = get_ptr(py_nodes[0]).size() if n > 0 else 0
+        m = self.get_max_length(py_nodes)
+        ids = np.empty([n, nw, m], dtype=dtype)
+        almts1 = almts2 = None
+        if use_alignment:
+            almts1 = np.empty([n, nw, m], dtype=dtype)
+            almts2 = np.empty([n, nw, self.ptr.max_end_length], dtype=dtype)
+        self.pack(py_nodes, ids, almts1, almts2)
+        if use_alignment:
+            return ids, almts1, almts2
+        return ids
+
+cdef class PyBeamSearch:
+    """Beam search that keeps the `beam_size` best distinct states (by distance) at every depth. Every action of every
+    state in the beam is scored with a one-step lookahead, in parallel with `num_threads` threads."""
+    cdef BeamSearch *ptr
+
+    cdef public PyEnv env
+
+    def __cinit__(self, PyEnv py_env, size_t beam_size, int num_threads=1):
+        assert beam_size > 0
+        cdef BeamSearchOpt opt
+        opt.beam_size = beam_size
+        opt.num_threads = num_threads
+        self.ptr = new BeamSearch(py_env.ptr, opt)
+        self.env = py_env
+
+    def __dealloc__(self):
+        del self.ptr
+
+    def search(self, PyTreeNode py_tnode, int depth):
+        """Run `depth` steps (fewer if every state is done) from `py_tnode`. Return the last beam, best first, as a list
+        of (node, actions) where actions are an array of [num_steps, 7] in the order of `expand_all_actions`."""
+        cdef TreeNode *node = py_tnode.ptr
+        cdef vector[Hypothesis] beam
+        with nogil:
+            beam = self.ptr.search(node, depth)
+        tnode_cls = type(py_tnode)
+        cdef abc_t[:, ::1] view
+        cdef size_t i, j, k, m
+        ret = list()
+        for i in range(beam.size()):
+            m = beam[i].actions.size()
+            actions = np.zeros([m, 7], dtype='uint16')
+            view = actions
+            for j in range(m):
+                for k in range(7):
+                    view[j, k] = beam[i].actions[j][k]
+            ret.append((wrap_node(tnode_cls, beam[i].node), actions))
+        return ret
+
+cdef class PyEpisodeRunner:
+    """Run whole episodes in C++ without holding the GIL. `evaluate_fn(ids, almts1, almts2, steps)` is called once per
+    batch with packed (and deduplicated) states, and should return meta priors [n, 6, num_abc], special priors [n, 6]
+    and values [n]."""
+    cdef EpisodeRunner *ptr
+
+    cdef public object evaluate_fn
+    cdef public object error
+    cdef public bool use_alignment
+    cdef PyMcts mcts
+    cdef PyEvaluationCache cache
+
+    def __cinit__(self,
+                  PyMcts py_mcts,
+                  evaluate_fn,
+                  int num_sims,
+                  int batch_size,
+                  int max_rollout_length,
+                  int play_strategy,
+                  float exponent,
+                  bool add_noise,
+                  float dirichlet_alpha,
+                  float noise_ratio,
+                  size_t num_abc,
+                  bool use_alignment,
+                  size_t max_end_length,
+                  uint64_t seed = 0):
+        cdef EpisodeOpt opt = EpisodeOpt()
+        opt.num_sims = num_sims
+        opt.batch_size = batch_size
+        opt.max_rollout_length = max_rollout_length
+        if play_strategy == PyPS_MAX:
+            opt.play_strategy = MAX
+        elif play_strategy == PyPS_SAMPLE_AC:
+            opt.play_strategy = SAMPLE_AC
+        elif play_strategy == PyPS_SAMPLE_MV:
+            opt.play_strategy = SAMPLE_MV
+        opt.exponent = exponent
+        opt.add_noise = add_noise
+        opt.dirichlet_alpha = dirichlet_alpha
+        opt.noise_ratio = noise_ratio
+        opt.num_abc = num_abc
+        opt.pad_id = alphabet.PAD_ID
+        opt.use_alignment = use_alignment
+        opt.max_end_length = max_end_length
+        opt.seed = seed
+
+        self.mcts = py_mcts
+        self.evaluate_fn = evaluate_fn
+        self.error = None
+        self.use_alignment = use_alignment
+        self.ptr = new EpisodeRunner(py_mcts.env.ptr, py_mcts.ptr, opt)
+        self.ptr.register_callback(evaluate_callback, <void *>self)
+
+    def __dealloc__(self):
+        del self.ptr
+
+    def set_cache(self, PyEvaluationCache cache):
+        """Consult `cache` before calling `evaluate_fn`. Pass None to disable."""
+        self.cache = cache
+        if cache is None:
+            self.ptr.set_cache(NULL)
+        else:
+            self.ptr.set_cache(cache.ptr)
+
+    def run(self, PyTreeNode py_root):
+        """Run one episode from `py_root` and return the played path."""
+        cdef Path path
+        self.error = None
+        try:
+            with nogil:
+                path = self.ptr.run(py_root.ptr)
+        except RuntimeError:
+            if self.error is not None:
+                raise self.error
+            raise
+        return PyPath.from_c_obj(path, type(py_root))
+
 def parallel_stack_ids(py_nodes, int num_threads, bool use_alignment, int max_end_length):
     cdef vector[TNptr] nodes = vector[TNptr]()
     for node in py_nodes:
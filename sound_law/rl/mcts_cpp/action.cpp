@@ -2,7 +2,7 @@
 
 ActionSpace::ActionSpace(WordSpace *word_space, const ActionSpaceOpt &as_opt, float start_dist) : word_space(word_space), opt(as_opt), start_dist(start_dist) {}
 
-TreeNode *ActionSpace::apply_new_action(TreeNode *node, const Subpath &subpath)
+TreeNode *ActionSpace::apply_new_action(TreeNode *node, const Subpath &subpath, bool defer)
 {
     // FIXME(j_luo) a bit repetive with env apply_action.
     MiniNode *last = subpath.mini_node_seq[5];
@@ -14,28 +14,26 @@ TreeNode *ActionSpace::apply_new_action(TreeNode *node, const Subpath &subpath)
     // A new node should always be created for STOP.
     {
         new_node = NodeFactory::get_stopped_node(node);
+        std::lock_guard<std::mutex> lock(LockManager::get_mutex(new_node));
         EdgeBuilder::connect(last, last_child_index, new_node);
     }
     else
     {
-        auto new_words = vec<Word *>(node->words);
         const auto &aff = last->get_affected_at(last_child_index);
-        // FIXME(j_luo) If everything is ordered, then perhaps we don't need hashing.
-        auto order2pos = map<int, vec<size_t>>();
-        // for (const auto &item : aff)
+        // Positions grouped by order. The scratch map is reused by every call on this thread.
+        thread_local auto order2pos = DenseMap<vec<size_t>>();
+        order2pos.clear();
+        order2pos.reserve(node->words.size());
         for (size_t i = 0; i < aff.size(); ++i)
             order2pos[aff.get_order_at(i)].push_back(aff.get_position_at(i));
-        for (const auto &item : order2pos)
+        auto changed_orders = vec<int>();
+        new_node = get_changed_node(node, order2pos, after_id, st, changed_orders);
         {
-            auto order = item.first;
-            auto new_id_seq = change_id_seq(node->words[order]->id_seq, item.second, after_id, st);
-            auto new_word = word_space->get_word(new_id_seq);
-            new_words[order] = new_word;
-            word_space->set_edit_dist_at(new_word, order);
+            // Tree nodes are shared through the transposition table, so other threads might connect to them as well.
+            std::lock_guard<std::mutex> lock(LockManager::get_mutex(new_node));
+            EdgeBuilder::connect(last, last_child_index, new_node);
         }
-        new_node = NodeFactory::get_tree_node(new_words, false);
-        EdgeBuilder::connect(last, last_child_index, new_node);
-        expand(new_node);
+        expand_child(new_node, node, changed_orders, defer);
         if ((node->get_dist() - new_node->get_dist()) < opt.dist_threshold)
             PruningManager::prune(last, last_child_index);
         // new_node->prune();
@@ -43,6 +41,81 @@ TreeNode *ActionSpace::apply_new_action(TreeNode *node, const Subpath &subpath)
     return new_node;
 }
 
+TreeNode *ActionSpace::get_changed_node(TreeNode *node, const DenseMap<vec<size_t>> &order2pos, abc_t after_id, SpecialType st, vec<int> &changed_orders)
+{
+    auto new_words = vec<Word *>(node->words);
+    // Only the changed words need to be scanned (in order) later.
+    changed_orders.assign(order2pos.keys().begin(), order2pos.keys().end());
+    std::sort(changed_orders.begin(), changed_orders.end());
+    for (const int order : changed_orders)
+    {
+        auto new_id_seq = change_id_seq(node->words[order]->id_seq, order2pos.at(order), after_id, st);
+        auto new_word = word_space->get_word(new_id_seq);
+        new_words[order] = new_word;
+        word_space->set_edit_dist_at(new_word, order);
+    }
+    return NodeFactory::get_tree_node(new_words, false);
+}
+
+void ActionSpace::expand_child(TreeNode *new_node, TreeNode *node, const vec<int> &changed_orders, bool defer) const
+{
+    if (opt.defer_expansion || defer)
+    {
+        // Remember the parent (through its words) so that the node can still be derived from it later.
+        auto parent_words = vec<pair<int, Word *>>();
+        parent_words.reserve(changed_orders.size());
+        for (const int order : changed_orders)
+            parent_words.push_back({order, node->words[order]});
+        std::lock_guard<std::mutex> lock(LockManager::get_mutex(new_node));
+        if (!new_node->is_expanded() && ActionManager::get_deferred_parent_words(new_node).empty())
+            ActionManager::defer_expansion(new_node, std::move(parent_words));
+    }
+    else
+        expand(new_node, node, changed_orders);
+}
+
+template <class F>
+void ActionSpace::for_each_match(const TreeNode *node, const Rule &rule, F &&fn) const
+{
+    // The action tables are only read once they are complete.
+    if (!ActionManager::is_expansion_done(node))
+    {
+        for_each_match(node->words, rule, fn);
+        return;
+    }
+    if (!can_match(rule))
+        return;
+    // Only the sites of `before_id` need to be checked.
+    for (size_t index = 1; index < node->get_num_actions(); ++index)
+        if (node->get_action_at(index) == rule.before_id)
+        {
+            const auto &aff = node->get_affected_at(index);
+            for (size_t i = 0; i < aff.size(); ++i)
+            {
+                auto order = aff.get_order_at(i);
+                auto pos = aff.get_position_at(i);
+                if (match_site(node->words[order], pos, rule))
+                    fn(order, pos);
+            }
+            return;
+        }
+}
+
+template <class F>
+void ActionSpace::for_each_match(const vec<Word *> &words, const Rule &rule, F &&fn) const
+{
+    if (!can_match(rule))
+        return;
+    // Skip the boundaries.
+    for (size_t order = 0; order < words.size(); ++order)
+    {
+        const auto word = words[order];
+        for (size_t pos = 1; pos + 1 < word->id_seq.size(); ++pos)
+            if (match_unit(word->id_seq[pos], rule.before_id, false) && match_site(word, pos, rule))
+                fn(order, pos);
+    }
+}
+
 TreeNode *ActionSpace::apply_action(TreeNode *node,
                                     abc_t before_id,
                                     abc_t after_id,
@@ -52,8 +125,125 @@ TreeNode *ActionSpace::apply_action(TreeNode *node,
                                     abc_t d_post_id,
                                     SpecialType st)
 {
-    Subpath subpath = Subpath();
-    return apply_action(node, before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st, subpath);
+    // A stopped node is always new and connected to the tree, so stopping goes through the mini nodes.
+    if (before_id == opt.null_id)
+    {
+        Subpath subpath = Subpath();
+        return apply_action(node, before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st, subpath);
+    }
+
+    const auto rule = Rule{before_id, after_id, pre_id, d_pre_id, post_id, d_post_id, st};
+    thread_local auto order2pos = DenseMap<vec<size_t>>();
+    order2pos.clear();
+    order2pos.reserve(node->words.size());
+    for_each_match(node, rule, [](int order, size_t pos) { order2pos[order].push_back(pos); });
+    // Same error as the one thrown by `get_action_index` when some mini node does not have the chosen action.
+    if (order2pos.size() == 0)
+        throw std::runtime_error("Target not found. This is usually the result of an action affecting zero site.");
+
+    auto changed_orders = vec<int>();
+    auto new_node = get_changed_node(node, order2pos, after_id, st, changed_orders);
+    expand_child(new_node, node, changed_orders);
+    return new_node;
+}
+
+bool ActionSpace::apply_rule(vec<Word *> &words, const Rule &rule)
+{
+    if (rule.before_id == opt.null_id)
+        return false;
+    thread_local auto order2pos = DenseMap<vec<size_t>>();
+    order2pos.clear();
+    order2pos.reserve(words.size());
+    for_each_match(words, rule, [](int order, size_t pos) { order2pos[order].push_back(pos); });
+    for (const auto order : order2pos.keys())
+    {
+        auto new_word = word_space->get_word(change_id_seq(words[order]->id_seq, order2pos.at(order), rule.after_id, rule.st));
+        word_space->set_edit_dist_at(new_word, order);
+        words[order] = new_word;
+    }
+    return (order2pos.size() > 0);
+}
+
+bool ActionSpace::match_unit(abc_t unit, abc_t target, bool can_have_any) const
+{
+    if (unit == target)
+        return true;
+    bool real_can_have_any = (can_have_any && (unit != opt.eot_id) && (unit != opt.sot_id));
+    if (real_can_have_any && (target == opt.any_id))
+        return true;
+    Stress stress = word_space->opt.unit_stress[unit];
+    if (stress == Stress::NOSTRESS)
+        return false;
+    if (target == word_space->opt.unit2base[unit])
+        return true;
+    return real_can_have_any && (target == ((stress == Stress::STRESSED) ? opt.any_s_id : opt.any_uns_id));
+}
+
+bool ActionSpace::match_context(const Word *word, size_t pos, int offset, bool use_vowel_seq, abc_t target, bool can_have_null, bool can_have_any) const
+{
+    if (target == opt.null_id)
+        return can_have_null;
+    auto unit = word->get_neighbor(pos, offset, use_vowel_seq);
+    return (unit != abc::NONE) && match_unit(unit, target, can_have_any);
+}
+
+bool ActionSpace::is_null_like(abc_t unit) const { return (unit == opt.null_id) || (unit == opt.any_id) || (unit == opt.any_s_id) || (unit == opt.any_uns_id); }
+
+bool ActionSpace::can_match(const Rule &rule) const
+{
+    // See `expand_before` and `expand_special_type` (with `force_apply`).
+    const auto &ws_opt = word_space->opt;
+    if (rule.before_id >= opt.num_abc)
+        return false;
+    abc_t before_base = ws_opt.unit2base[rule.before_id];
+    switch (rule.st)
+    {
+    case SpecialType::NONE:
+        if (rule.after_id >= opt.num_abc)
+            return false;
+        break;
+    case SpecialType::VS:
+        if (!ws_opt.is_vowel[rule.before_id] || (rule.after_id >= opt.num_abc))
+            return false;
+        break;
+    case SpecialType::CLL:
+    case SpecialType::CLR:
+        break;
+    case SpecialType::GBJ:
+        if (!gbj_map.contains(before_base) || (gbj_map.at(before_base) != rule.after_id))
+            return false;
+        break;
+    case SpecialType::GBW:
+        if (!gbw_map.contains(before_base) || (gbw_map.at(before_base) != rule.after_id))
+            return false;
+        break;
+    default:
+        return false;
+    }
+    if (is_null_like(rule.pre_id) && (rule.d_pre_id != opt.null_id))
+        return false;
+    if (is_null_like(rule.post_id) && (rule.d_post_id != opt.null_id))
+        return false;
+    return true;
+}
+
+bool ActionSpace::match_site(const Word *word, size_t pos, const Rule &rule) const
+{
+    const auto st = rule.st;
+    if ((st == SpecialType::CLL) || (st == SpecialType::CLR))
+    {
+        auto neighbor = word->get_neighbor(pos, (st == SpecialType::CLL) ? -1 : 1, false);
+        if (neighbor == abc::NONE)
+            return false;
+        auto it = cl_map.find(word_space->opt.unit2base[neighbor]);
+        if ((it == cl_map.end()) || !match_unit(it->second, rule.after_id, false))
+            return false;
+    }
+    bool use_vowel_seq = (st == SpecialType::VS);
+    return match_context(word, pos, -1, use_vowel_seq, rule.pre_id, st != SpecialType::CLL, st != SpecialType::CLL) &&
+           (is_null_like(rule.pre_id) || match_context(word, pos, -2, use_vowel_seq, rule.d_pre_id, true, true)) &&
+           match_context(word, pos, 1, use_vowel_seq, rule.post_id, st != SpecialType::CLR, st != SpecialType::CLR) &&
+           (is_null_like(rule.post_id) || match_context(word, pos, 2, use_vowel_seq, rule.d_post_id, true, true));
 }
 
 TreeNode *ActionSpace::apply_action(TreeNode *node,
@@ -66,6 +256,7 @@ TreeNode *ActionSpace::apply_action(TreeNode *node,
                                     SpecialType st,
                                     Subpath &subpath)
 {
+    expand(node);
     // std::cerr << "before\n";
     auto before = ChosenChar({node->get_action_index(before_id), before_id});
     bool stopped = (before.first == 0);
@@ -130,7 +321,7 @@ TreeNode *ActionSpace::apply_action(TreeNode *node,
     return apply_new_action(node, subpath);
 }
 
-inline IdSeq ActionSpace::change_id_seq(const IdSeq &id_seq, const vec<size_t> &positions, abc_t after_id, SpecialType st)
+inline IdSeq ActionSpace::change_id_seq(const IdSeq &id_seq, const vec<size_t> &positions, abc_t after_id, SpecialType st) const
 {
     auto new_id_seq = IdSeq(id_seq);
     auto stressed_after_id = word_space->opt.unit2stressed[after_id];
@@ -279,6 +470,7 @@ MiniNode *ActionSpace::get_mini_node(TreeNode *base, BaseNode *parent, const Cho
     // BaseNode *&child = parent->children[chosen.first];
     bool is_transition = (ap == ActionPhase::POST);
     BaseNode *child;
+    std::lock_guard<std::mutex> lock(LockManager::get_mutex(parent));
     if (!parent->has_child(chosen.first))
     {
         if (is_transition)
@@ -295,12 +487,224 @@ MiniNode *ActionSpace::get_mini_node(TreeNode *base, BaseNode *parent, const Cho
         return static_cast<MiniNode *>(child);
 }
 
-inline bool in_bound(int pos, size_t max) { return ((pos >= 0) && (pos < max)); }
+OccurrenceIndex ActionSpace::build_occurrence_index(const TreeNode *node) const
+{
+    auto orders = vec<int>(node->words.size());
+    for (size_t order = 0; order < orders.size(); ++order)
+        orders[order] = order;
+    return build_occurrence_index(node, orders);
+}
+
+OccurrenceIndex ActionSpace::build_occurrence_index(const TreeNode *node, const vec<int> &orders) const
+{
+    auto index = OccurrenceIndex();
+    // Collect all sites, skipping the boundaries. Misalignment scores do not depend on the unit.
+    for (const int order : orders)
+    {
+        const auto word = node->words[order];
+        const size_t n = word->id_seq.size();
+        for (size_t pos = 1; pos + 1 < n; ++pos)
+        {
+            index.orders.push_back(order);
+            index.positions.push_back(pos);
+            index.misalign_scores.push_back(word_space->get_misalignment_score(word, order, pos, abc::NONE));
+        }
+    }
+    const size_t num_sites = index.orders.size();
+
+    // Count the sites of every unit (and the base unit of every vowel), assigning slots in order of first occurrence.
+    auto slots = vec<int>(opt.num_abc, -1);
+    auto counts = vec<size_t>();
+    auto get_units = [this, node, &index](size_t site) {
+        const abc_t unit = node->words[index.orders[site]]->id_seq[index.positions[site]];
+        const bool has_base = (word_space->opt.unit_stress[unit] != Stress::NOSTRESS);
+        return pair<abc_t, abc_t>(unit, has_base ? word_space->opt.unit2base[unit] : abc::NONE);
+    };
+    auto count = [&slots, &counts, &index](abc_t unit) {
+        if (slots[unit] == -1)
+        {
+            slots[unit] = index.units.size();
+            index.units.push_back(unit);
+            counts.push_back(0);
+        }
+        ++counts[slots[unit]];
+    };
+    for (size_t site = 0; site < num_sites; ++site)
+    {
+        const auto units = get_units(site);
+        count(units.first);
+        if (units.second != abc::NONE)
+            count(units.second);
+    }
+
+    // Fill in the sites of every unit in scan order.
+    const size_t num_units = index.units.size();
+    index.starts = vec<size_t>(num_units + 1, 0);
+    for (size_t i = 0; i < num_units; ++i)
+        index.starts[i + 1] = index.starts[i] + counts[i];
+    index.sites = vec<size_t>(index.starts[num_units]);
+    auto offsets = vec<size_t>(index.starts.begin(), index.starts.end() - 1);
+    for (size_t site = 0; site < num_sites; ++site)
+    {
+        const auto units = get_units(site);
+        index.sites[offsets[slots[units.first]]++] = site;
+        if (units.second != abc::NONE)
+            index.sites[offsets[slots[units.second]]++] = site;
+    }
+    return index;
+}
+
+namespace
+{
+    inline bool contains_order(const vec<int> &orders, int order) { return std::binary_search(orders.begin(), orders.end(), order); }
+
+    // Whether any site of `affected` (sorted by order) is at one of `orders`.
+    bool touches_orders(const Affected &affected, const vec<int> &orders)
+    {
+        for (const int order : orders)
+        {
+            size_t lo = 0;
+            size_t hi = affected.size();
+            while (lo < hi)
+            {
+                size_t mid = (lo + hi) / 2;
+                if (affected.get_order_at(mid) < order)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if ((lo < affected.size()) && (affected.get_order_at(lo) == order))
+                return true;
+        }
+        return false;
+    }
+} // namespace
+
+void ActionSpace::derive_actions(TreeNode *node, const TreeNode *parent, const vec<int> &changed_orders) const
+{
+    // Only the changed words are scanned.
+    const auto index = build_occurrence_index(node, changed_orders);
+    auto slots = vec<int>(opt.num_abc, -1);
+    for (size_t i = 0; i < index.units.size(); ++i)
+        slots[index.units[i]] = i;
+    auto used = vec<bool>(index.units.size(), false);
+
+    struct Entry
+    {
+        abc_t unit;
+        Affected affected;
+    };
+    auto entries = vec<Entry>();
+    entries.reserve(parent->get_num_actions() + index.units.size());
+    // Merge the sites of the unchanged words (from the parent) with the new sites, both in scan order.
+    auto add_entry = [&](abc_t unit, const Affected *old_aff, int slot) {
+        auto aff = Affected(start_dist);
+        size_t i = 0;
+        size_t j = (slot == -1) ? 0 : index.starts[slot];
+        const size_t j_end = (slot == -1) ? 0 : index.starts[slot + 1];
+        const size_t i_end = (old_aff == nullptr) ? 0 : old_aff->size();
+        while ((i < i_end) || (j < j_end))
+        {
+            if ((i < i_end) && contains_order(changed_orders, old_aff->get_order_at(i)))
+            {
+                ++i;
+                continue;
+            }
+            bool take_old;
+            if (i == i_end)
+                take_old = false;
+            else if (j == j_end)
+                take_old = true;
+            else
+            {
+                const auto site = index.sites[j];
+                const int old_order = old_aff->get_order_at(i);
+                take_old = (old_order < index.orders[site]) || ((old_order == index.orders[site]) && (static_cast<size_t>(old_aff->get_position_at(i)) < index.positions[site]));
+            }
+            if (take_old)
+            {
+                aff.push_back(old_aff->get_order_at(i), old_aff->get_position_at(i), old_aff->get_misalign_score_at(i));
+                ++i;
+            }
+            else
+            {
+                const auto site = index.sites[j];
+                aff.push_back(index.orders[site], index.positions[site], index.misalign_scores[site]);
+                ++j;
+            }
+        }
+        if (aff.size() > 0)
+            entries.push_back(Entry{unit, std::move(aff)});
+    };
+    // Skip STOP.
+    for (size_t i = 1; i < parent->get_num_actions(); ++i)
+    {
+        const abc_t unit = parent->get_action_at(i);
+        const auto &old_aff = parent->get_affected_at(i);
+        const int slot = slots[unit];
+        if (slot != -1)
+            used[slot] = true;
+        // Most units do not occur in the changed words at all, and their sites are copied as is.
+        if ((slot == -1) && !touches_orders(old_aff, changed_orders))
+            entries.push_back(Entry{unit, old_aff});
+        else
+            add_entry(unit, &old_aff, slot);
+    }
+    for (size_t slot = 0; slot < index.units.size(); ++slot)
+        if (!used[slot])
+            add_entry(index.units[slot], nullptr, slot);
+
+    // Restore the order of first occurrence. At the same site, the unit itself comes before its base unit.
+    auto get_key = [node](const Entry &entry) {
+        const int order = entry.affected.get_order_at(0);
+        const size_t pos = entry.affected.get_position_at(0);
+        const int rank = (node->words[order]->id_seq[pos] == entry.unit) ? 0 : 1;
+        return std::make_tuple(order, pos, rank);
+    };
+    auto keys = vec<tuple<int, size_t, int>>();
+    keys.reserve(entries.size());
+    for (const auto &entry : entries)
+        keys.push_back(get_key(entry));
+    auto perm = vec<size_t>(entries.size());
+    for (size_t i = 0; i < perm.size(); ++i)
+        perm[i] = i;
+    std::sort(perm.begin(), perm.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    for (const auto i : perm)
+        ActionManager::add_action(node, entries[i].unit, std::move(entries[i].affected));
+}
 
 void ActionSpace::expand(TreeNode *node) const
+{
+    auto parent_words = vec<pair<int, Word *>>();
+    {
+        std::lock_guard<std::mutex> lock(LockManager::get_mutex(node));
+        if (node->is_expanded())
+            return;
+        parent_words = ActionManager::get_deferred_parent_words(node);
+    }
+    if (parent_words.empty())
+    {
+        expand(node, nullptr, vec<int>());
+        return;
+    }
+
+    auto words = vec<Word *>(node->words);
+    auto changed_orders = vec<int>();
+    changed_orders.reserve(parent_words.size());
+    for (const auto &item : parent_words)
+    {
+        words[item.first] = item.second;
+        changed_orders.push_back(item.first);
+    }
+    // The parent is null (and the node is expanded from scratch) if it has been evicted.
+    expand(node, NodeFactory::find_tree_node(words), changed_orders);
+}
+
+void ActionSpace::expand(TreeNode *node, const TreeNode *parent, const vec<int> &changed_orders) const
 {
     SPDLOG_DEBUG("ActionSpace:: expanding node...");
 
+    std::lock_guard<std::mutex> lock(LockManager::get_mutex(node));
     if (node->is_expanded())
     {
         assert(node->get_pruned().size() > 0);
@@ -311,26 +715,27 @@ void ActionSpace::expand(TreeNode *node) const
     // Null/Stop option.
     ActionManager::add_action(node, opt.null_id, Affected(start_dist));
 
-    auto char_map = map<abc_t, size_t>();
-    // std::cerr << "=============================\n";
-    for (int order = 0; order < node->words.size(); ++order)
+    // The parent might still be expanded by another thread, in which case the node is expanded from scratch.
+    if ((parent != nullptr) && ActionManager::is_expansion_done(parent))
+        derive_actions(node, parent, changed_orders);
+    else
     {
-        auto &id_seq = node->words[order]->id_seq;
-        size_t n = id_seq.size();
-        // Skip the boundaries.
-        for (int pos = 1; pos < n - 1; ++pos)
+        // Every action table is a slice of the inverted index.
+        const auto index = build_occurrence_index(node);
+        for (size_t i = 0; i < index.units.size(); ++i)
         {
-            if (in_bound(pos, n))
+            auto aff = Affected(start_dist);
+            aff.reserve(index.starts[i + 1] - index.starts[i]);
+            for (size_t j = index.starts[i]; j < index.starts[i + 1]; ++j)
             {
-                // auto word = static_cast<TreeNode *>(node)->words[order];
-                // auto misalign_score = word_space->get_misalignment_score(word, order, pos, abc::NONE);
-                // if (id_seq[pos] == 375)
-                //     std::cerr << order << " " << pos << " " << misalign_score << "\n";
-                update_affected(node, id_seq[pos], order, pos, char_map, false, abc::NONE);
+                const auto site = index.sites[j];
+                aff.push_back(index.orders[site], index.positions[site], index.misalign_scores[site]);
             }
+            ActionManager::add_action(node, index.units[i], std::move(aff));
         }
     }
 
+    ActionManager::clear_deferred_parent_words(node);
     expand_stats(node);
     SPDLOG_DEBUG("ActionSpace:: node expanded with #actions {}.", node->get_num_actions());
 
@@ -338,6 +743,7 @@ void ActionSpace::expand(TreeNode *node) const
     for (size_t i = 1; i < node->get_num_actions(); ++i)
         if (node->get_num_affected_at(i) < opt.site_threshold)
             PruningManager::prune(node, i);
+    ActionManager::finish_expansion(node);
 
     // std::cerr << "Expanding tree nodes\n";
     // node->show_action_stats();
@@ -361,7 +767,9 @@ void ActionSpace::expand_special_type(MiniNode *node, BaseNode *parent, int chos
     if ((st == SpecialType::CLL) || (st == SpecialType::CLR))
     {
         auto offset = (st == SpecialType::CLL) ? -1 : 1;
-        auto char_map = map<abc_t, size_t>();
+        thread_local auto char_map = DenseMap<size_t>();
+        char_map.clear();
+        char_map.reserve(opt.num_abc);
         // for (const auto &item : aff)
         for (size_t i = 0; i < aff.size(); ++i)
         {
@@ -437,19 +845,17 @@ void ActionSpace::expand_before(MiniNode *node, int chosen_index) const
         auto order = full_aff.get_order_at(i);  //item.first;
         auto pos = full_aff.get_position_at(i); //item.second;
         auto word = node->base->words[order];
-        auto &id_seq = word->id_seq;
-        if (pos > 0)
-        {
-            auto base_unit = word_space->opt.unit2base[id_seq[pos - 1]];
-            if (cl_map.contains(base_unit))
-                cll_aff.push_back(order, pos, word_space->get_misalignment_score(word, order, pos, abc::NONE));
-        }
-        if (pos < (id_seq.size() - 1))
-        {
-            auto base_unit = word_space->opt.unit2base[id_seq[pos + 1]];
-            if (cl_map.contains(base_unit))
-                clr_aff.push_back(order, pos, word_space->get_misalignment_score(word, order, pos, abc::NONE));
-        }
+        auto left = word->get_neighbor(pos, -1, false);
+        auto right = word->get_neighbor(pos, 1, false);
+        bool is_cll = (left != abc::NONE) && cl_map.contains(word_space->opt.unit2base[left]);
+        bool is_clr = (right != abc::NONE) && cl_map.contains(word_space->opt.unit2base[right]);
+        if (!is_cll && !is_clr)
+            continue;
+        auto misalign_score = word_space->get_misalignment_score(word, order, pos, abc::NONE);
+        if (is_cll)
+            cll_aff.push_back(order, pos, misalign_score);
+        if (is_clr)
+            clr_aff.push_back(order, pos, misalign_score);
     }
     if (cll_aff.size() > 0)
         ActionManager::add_action(node, static_cast<abc_t>(SpecialType::CLL), cll_aff);
@@ -474,28 +880,19 @@ void ActionSpace::expand_normal(MiniNode *node, BaseNode *parent, int chosen_ind
     const auto &words = node->base->words;
     const auto &affected = parent->get_affected_at(chosen_index);
     // std::cerr << "Before expanding, chosen_index for parent: " << chosen_index << "\n";
-    auto char_map = map<abc_t, size_t>();
+    // Action index of every unit added so far. The scratch map is reused by every call on this thread.
+    thread_local auto char_map = DenseMap<size_t>();
+    char_map.clear();
+    char_map.reserve(opt.num_abc);
     // for (const auto &aff : affected)
     for (size_t i = 0; i < affected.size(); ++i)
     {
         int order = affected.get_order_at(i); // aff.first;
         auto old_pos = affected.get_position_at(i);
-        auto word = words[order];
-        if (use_vowel_seq)
-        {
-            // Get the position/index in the vowel seq.
-            auto vowel_pos = word->id2vowel[old_pos] + offset;
-            auto &vowel_seq = words[order]->vowel_seq;
-            if (in_bound(vowel_pos, vowel_seq.size()))
-                update_affected(node, vowel_seq[vowel_pos], order, old_pos, char_map, can_have_any, after_id);
-        }
-        else
-        {
-            auto pos = old_pos + offset;
-            auto &id_seq = words[order]->id_seq;
-            if (in_bound(pos, id_seq.size()))
-                update_affected(node, id_seq[pos], order, old_pos, char_map, can_have_any, after_id);
-        }
+        // Neighbors (in the vowel seq if needed) are precomputed by the word.
+        auto unit = words[order]->get_neighbor(old_pos, offset, use_vowel_seq);
+        if (unit != abc::NONE)
+            update_affected(node, unit, order, old_pos, char_map, can_have_any, after_id);
     }
 }
 
@@ -536,6 +933,7 @@ void ActionSpace::expand_null(MiniNode *node, BaseNode *parent, int chosen_index
 
 void ActionSpace::expand(MiniNode *node, const Subpath &subpath, bool use_vowel_seq, bool force_apply) const
 {
+    std::lock_guard<std::mutex> lock(LockManager::get_mutex(node));
     if (node->is_expanded())
     {
         assert(node->get_pruned().size() > 0);
@@ -616,7 +1014,7 @@ void ActionSpace::expand(MiniNode *node, const Subpath &subpath, bool use_vowel_
     return;
 }
 
-void ActionSpace::update_affected_impl(BaseNode *node, abc_t unit, int order, size_t pos, map<abc_t, size_t> &char_map, abc_t after_id) const
+void ActionSpace::update_affected_impl(BaseNode *node, abc_t unit, int order, size_t pos, DenseMap<size_t> &char_map, abc_t after_id) const
 {
     Word *word;
     if (node->is_tree_node())
@@ -636,34 +1034,36 @@ void ActionSpace::update_affected_impl(BaseNode *node, abc_t unit, int order, si
     else
     {
         // Add one more position.
-        ActionManager::update_affected_at(node, char_map[unit], order, pos, misalign_score);
+        ActionManager::update_affected_at(node, char_map.at(unit), order, pos, misalign_score);
     }
 }
 
-void ActionSpace::update_affected(BaseNode *node, abc_t unit, int order, size_t pos, map<abc_t, size_t> &char_map, bool can_have_any, abc_t after_id) const
+void ActionSpace::update_affected(BaseNode *node, abc_t unit, int order, size_t pos, DenseMap<size_t> &char_map, bool can_have_any, abc_t after_id) const
 {
-    auto queue = vec<abc_t>();
+    // At most four units: `unit`, <any>, its base unit and <any_s>/<any_uns>.
+    auto queue = array<abc_t, 4>();
+    size_t queue_size = 0;
     // Include include `unit` itself.
-    queue.push_back(unit);
+    queue[queue_size++] = unit;
 
     bool real_can_have_any = (can_have_any && (unit != opt.eot_id) && (unit != opt.sot_id));
     if (real_can_have_any)
-        queue.push_back(opt.any_id);
+        queue[queue_size++] = opt.any_id;
 
     Stress stress = word_space->opt.unit_stress[unit];
     // Vowel case (every vowel is annotated with stress information):
     if (stress != Stress::NOSTRESS)
     {
-        queue.push_back(word_space->opt.unit2base[unit]);
+        queue[queue_size++] = word_space->opt.unit2base[unit];
         if (real_can_have_any)
             if (stress == Stress::STRESSED)
-                queue.push_back(opt.any_s_id);
+                queue[queue_size++] = opt.any_s_id;
             else
-                queue.push_back(opt.any_uns_id);
+                queue[queue_size++] = opt.any_uns_id;
     }
 
-    for (const auto u : queue)
-        update_affected_impl(node, u, order, pos, char_map, after_id);
+    for (size_t i = 0; i < queue_size; ++i)
+        update_affected_impl(node, queue[i], order, pos, char_map, after_id);
 
     // // FIXME(j_luo) clearer logic here -- e.g., <any> is not aviable for after_id.
     // if (((unit == opt.any_id) || (unit == opt.any_s_id) || (unit == opt.any_uns_id)) && !can_have_any)
@@ -690,6 +1090,7 @@ void ActionSpace::update_affected(BaseNode *node, abc_t unit, int order, size_t
 
 void ActionSpace::evaluate(MiniNode *node) const
 {
+    std::lock_guard<std::mutex> lock(LockManager::get_mutex(node));
     ActionManager::evaluate(node);
 }
 
@@ -700,25 +1101,103 @@ void ActionSpace::expand_stats(BaseNode *node) const
     clear_priors(node, false);
     EdgeBuilder::init_edges(node);
     ActionManager::init_pruned(node);
+    ActionManager::init_heuristics(node);
     if (node->is_transitional())
         ActionManager::init_rewards(static_cast<TransitionNode *>(node));
 }
 
+// Unvisited nodes are included, since leaves might be evaluated without a visit (or stats might be cleared already).
 void ActionSpace::clear_stats(BaseNode *root, bool recursive) const
 {
-    auto queue = recursive ? Traverser::bfs(root) : vec<BaseNode *>{root};
+    auto queue = recursive ? Traverser::bfs(root, true) : vec<BaseNode *>{root};
     for (const auto node : queue)
         ActionManager::init_stats(node);
 }
 
 void ActionSpace::clear_priors(BaseNode *root, bool recursive) const
 {
-    auto queue = recursive ? Traverser::bfs(root) : vec<BaseNode *>{root};
+    auto queue = recursive ? Traverser::bfs(root, true) : vec<BaseNode *>{root};
     for (const auto node : queue)
         ActionManager::clear_priors(node);
 }
 
-void ActionSpace::evaluate(TreeNode *node, const vec<vec<float>> &meta_priors, const vec<float> &special_priors) { ActionManager::evaluate(node, meta_priors, special_priors); }
+// Priors are gathered over the actions, so nodes are expanded first.
+void ActionSpace::evaluate(TreeNode *node, const vec<vec<float>> &meta_priors, const vec<float> &special_priors)
+{
+    assert(meta_priors.size() == 6);
+    const size_t num_abc = meta_priors[0].size();
+    auto flat = vec<float>();
+    flat.reserve(6 * num_abc);
+    for (const auto &row : meta_priors)
+        flat.insert(flat.end(), row.begin(), row.end());
+    evaluate(node, PriorBlock::create(std::move(flat), vec<float>(special_priors), 1, num_abc), 0);
+}
+
+void ActionSpace::evaluate(TreeNode *node, const PriorBlockPtr &block, size_t row)
+{
+    expand(node);
+    if (node->is_evaluated())
+        return;
+    auto [after_chars, context_chars] = get_prior_chars(node);
+    ActionManager::evaluate(node, *block, row, std::move(after_chars), std::move(context_chars));
+}
+
+pair<vec<abc_t>, vec<abc_t>> ActionSpace::get_prior_chars(const TreeNode *node) const
+{
+    const auto &unit2base = word_space->opt.unit2base;
+    auto is_after = vec<bool>(opt.num_abc, false);
+    auto is_context = vec<bool>(opt.num_abc, false);
+    auto keep = [this](vec<bool> &is_kept, abc_t unit) {
+        if (unit < opt.num_abc)
+            is_kept[unit] = true;
+    };
+    // After ids of every before (see `expand_special_type`).
+    for (const auto before : node->get_actions())
+    {
+        if (before >= opt.num_abc)
+            continue;
+        // Changes are registered for the base unit.
+        const auto base = unit2base[before];
+        if (permissible_changes.contains(base))
+            for (const auto after : permissible_changes.at(base))
+                keep(is_after, after);
+        if (gbj_map.contains(base))
+            keep(is_after, gbj_map.at(base));
+        if (gbw_map.contains(base))
+            keep(is_after, gbw_map.at(base));
+    }
+    for (const auto &item : cl_map)
+        keep(is_after, item.second);
+    // Stopped mini nodes only have the null action.
+    keep(is_after, opt.null_id);
+    // Contexts are units of the words (or their base units), or one of the special ids (see `update_affected`).
+    for (const auto word : node->words)
+        for (const auto unit : word->id_seq)
+        {
+            keep(is_context, unit);
+            keep(is_context, unit2base[unit]);
+        }
+    for (const auto unit : {opt.null_id, opt.sot_id, opt.eot_id, opt.any_id, opt.any_s_id, opt.any_uns_id})
+        keep(is_context, unit);
+
+    auto ret = pair<vec<abc_t>, vec<abc_t>>();
+    for (abc_t unit = 0; unit < opt.num_abc; ++unit)
+    {
+        if (is_after[unit])
+            ret.first.push_back(unit);
+        if (is_context[unit])
+            ret.second.push_back(unit);
+    }
+    return ret;
+}
+
+void ActionSpace::evaluate(const vec<TreeNode *> &nodes, const PriorBlockPtr &block)
+{
+    assert(nodes.size() == block->size);
+    for (size_t i = 0; i < nodes.size(); ++i)
+        if (nodes[i]->is_leaf())
+            evaluate(nodes[i], block, i);
+}
 
 void ActionSpace::add_noise(TreeNode *node, const vec<vec<float>> &meta_noise, const vec<float> &special_noise, float noise_ratio) const
 {
@@ -737,67 +1216,186 @@ void ActionSpace::connect(BaseNode *base, const Subpath &subpath) const
     }
 }
 
+namespace
+{
+    // Phase of the mini node reached after making `length + 1` choices.
+    const array<ActionPhase, 6> phases = {ActionPhase::BEFORE, ActionPhase::SPECIAL_TYPE, ActionPhase::AFTER, ActionPhase::PRE, ActionPhase::D_PRE, ActionPhase::POST};
+} // namespace
+
+void ActionSpace::visit_actions(TreeNode *base,
+                                BaseNode *parent,
+                                Subpath &path,
+                                int length,
+                                bool materialize,
+                                ActionVec &action,
+                                const ActionVisitor &fn) const
+{
+    assert(parent->is_expanded());
+    for (size_t index = 0; index < parent->get_num_actions(); ++index)
+    {
+        action[length] = parent->get_action_at(index);
+        const auto chosen = ChosenChar{index, action[length]};
+        path.chosen_seq[length] = chosen;
+        if (length == 6)
+        {
+            fn(action, static_cast<MiniNode *>(parent)->get_affected_at(index));
+            break;
+        }
+
+        path.stopped = (path.chosen_seq[0].first == 0);
+        const auto ap = phases[length];
+        MiniNode *child;
+        if (materialize)
+            child = get_mini_node(base, parent, chosen, ap, path.stopped);
+        else if (ap == ActionPhase::POST)
+            child = NodeFactory::get_transition_node(base, path.stopped);
+        else
+            child = NodeFactory::get_mini_node(base, ap, path.stopped);
+        path.mini_node_seq[length] = child;
+        bool use_vowel_seq = ((length > 1) && (static_cast<SpecialType>(path.chosen_seq[1].second) == SpecialType::VS));
+        expand(child, path, use_vowel_seq, false);
+        visit_actions(base, child, path, length + 1, materialize, action, fn);
+        if (!materialize)
+            MemoryManager::release(child);
+    }
+}
+
+void ActionSpace::for_each_action(TreeNode *base, size_t before_index, bool materialize, const ActionVisitor &fn) const
+{
+    expand(base);
+    assert(before_index < base->get_num_actions());
+    auto path = Subpath();
+    auto action = ActionVec();
+    action[0] = base->get_action_at(before_index);
+    const auto before = ChosenChar{before_index, action[0]};
+    path.chosen_seq[0] = before;
+    path.stopped = (before_index == 0);
+    MiniNode *child;
+    if (materialize)
+        child = get_mini_node(base, base, before, ActionPhase::BEFORE, path.stopped);
+    else
+        child = NodeFactory::get_mini_node(base, ActionPhase::BEFORE, path.stopped);
+    path.mini_node_seq[0] = child;
+    expand(child, path, false, false);
+    visit_actions(base, child, path, 1, materialize, action, fn);
+    if (!materialize)
+        MemoryManager::release(child);
+}
+
+vec<vec<ActionVec>> ActionSpace::enumerate_actions(TreeNode *base, const vec<size_t> &before_indices, bool materialize, Pool *tp) const
+{
+    expand(base);
+    const size_t n = before_indices.size();
+    auto ret = vec<vec<ActionVec>>(n);
+    auto collect = [this, base, &before_indices, materialize, &ret](size_t i) {
+        for_each_action(base, before_indices[i], materialize, [&ret, i](const ActionVec &action, const Affected &) { ret[i].push_back(action); });
+    };
+    if ((tp == nullptr) || (n <= 1))
+    {
+        for (size_t i = 0; i < n; ++i)
+            collect(i);
+        return ret;
+    }
+    vec<std::future<void>> futures;
+    futures.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+        futures.push_back(tp->push([&collect, i](int) { collect(i); }));
+    for (auto &future : futures)
+        future.get();
+    return ret;
+}
+
 vec<vec<abc_t>> ActionSpace::expand_all_actions(TreeNode *base) const
 {
-    auto queue = vec<tuple<int, Subpath, BaseNode *>>();
-    queue.push_back({0, Subpath(), base});
-    size_t i = 0;
+    expand(base);
     auto ret = vec<vec<abc_t>>();
-    while (i < queue.size())
+    for (size_t index = 0; index < base->get_num_actions(); ++index)
+        for_each_action(base, index, false, [&ret](const ActionVec &action, const Affected &) { ret.push_back(vec<abc_t>(action.begin(), action.end())); });
+    return ret;
+}
+
+void ActionSpace::for_each_lookahead(TreeNode *base, size_t before_index, const LookaheadVisitor &fn) const
+{
+    const float base_dist = base->get_dist();
+    // The distance of a new state is summed over its words in order, as in `TreeNode::common_init`, so that it is
+    // rounded the same way (and is zero exactly when the new state is done). Everything before the first changed
+    // word is summed once. The scratch containers are reused by every call on this thread.
+    const size_t num_words = base->words.size();
+    thread_local auto word_dists = vec<float>();
+    thread_local auto partial_dists = vec<float>();
+    word_dists.resize(num_words);
+    partial_dists.resize(num_words + 1);
+    partial_dists[0] = 0.0;
+    for (size_t order = 0; order < num_words; ++order)
     {
-        const auto item = queue[i++];
-        const auto length = std::get<0>(item);
-        const auto &path = std::get<1>(item);
-        if (length == 7)
+        word_dists[order] = base->words[order]->get_edit_dist_at(order);
+        partial_dists[order + 1] = partial_dists[order] + word_dists[order];
+    }
+    // Positions grouped by order.
+    thread_local auto order2pos = DenseMap<vec<size_t>>();
+    order2pos.reserve(num_words);
+    for_each_action(base, before_index, false, [this, base, base_dist, num_words, &fn](const ActionVec &action, const Affected &aff) {
+        // Stopping keeps the state as it is.
+        if (action[0] == opt.null_id)
         {
-            auto action_vec = vec<abc_t>();
-            for (const auto &item : path.chosen_seq)
-                action_vec.push_back(item.second);
-            ret.push_back(action_vec);
-            continue;
+            fn(action, aff, base_dist);
+            return;
         }
-        const auto parent = std::get<2>(item);
-        assert(parent->is_expanded());
-        for (size_t index = 0; index < parent->get_num_actions(); ++index)
+        order2pos.clear();
+        for (size_t i = 0; i < aff.size(); ++i)
+            order2pos[aff.get_order_at(i)].push_back(aff.get_position_at(i));
+        const auto st = static_cast<SpecialType>(action[1]);
+        size_t first = num_words;
+        for (const int order : order2pos.keys())
         {
-            auto action = parent->get_action_at(index);
-            ActionPhase ap;
-            switch (length)
-            {
-            case 0:
-                ap = ActionPhase::BEFORE;
-                break;
-            case 1:
-                ap = ActionPhase::SPECIAL_TYPE;
-                break;
-            case 2:
-                ap = ActionPhase::AFTER;
-                break;
-            case 3:
-                ap = ActionPhase::PRE;
-                break;
-            case 4:
-                ap = ActionPhase::D_PRE;
-                break;
-            case 5:
-                ap = ActionPhase::POST;
-                break;
-            }
-            const auto chosen = ChosenChar{index, action};
-            auto new_path = path;
-            new_path.chosen_seq[length] = chosen;
-            if (length == 6)
-            {
-                queue.push_back({7, new_path, nullptr});
-                break;
-            }
-            new_path.stopped = (new_path.chosen_seq[0].first == 0);
-            auto child = get_mini_node(base, parent, chosen, ap, new_path.stopped);
-            new_path.mini_node_seq[length] = child;
-            bool use_vowel_seq = ((length > 1) && (static_cast<SpecialType>(new_path.chosen_seq[1].second) == SpecialType::VS));
-            expand(child, new_path, use_vowel_seq, false);
-            queue.push_back({length + 1, new_path, child});
+            word_dists[order] = word_space->get_edit_dist_at(change_id_seq(base->words[order]->id_seq, order2pos.at(order), action[2], st), order);
+            first = std::min<size_t>(first, order);
         }
+        float dist = partial_dists[first];
+        for (size_t order = first; order < num_words; ++order)
+            dist += word_dists[order];
+        for (const int order : order2pos.keys())
+            word_dists[order] = base->words[order]->get_edit_dist_at(order);
+        fn(action, aff, dist);
+    });
+}
+
+Lookahead ActionSpace::get_lookahead(TreeNode *base, Pool *tp) const
+{
+    expand(base);
+    const size_t n = base->get_num_actions();
+    auto results = vec<Lookahead>(n);
+    auto score = [this, base, &results](size_t index) {
+        auto &result = results[index];
+        for_each_lookahead(base, index, [&result](const ActionVec &action, const Affected &, float dist) {
+            result.actions.push_back(action);
+            result.dists.push_back(dist);
+        });
+    };
+
+    if ((tp == nullptr) || (n <= 1))
+        for (size_t index = 0; index < n; ++index)
+            score(index);
+    else
+    {
+        vec<std::future<void>> futures;
+        futures.reserve(n);
+        for (size_t index = 0; index < n; ++index)
+            futures.push_back(tp->push([&score, index](int) { score(index); }));
+        for (auto &future : futures)
+            future.get();
+    }
+
+    auto ret = Lookahead();
+    size_t total = 0;
+    for (const auto &result : results)
+        total += result.actions.size();
+    ret.actions.reserve(total);
+    ret.dists.reserve(total);
+    for (const auto &result : results)
+    {
+        ret.actions.insert(ret.actions.end(), result.actions.begin(), result.actions.end());
+        ret.dists.insert(ret.dists.end(), result.dists.begin(), result.dists.end());
     }
     return ret;
 }
@@ -809,9 +1407,58 @@ int ActionSpace::get_num_affected(TreeNode *node,
                                   abc_t d_pre,
                                   abc_t post,
                                   abc_t d_post,
-                                  SpecialType special_type)
+                                  SpecialType special_type) const
 {
-    Subpath subpath = Subpath();
-    apply_action(node, before, after, pre, d_pre, post, d_post, special_type, subpath);
-    return subpath.mini_node_seq[5]->get_num_affected_at(subpath.chosen_seq[6].first);
+    // Stopping does not affect any site.
+    if (before == opt.null_id)
+        return 0;
+    int count = 0;
+    for_each_match(node, Rule{before, after, pre, d_pre, post, d_post, special_type}, [&count](int, size_t) { ++count; });
+    return count;
+}
+
+vec<int> ActionSpace::get_num_affected(TreeNode *node, const vec<Rule> &rules) const
+{
+    auto counts = vec<int>(rules.size(), 0);
+    auto count = [this, node, &rules, &counts](size_t i, size_t num_sites, const auto &get_site) {
+        for (size_t j = 0; j < num_sites; ++j)
+        {
+            const auto site = get_site(j);
+            if (match_site(node->words[site.first], site.second, rules[i]))
+                ++counts[i];
+        }
+    };
+    auto is_valid = [this](const Rule &rule) { return (rule.before_id != opt.null_id) && (rule.before_id < opt.num_abc) && can_match(rule); };
+
+    // The sites of every before unit are looked up once: from the actions if the node has been fully expanded,
+    // otherwise from an index built for this batch (the node is left untouched).
+    auto slots = vec<int>(opt.num_abc, -1);
+    if (ActionManager::is_expansion_done(node))
+    {
+        for (size_t index = 1; index < node->get_num_actions(); ++index)
+            slots[node->get_action_at(index)] = index;
+        for (size_t i = 0; i < rules.size(); ++i)
+            if (is_valid(rules[i]) && (slots[rules[i].before_id] != -1))
+            {
+                const auto &aff = node->get_affected_at(slots[rules[i].before_id]);
+                count(i, aff.size(), [&aff](size_t j) { return pair<int, size_t>(aff.get_order_at(j), aff.get_position_at(j)); });
+            }
+    }
+    else
+    {
+        const auto index = build_occurrence_index(node);
+        for (size_t k = 0; k < index.units.size(); ++k)
+            slots[index.units[k]] = k;
+        for (size_t i = 0; i < rules.size(); ++i)
+            if (is_valid(rules[i]) && (slots[rules[i].before_id] != -1))
+            {
+                const size_t start = index.starts[slots[rules[i].before_id]];
+                const size_t end = index.starts[slots[rules[i].before_id] + 1];
+                count(i, end - start, [&index, start](size_t j) {
+                    const auto site = index.sites[start + j];
+                    return pair<int, size_t>(index.orders[site], index.positions[site]);
+                });
+            }
+    }
+    return counts;
 }
@@ -17,28 +17,82 @@ struct ActionSpaceOpt
     int site_threshold;
     float dist_threshold;
     size_t num_abc;
+    // Expand new tree nodes only when they are evaluated or acted upon, instead of when they are created.
+    bool defer_expansion = false;
+};
+
+// A full action (the seven choices of one step) as a rule that can be applied to any state.
+struct Rule
+{
+    abc_t before_id;
+    abc_t after_id;
+    abc_t pre_id;
+    abc_t d_pre_id;
+    abc_t post_id;
+    abc_t d_post_id;
+    SpecialType st;
+};
+
+// The seven choices of a complete action, in the order they are made.
+using ActionVec = array<abc_t, 7>;
+
+// Every complete action of a state and the distance of the state it leads to.
+struct Lookahead
+{
+    vec<ActionVec> actions;
+    vec<float> dists;
+};
+
+// Inverted index of the sites (order and position) where every unit occurs in a state. Units include the base units of
+// vowels, and are kept in order of first occurrence, i.e., the order in which a scan over the words would find them.
+struct OccurrenceIndex
+{
+    vec<abc_t> units;
+    vec<size_t> starts; // Sites of `units[i]` are `sites[starts[i]: starts[i + 1]]`.
+    vec<size_t> sites;  // Indices into the per-site arrays below.
+
+    vec<int> orders;
+    vec<size_t> positions;
+    vec<float> misalign_scores;
 };
 
 class Env;
 class Mcts;
+class BeamSearch;
+
+using ActionVisitor = std::function<void(const ActionVec &, const Affected &)>;
+// Called with every complete action, its affected sites and the distance it leads to.
+using LookaheadVisitor = std::function<void(const ActionVec &, const Affected &, float)>;
 
 class ActionSpace
 {
     friend Env;
     friend Mcts;
+    friend BeamSearch;
 
     WordSpace *word_space;
 
     Subpath get_best_subpath(TreeNode *, const SelectionOpt &) const;
     MiniNode *get_mini_node(TreeNode *, BaseNode *, const ChosenChar &, ActionPhase, bool) const;
-    IdSeq change_id_seq(const IdSeq &, const vec<size_t> &, abc_t, SpecialType);
-    void update_affected(BaseNode *, abc_t, int, size_t, map<abc_t, size_t> &, bool, abc_t) const;
-    void update_affected_impl(BaseNode *, abc_t, int, size_t, map<abc_t, size_t> &, abc_t) const;
+    IdSeq change_id_seq(const IdSeq &, const vec<size_t> &, abc_t, SpecialType) const;
+    void update_affected(BaseNode *, abc_t, int, size_t, DenseMap<size_t> &, bool, abc_t) const;
+    void update_affected_impl(BaseNode *, abc_t, int, size_t, DenseMap<size_t> &, abc_t) const;
     void update_affected_with_after_id(MiniNode *, const Affected &, abc_t) const;
     // void update_affected(BaseNode *, const IdSeq &, int, size_t, int, map<abc_t, size_t> &);
 
+    // Build the index over the words at the given orders (which should be sorted), or over all words.
+    OccurrenceIndex build_occurrence_index(const TreeNode *, const vec<int> &) const;
+    OccurrenceIndex build_occurrence_index(const TreeNode *) const;
+    // Add the root actions of a state whose words differ from those of the (expanded) parent only at the given orders.
+    void derive_actions(TreeNode *, const TreeNode *, const vec<int> &) const;
+
     // Methods for expanding nodes.
+    // Expand the node if needed. Deferred nodes are derived from their parents if possible. This is the hook to call
+    // before reading the actions of a tree node that might have been created with deferred expansion.
     void expand(TreeNode *) const;
+    // Expand a child of `parent` incrementally if the parent has been expanded. Only words at the given orders are
+    // different.
+    void expand(TreeNode *, const TreeNode *, const vec<int> &) const;
     void expand(MiniNode *, const Subpath &, bool, bool) const;
     void expand_before(MiniNode *, int) const;
     void expand_special_type(MiniNode *, BaseNode *, int, abc_t, bool) const;
@@ -49,19 +103,73 @@ class ActionSpace
     void expand_normal(MiniNode *, BaseNode *, int, int, bool, bool, bool, abc_t) const;
     void expand_null(MiniNode *, BaseNode *, int) const;
     bool expand_null_only(MiniNode *, BaseNode *, int) const;
+    // Depth-first search below `parent` (at phase `length`) for `for_each_action`.
+    void visit_actions(TreeNode *, BaseNode *, Subpath &, int, bool, ActionVec &, const ActionVisitor &) const;
+    // Visit every complete action (with its affected sites) below the root action at the given index in depth-first
+    // order, taking only the first d_post of every path. Only the mini nodes on the current path are held at a time. If
+    // not `materialize`, they are built on the side and released once visited, leaving the tree untouched (apart from
+    // expanding the root).
+    void for_each_action(TreeNode *, size_t, bool, const ActionVisitor &) const;
+    // Collect the actions below every given root action, in parallel across root actions with the given pool (if any).
+    vec<vec<ActionVec>> enumerate_actions(TreeNode *, const vec<size_t> &, bool, Pool *) const;
     vec<vec<abc_t>> expand_all_actions(TreeNode *) const;
+    // Visit every complete action below the root action at the given index, in the order of `for_each_action`, with the
+    // distance it leads to. Only the changed words are scored, and no node (or word) is created.
+    void for_each_lookahead(TreeNode *, size_t, const LookaheadVisitor &) const;
+    // Get the distance reached by every complete action, in the order of `expand_all_actions`, in parallel across root
+    // actions with the given pool (if any). Only the changed words are scored, and no node (or word) is created.
+    Lookahead get_lookahead(TreeNode *, Pool *) const;
 
     void evaluate(MiniNode *) const;
+    // The after ids and the context units (both sorted) that actions of the mini nodes below this node might use, i.e.,
+    // the columns of the priors that are kept when it is evaluated. After ids that are only forced by applying a rule
+    // are left out.
+    pair<vec<abc_t>, vec<abc_t>> get_prior_chars(const TreeNode *) const;
     // This will create a new tree node without checking first if the child exists. Use `apply_action` in `Env` if checking is needed.
-    TreeNode *apply_new_action(TreeNode *, const Subpath &);
+    // The expansion of the new node is deferred if `defer` is set, even if `defer_expansion` is not.
+    TreeNode *apply_new_action(TreeNode *, const Subpath &, bool = false);
+    // Get the tree node with the positions (grouped by order) changed, and the sorted list of the changed orders.
+    TreeNode *get_changed_node(TreeNode *, const DenseMap<vec<size_t>> &, abc_t, SpecialType, vec<int> &);
+    // Expand (or defer the expansion of) a child that differs from its parent at the given orders.
+    void expand_child(TreeNode *, TreeNode *, const vec<int> &, bool = false) const;
+    // Apply a rule directly, without going through (and creating) the mini nodes. Stopping is the exception.
     TreeNode *apply_action(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType);
+    // Apply a rule by walking down the mini nodes, which are recorded in the subpath.
     TreeNode *apply_action(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType, Subpath &);
-    int get_num_affected(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType);
+    // Apply a rule to the words in place, without creating any node. Return whether any site has been affected.
+    bool apply_rule(vec<Word *> &, const Rule &);
+    // Methods for matching rules directly against the words. They follow the expansion of the mini nodes: a site is
+    // matched iff it would be in the affected list of the last chosen action.
+    // Whether `unit` at some site provides the action `target`, same as `update_affected`.
+    bool match_unit(abc_t, abc_t, bool) const;
+    // Whether the context `target` at the offset is available for the site, same as `expand_normal`.
+    bool match_context(const Word *, size_t, int, bool, abc_t, bool, bool) const;
+    // Whether only the null action is available after `unit`, same as `expand_null_only`.
+    bool is_null_like(abc_t) const;
+    // Whether the rule can match any site at all, i.e., whether the special type and the after id are available.
+    bool can_match(const Rule &) const;
+    // Whether a site of the before unit is matched by the rest of the rule.
+    bool match_site(const Word *, size_t, const Rule &) const;
+    // Call `fn(order, position)` for every site matched by the rule. Expanded nodes only check the sites of the before
+    // unit, otherwise the words are scanned.
+    template <class F>
+    void for_each_match(const TreeNode *, const Rule &, F &&) const;
+    template <class F>
+    void for_each_match(const vec<Word *> &, const Rule &, F &&) const;
+    // Count the sites affected by a rule (zero if none), without creating any node.
+    int get_num_affected(TreeNode *, abc_t, abc_t, abc_t, abc_t, abc_t, abc_t, SpecialType) const;
+    // Count the sites affected by every rule.
+    vec<int> get_num_affected(TreeNode *, const vec<Rule> &) const;
     void register_permissible_change(abc_t, abc_t);
     void register_cl_map(abc_t, abc_t);
     void register_gbj_map(abc_t, abc_t);
     void register_gbw_map(abc_t, abc_t);
     void evaluate(TreeNode *, const vec<vec<float>> &, const vec<float> &);
+    // Evaluate with one row of the block. The node only keeps the columns of `get_prior_chars` (and its befores).
+    void evaluate(TreeNode *, const PriorBlockPtr &, size_t);
+    // Evaluate every node that is still a leaf with its row of the block. Other nodes (duplicates or nodes evaluated
+    // earlier) are skipped.
+    void evaluate(const vec<TreeNode *> &, const PriorBlockPtr &);
 
     void connect(BaseNode *, const Subpath &) const;
 
@@ -0,0 +1,192 @@
+#include "beam.hpp"
+
+namespace
+{
+    // Order candidates by distance, then by the order in which they are visited.
+    template <class C>
+    bool is_better(const C &c1, const C &c2)
+    {
+        return std::tie(c1.dist, c1.hyp_index, c1.root_index, c1.seq) < std::tie(c2.dist, c2.hyp_index, c2.root_index, c2.seq);
+    }
+} // namespace
+
+BeamSearch::BeamSearch(Env *env, const BeamSearchOpt &opt) : env(env), opt(opt)
+{
+    if (opt.num_threads > 1)
+        tp = new Pool(opt.num_threads);
+    else
+        tp = nullptr;
+}
+
+BeamSearch::~BeamSearch() { delete tp; }
+
+void BeamSearch::parallel_for(size_t n, const std::function<void(size_t)> &fn) const
+{
+    if ((tp == nullptr) || (n <= 1))
+    {
+        for (size_t i = 0; i < n; ++i)
+            fn(i);
+        return;
+    }
+    vec<std::future<void>> results;
+    results.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+        results.push_back(tp->push([&fn, i](int) { fn(i); }));
+    // Errors are propagated through the futures.
+    for (auto &result : results)
+        result.get();
+}
+
+void BeamSearch::compute_words(Candidate &c, const TreeNode *node) const
+{
+    // Positions grouped by order.
+    auto order2pos = map<int, vec<size_t>>();
+    auto orders = vec<int>();
+    for (const auto &site : c.sites)
+    {
+        auto &positions = order2pos[site.first];
+        if (positions.empty())
+            orders.push_back(site.first);
+        positions.push_back(site.second);
+    }
+    std::sort(orders.begin(), orders.end());
+    c.key = 0;
+    const auto st = static_cast<SpecialType>(c.action[1]);
+    for (const int order : orders)
+    {
+        const auto &id_seq = node->words[order]->id_seq;
+        auto new_id_seq = env->action_space->change_id_seq(id_seq, order2pos.at(order), c.action[2], st);
+        if (new_id_seq == id_seq)
+            continue;
+        boost::hash_combine(c.key, order);
+        boost::hash_combine(c.key, new_id_seq);
+        c.words.push_back({order, std::move(new_id_seq)});
+    }
+    c.has_words = true;
+}
+
+void BeamSearch::prune(vec<Candidate> &candidates, const TreeNode *node) const
+{
+    std::sort(candidates.begin(), candidates.end(), is_better<Candidate>);
+    // Kept candidates by key. Keys might collide, so candidates with the same key are compared in full.
+    auto key2kept = map<size_t, vec<size_t>>();
+    size_t n = 0;
+    for (size_t i = 0; (i < candidates.size()) && (n < opt.beam_size); ++i)
+    {
+        if (!candidates[i].has_words)
+            compute_words(candidates[i], node);
+        auto &kept = key2kept[candidates[i].key];
+        bool is_duplicate = false;
+        for (const auto j : kept)
+            is_duplicate = is_duplicate || (candidates[j].words == candidates[i].words);
+        if (is_duplicate)
+            continue;
+        kept.push_back(n);
+        if (n != i)
+            candidates[n] = std::move(candidates[i]);
+        ++n;
+    }
+    candidates.resize(n);
+}
+
+vec<BeamSearch::Candidate> BeamSearch::score(TreeNode *node, size_t hyp_index, size_t root_index) const
+{
+    auto candidates = vec<BeamSearch::Candidate>();
+    // Prune once in a while so that only a few candidates are held at a time.
+    const size_t capacity = std::max<size_t>(opt.beam_size * 4, 64);
+    candidates.reserve(capacity);
+    const abc_t null_id = env->action_space->opt.null_id;
+    size_t seq = 0;
+    env->action_space->for_each_lookahead(node, root_index, [&](const ActionVec &action, const Affected &aff, float dist) {
+        // Stopping is not a step.
+        if (action[0] == null_id)
+            return;
+        auto sites = vec<pair<int, size_t>>();
+        sites.reserve(aff.size());
+        for (size_t i = 0; i < aff.size(); ++i)
+            sites.push_back({aff.get_order_at(i), aff.get_position_at(i)});
+        candidates.push_back(Candidate{dist, hyp_index, root_index, seq++, action, std::move(sites), false, {}, 0});
+        if (candidates.size() >= capacity)
+            prune(candidates, node);
+    });
+    prune(candidates, node);
+    return candidates;
+}
+
+vec<Hypothesis> BeamSearch::step(const vec<Hypothesis> &beam)
+{
+    auto next = vec<Hypothesis>();
+    auto seen = set<TreeNode *>();
+    // Done states are not expanded any further.
+    auto tasks = vec<pair<size_t, size_t>>();
+    for (size_t i = 0; i < beam.size(); ++i)
+        if (beam[i].node->is_done())
+        {
+            if (seen.insert(beam[i].node).second)
+                next.push_back(beam[i]);
+        }
+        else
+        {
+            env->action_space->expand(beam[i].node);
+            for (size_t index = 0; index < beam[i].node->get_num_actions(); ++index)
+                tasks.push_back({i, index});
+        }
+
+    auto results = vec<vec<Candidate>>(tasks.size());
+    parallel_for(tasks.size(), [this, &beam, &tasks, &results](size_t t) {
+        const auto &task = tasks[t];
+        results[t] = score(beam[task.first].node, task.first, task.second);
+    });
+    auto candidates = vec<Candidate>();
+    for (const auto &result : results)
+        candidates.insert(candidates.end(), result.begin(), result.end());
+    std::sort(candidates.begin(), candidates.end(), is_better<Candidate>);
+
+    // Apply the best candidates in parallel, as many as there are open slots, until the beam is full. Candidates that
+    // lead to a state already in the beam are skipped.
+    size_t start = 0;
+    while ((next.size() < opt.beam_size) && (start < candidates.size()))
+    {
+        const size_t end = std::min(start + opt.beam_size - next.size(), candidates.size());
+        auto nodes = vec<TreeNode *>(end - start);
+        parallel_for(end - start, [this, &beam, &candidates, &nodes, start](size_t i) {
+            const auto &c = candidates[start + i];
+            const auto &a = c.action;
+            nodes[i] = env->action_space->apply_action(beam[c.hyp_index].node, a[0], a[2], a[3], a[4], a[5], a[6], static_cast<SpecialType>(a[1]));
+        });
+        {
+            std::lock_guard<std::mutex> cache_lock(env->cache_mtx);
+            for (const auto node : nodes)
+                env->cache.put(node);
+        }
+        for (size_t i = 0; (i < nodes.size()) && (next.size() < opt.beam_size); ++i)
+            if (seen.insert(nodes[i]).second)
+            {
+                const auto &c = candidates[start + i];
+                auto hyp = Hypothesis{nodes[i], beam[c.hyp_index].actions};
+                hyp.actions.push_back(c.action);
+                next.push_back(std::move(hyp));
+            }
+        start = end;
+    }
+    std::stable_sort(next.begin(), next.end(), [](const Hypothesis &h1, const Hypothesis &h2) { return h1.node->get_dist() < h2.node->get_dist(); });
+    return next;
+}
+
+vec<Hypothesis> BeamSearch::search(TreeNode *node, int depth)
+{
+    auto beam = vec<Hypothesis>{Hypothesis{node, vec<ActionVec>()}};
+    for (int d = 0; d < depth; ++d)
+    {
+        bool all_done = true;
+        for (const auto &hyp : beam)
+            all_done = all_done && hyp.node->is_done();
+        if (all_done)
+            break;
+        auto next = step(beam);
+        if (next.empty())
+            break;
+        beam = std::move(next);
+    }
+    return beam;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.hpp"
+#include "env.hpp"
+#include "node.hpp"
+
+struct BeamSearchOpt
+{
+    // Number of states kept at every depth.
+    size_t beam_size;
+    int num_threads;
+};
+
+// A state in the beam with the actions that lead to it from the start of the search.
+struct Hypothesis
+{
+    TreeNode *node;
+    vec<ActionVec> actions;
+};
+
+// Beam search over the complete actions of `ActionSpace`. At every depth, every action of every state in the beam is
+// scored with a one-step lookahead, and the `beam_size` best distinct states (by `get_dist`) are kept. States are
+// deduplicated through the transposition table, so different actions (or hypotheses) that lead to the same state only
+// take one slot. Done states stay in the beam as they are. New states are registered with the cache of the
+// environment, so they are released by `Env::evict` like the nodes created by `Mcts`.
+class BeamSearch
+{
+    Pool *tp;
+    Env *env;
+
+    struct Candidate
+    {
+        float dist;
+        size_t hyp_index;
+        size_t root_index;
+        size_t seq; // Order of visit below the root action, used to break ties.
+        ActionVec action;
+        vec<pair<int, size_t>> sites; // Affected sites as (order, position).
+        // Words changed by the action as (order, new id sequence), computed when the candidate is first considered by
+        // `prune`. Words that stay the same are left out, so that candidates of the same hypothesis lead to the same
+        // state iff they have the same words, even with different special types or sites.
+        bool has_words = false;
+        vec<pair<int, IdSeq>> words;
+        size_t key; // Hash of the changed words.
+    };
+
+    // Run `fn(i)` for every `i` in `[0, n)` on the thread pool.
+    void parallel_for(size_t, const std::function<void(size_t)> &) const;
+    // Compute the changed words of a candidate of the given state.
+    void compute_words(Candidate &, const TreeNode *) const;
+    // Keep the best `beam_size` candidates (of the given state) that lead to distinct states, sorted by distance (then by
+    // the order of visit).
+    void prune(vec<Candidate> &, const TreeNode *) const;
+    // Score every action below the root action of the hypothesis at the given indices, keeping only the best candidates.
+    vec<Candidate> score(TreeNode *, size_t, size_t) const;
+
+public:
+    const BeamSearchOpt opt;
+
+    BeamSearch(Env *, const BeamSearchOpt &);
+    ~BeamSearch();
+
+    // Expand the beam by one depth. Return the new beam sorted by distance, which is empty if no action is available.
+    vec<Hypothesis> step(const vec<Hypothesis> &);
+    // Run `depth` steps from the given node. Return the last beam, sorted by distance.
+    vec<Hypothesis> search(TreeNode *, int);
+};
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include <algorithm>
 #include <limits>
 #include <boost/functional/hash.hpp>
@@ -123,6 +124,91 @@ enum class PlayStrategy : int
     SAMPLE_MV
 };
 
+// Counter-based random stream. The k-th draw only depends on (seed, stream id, k), so a stream gives the same numbers
+// no matter which thread consumes it. It satisfies `UniformRandomBitGenerator` and can be used with `<random>`.
+class RandomStream
+{
+    uint64_t key;
+    uint64_t counter = 0;
+
+    // SplitMix64 finalizer.
+    static inline uint64_t mix(uint64_t z)
+    {
+        z += 0x9e3779b97f4a7c15;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+public:
+    using result_type = uint64_t;
+
+    RandomStream(uint64_t seed, uint64_t stream_id) : key(mix(mix(seed) ^ stream_id)){};
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+    inline result_type operator()() { return mix(key ^ mix(counter++)); }
+    // Uniform float in [0, high).
+    inline float randf(float high) { return high * static_cast<float>((*this)() >> 40) / static_cast<float>(1 << 24); }
+    // Uniform integer in [0, high).
+    inline size_t randint(size_t high) { return (*this)() % high; }
+};
+
+// Map from small dense integer keys (units, word orders) to values, backed by plain arrays. It is meant to be reused as
+// scratch space (e.g., `thread_local`): `clear` only resets the keys touched since the last call, and keeps the memory
+// (including the capacity of vector values).
+template <class V>
+class DenseMap
+{
+    vec<V> values;
+    vec<bool> present;
+    vec<size_t> touched;
+
+    template <class T>
+    static inline void reset(vec<T> &value) { value.clear(); }
+    template <class T>
+    static inline void reset(T &value) { value = T(); }
+
+public:
+    inline void reserve(size_t num_keys)
+    {
+        if (values.size() < num_keys)
+        {
+            values.resize(num_keys);
+            present.resize(num_keys, false);
+        }
+    }
+    inline bool contains(size_t key) const { return (key < present.size()) && present[key]; }
+    inline V &operator[](size_t key)
+    {
+        if (key >= values.size())
+            reserve(std::max(key + 1, 2 * values.size()));
+        if (!present[key])
+        {
+            present[key] = true;
+            touched.push_back(key);
+        }
+        return values[key];
+    }
+    inline const V &at(size_t key) const
+    {
+        assert(contains(key));
+        return values[key];
+    }
+    // Keys in the order they were first touched.
+    inline const vec<size_t> &keys() const { return touched; }
+    inline size_t size() const { return touched.size(); }
+    inline void clear()
+    {
+        for (const auto key : touched)
+        {
+            present[key] = false;
+            reset(values[key]);
+        }
+        touched.clear();
+    }
+};
+
 template <class K, class V>
 class Trie;
 
@@ -150,6 +236,8 @@ class Trie
 private:
     TrieNode<K, V> *root;
     const V default_value;
+    // Guards the check-and-set of values so that concurrent lookups of the same key end up with the same value.
+    std::mutex mtx;
 
     vec<TrieNode<K, V> *> get_path(const vec<K> &key)
     {
@@ -179,6 +267,7 @@ public:
     bool get(const vec<K> &key, V &new_value)
     {
         auto node = locate_key(key);
+        std::lock_guard<std::mutex> lock(mtx);
         if (default_value == node->value)
         {
             node->value = new_value;
@@ -191,6 +280,20 @@ public:
         }
     };
 
+    // Look up the value associated with a key without inserting anything. Return whether it exists.
+    bool find(const vec<K> &key, V &value)
+    {
+        TrieNode<K, V> *node = root;
+        for (const K k : key)
+            if (!node->children.if_contains(k, [&node](TrieNode<K, V> *const &child) { node = child; }))
+                return false;
+        std::lock_guard<std::mutex> lock(mtx);
+        if (default_value == node->value)
+            return false;
+        value = node->value;
+        return true;
+    }
+
     // Remove the value associted with the key.
     void remove(const vec<K> &key)
     {
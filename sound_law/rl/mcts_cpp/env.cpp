@@ -32,15 +32,30 @@ Env::Env(const EnvOpt &env_opt, const ActionSpaceOpt &as_opt, const WordSpaceOpt
     cache = LruCache();
 }
 
-TreeNode *Env::apply_action(TreeNode *node, const Subpath &subpath)
+Env::~Env() { delete tp; }
+
+Pool *Env::get_pool(size_t num_threads) const
+{
+    if (num_threads <= 1)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(tp_mtx);
+    if (tp == nullptr)
+        tp = new Pool(num_threads);
+    else if (static_cast<size_t>(tp->size()) < num_threads)
+        tp->resize(num_threads);
+    return tp;
+}
+
+TreeNode *Env::apply_action(TreeNode *node, const Subpath &subpath, bool defer_expansion)
 {
     auto *last = static_cast<TransitionNode *>(subpath.mini_node_seq[5]);
     int last_child_index = subpath.chosen_seq[6].first;
     // BaseNode *&child = last->children[last_child_index];
     BaseNode *child;
+    std::unique_lock<std::mutex> last_lock(LockManager::get_mutex(last));
     if (!last->has_child(last_child_index))
     {
-        child = action_space->apply_new_action(node, subpath);
+        child = action_space->apply_new_action(node, subpath, defer_expansion);
         float reward;
         if (subpath.stopped)
             reward = -opt.step_penalty;
@@ -55,6 +70,9 @@ TreeNode *Env::apply_action(TreeNode *node, const Subpath &subpath)
     }
     else
         child = last->get_child(last_child_index);
+    last_lock.unlock();
+
+    std::lock_guard<std::mutex> cache_lock(cache_mtx);
     for (const auto node : subpath.mini_node_seq)
         cache.put(static_cast<BaseNode *>(node));
     cache.put(static_cast<BaseNode *>(child));
@@ -73,3 +91,71 @@ size_t Env::evict(size_t until_size)
     SPDLOG_TRACE("After evicting #items: {}", cache.size());
     return size_before;
 };
+
+size_t Env::evict_siblings(TreeNode *old_root, TreeNode *new_root)
+{
+    // Collect everything first -- releasing nodes modifies the edges that are being traversed.
+    auto to_evict = Traverser::orphans(old_root, new_root);
+
+    std::lock_guard<std::mutex> cache_lock(cache_mtx);
+    size_t size_before = cache.size();
+    for (const auto node : to_evict)
+        cache.evict(node);
+    SPDLOG_DEBUG("Env: {} nodes evicted, {} nodes left in the cache.", size_before - cache.size(), cache.size());
+    return size_before - cache.size();
+}
+
+vec<CascadeResult> Env::apply_rules(const vec<VocabIdSeq> &start_ids_batch, const vec<Rule> &rules, size_t num_threads)
+{
+    const size_t n = start_ids_batch.size();
+    auto results = vec<CascadeResult>(n);
+    auto apply = [this, &start_ids_batch, &rules, &results](size_t i) {
+        const auto &start_ids = start_ids_batch[i];
+        if (start_ids.size() != word_space->end_words.size())
+            throw std::runtime_error("Each vocabulary should have the same number of words as the end state.");
+        auto words = vec<Word *>();
+        words.reserve(start_ids.size());
+        for (size_t order = 0; order < start_ids.size(); ++order)
+        {
+            auto word = word_space->get_word(start_ids[order]);
+            word_space->set_edit_dist_at(word, order);
+            words.push_back(word);
+        }
+        auto get_dist = [&words]() {
+            float dist = 0.0;
+            for (size_t order = 0; order < words.size(); ++order)
+                dist += words[order]->get_edit_dist_at(order);
+            return dist;
+        };
+
+        auto &result = results[i];
+        result.dists.reserve(rules.size() + 1);
+        result.applied.reserve(rules.size());
+        result.dists.push_back(get_dist());
+        for (const auto &rule : rules)
+        {
+            bool applied = action_space->apply_rule(words, rule);
+            result.applied.push_back(applied);
+            result.dists.push_back(applied ? get_dist() : result.dists.back());
+        }
+        result.ids.reserve(words.size());
+        for (const auto word : words)
+            result.ids.push_back(word->id_seq);
+    };
+
+    auto tp = get_pool(num_threads);
+    if ((tp == nullptr) || (n <= 1))
+    {
+        for (size_t i = 0; i < n; ++i)
+            apply(i);
+        return results;
+    }
+    // One task per vocabulary since cascades can be long. Errors are propagated through the futures.
+    vec<std::future<void>> futures;
+    futures.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+        futures.push_back(tp->push([&apply, i](int) { apply(i); }));
+    for (auto &future : futures)
+        future.get();
+    return results;
+}
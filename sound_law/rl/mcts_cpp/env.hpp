@@ -14,30 +14,68 @@ struct EnvOpt
     float step_penalty;
 };
 
+// Result of applying a cascade of rules to one vocabulary.
+struct CascadeResult
+{
+    VocabIdSeq ids;    // Final id sequences.
+    vec<float> dists;  // Distance to the end state before any rule and after every rule.
+    vec<bool> applied; // Whether every rule has affected any site.
+};
+
 class Mcts;
 
 class Env
 {
     friend class Mcts;
+    friend class BeamSearch;
 
     ActionSpace *action_space;
     WordSpace *word_space;
     LruCache cache;
+    std::mutex cache_mtx;
+    // Workers shared by the parallel helpers (`apply_rules`, `enumerate_actions` and `get_lookahead`), so that calls
+    // (e.g., one per chunk of root actions) do not spawn threads of their own. Created on first use, and grown to the
+    // largest number of threads asked for.
+    mutable Pool *tp = nullptr;
+    mutable std::mutex tp_mtx;
 
-    TreeNode *apply_action(TreeNode *, const Subpath &);
+    // Return the pool with at least the given number of threads, or null if one thread is enough.
+    Pool *get_pool(size_t) const;
+
+    // Return the child reached by the subpath, creating it if needed. The expansion of a new child is deferred if the
+    // flag is set.
+    TreeNode *apply_action(TreeNode *, const Subpath &, bool = false);
 
 public:
     Env(const EnvOpt &, const ActionSpaceOpt &, const WordSpaceOpt &);
+    ~Env();
 
     const EnvOpt opt;
     TreeNode *start;
     TreeNode *end;
 
     size_t evict(size_t);
+    // Evict the siblings of the played action and their subtrees, i.e., every non-persistent node below `old_root`
+    // that is only reachable through it. Nodes that are shared with the subtree of `new_root` (or with anything else)
+    // are kept with their stats, and left to the lru side of the cache. Return the number of nodes evicted.
+    size_t evict_siblings(TreeNode *, TreeNode *);
+    // Apply a cascade of rules to every start vocabulary (with the same number of words as the end state), in
+    // parallel across vocabularies. Rules that do not affect any site are skipped. No tree node is created.
+    vec<CascadeResult> apply_rules(const vec<VocabIdSeq> &, const vec<Rule> &, size_t);
 
     // Various wrapper functions.
     inline void register_permissible_change(abc_t before, abc_t after) { action_space->register_permissible_change(before, after); };
+    inline void ensure_expanded(TreeNode *node) { action_space->expand(node); };
     inline void evaluate(TreeNode *node, const vec<vec<float>> &meta_priors, const vec<float> &special_priors) { action_space->evaluate(node, meta_priors, special_priors); };
+    inline void evaluate(TreeNode *node, const PriorBlockPtr &block, size_t row) { action_space->evaluate(node, block, row); };
+    inline void evaluate(const vec<TreeNode *> &nodes, const PriorBlockPtr &block) { action_space->evaluate(nodes, block); };
+    // Evaluate a batch of nodes with priors laid out as [n, 6, num_abc] and [n, 6]. The priors are copied into one
+    // block shared by all nodes.
+    inline void evaluate(const vec<TreeNode *> &nodes, const float *meta_priors, const float *special_priors, size_t num_abc)
+    {
+        if (!nodes.empty())
+            evaluate(nodes, PriorBlock::create(meta_priors, special_priors, nodes.size(), num_abc));
+    };
     inline float get_edit_dist(const IdSeq &seq1, const IdSeq &seq2) { return word_space->get_edit_dist(seq1, seq2); };
     inline TreeNode *apply_action(TreeNode *node,
                                   abc_t before,
@@ -47,6 +85,16 @@ public:
                                   abc_t post,
                                   abc_t d_post,
                                   SpecialType special_type) { return action_space->apply_action(node, before, after, pre, d_pre, post, d_post, special_type); };
+    // Apply a rule by walking down the mini nodes (which are recorded in the subpath), like the selection does.
+    inline TreeNode *apply_action(TreeNode *node,
+                                  abc_t before,
+                                  abc_t after,
+                                  abc_t pre,
+                                  abc_t d_pre,
+                                  abc_t post,
+                                  abc_t d_post,
+                                  SpecialType special_type,
+                                  Subpath &subpath) { return action_space->apply_action(node, before, after, pre, d_pre, post, d_post, special_type, subpath); };
     inline int get_num_affected(TreeNode *node,
                                 abc_t before,
                                 abc_t after,
@@ -55,11 +103,15 @@ public:
                                 abc_t post,
                                 abc_t d_post,
                                 SpecialType special_type) { return action_space->get_num_affected(node, before, after, pre, d_pre, post, d_post, special_type); };
+    inline vec<int> get_num_affected(TreeNode *node, const vec<Rule> &rules) { return action_space->get_num_affected(node, rules); };
     inline void register_cl_map(abc_t before, abc_t after) { action_space->register_cl_map(before, after); };
     inline void register_gbj_map(abc_t before, abc_t after) { action_space->register_gbj_map(before, after); };
     inline void register_gbw_map(abc_t before, abc_t after) { action_space->register_gbw_map(before, after); };
+    // Eagerly clear stats and priors with a bfs. Use `new_epoch` instead unless debugging.
     inline void clear_stats(TreeNode *node, bool recursive) { action_space->clear_stats(node, recursive); };
     inline void clear_priors(TreeNode *node, bool recursive) { action_space->clear_priors(node, recursive); };
+    // Start a new search epoch: stats and priors of every node are lazily cleared the first time they are used.
+    inline void new_epoch() { StatsManager::new_epoch(); };
     // inline void prune(TreeNode *node) { action_space->prune(node, false); };
     inline size_t get_num_words() { return word_space->size(); };
     inline void add_noise(TreeNode *node, const vec<vec<float>> &meta_priors, const vec<float> &special_priors, float noise_ratio) { action_space->add_noise(node, meta_priors, special_priors, noise_ratio); };
@@ -71,4 +123,6 @@ public:
         return ret;
     }
     inline vec<vec<abc_t>> expand_all_actions(TreeNode *base) const { return action_space->expand_all_actions(base); }
+    inline vec<vec<ActionVec>> enumerate_actions(TreeNode *base, const vec<size_t> &before_indices, bool materialize, size_t num_threads) const { return action_space->enumerate_actions(base, before_indices, materialize, get_pool(num_threads)); }
+    inline Lookahead get_lookahead(TreeNode *base, size_t num_threads) const { return action_space->get_lookahead(base, get_pool(num_threads)); }
 };
\ No newline at end of file
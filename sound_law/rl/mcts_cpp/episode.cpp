@@ -0,0 +1,185 @@
+#include "episode.hpp"
+
+EpisodeRunner::EpisodeRunner(Env *env,
+                             Mcts *mcts,
+                             const EpisodeOpt &opt) : env(env),
+                                                      mcts(mcts),
+                                                      batcher(mcts->tp, opt.pad_id, opt.max_end_length),
+                                                      opt(opt)
+{
+    // Ids are packed as int16.
+    if (opt.num_abc > static_cast<size_t>(std::numeric_limits<int16_t>::max()))
+        throw std::invalid_argument("The alphabet is too large for ids packed as int16.");
+}
+
+void EpisodeRunner::register_callback(EvaluateFn fn, void *ctx)
+{
+    evaluate_fn = fn;
+    context = ctx;
+}
+
+void EpisodeRunner::set_cache(EvaluationCache *cache) { this->cache = cache; }
+
+vec<float> EpisodeRunner::evaluate(const vec<TreeNode *> &all_nodes, const vec<int> &all_steps, EvaluationBatch &batch)
+{
+    const size_t num_all = all_nodes.size();
+    const size_t num_meta = 6 * opt.num_abc;
+    auto values = vec<float>(num_all, 0.0);
+
+    // Only cache misses are sent to the callback. Cache hits share one prior block.
+    auto hit_nodes = vec<TreeNode *>();
+    auto hit_meta_priors = vec<float>();
+    auto hit_special_priors = vec<float>();
+    auto nodes = vec<TreeNode *>();
+    auto steps = vec<int>();
+    auto rows = vec<size_t>();
+    for (size_t i = 0; i < num_all; ++i)
+    {
+        if (cache != nullptr)
+        {
+            const size_t k = hit_nodes.size();
+            hit_meta_priors.resize((k + 1) * num_meta);
+            hit_special_priors.resize((k + 1) * 6);
+            if (cache->lookup(all_nodes[i], all_steps[i], hit_meta_priors.data() + k * num_meta, hit_special_priors.data() + k * 6, values[i]))
+            {
+                hit_nodes.push_back(all_nodes[i]);
+                continue;
+            }
+        }
+        nodes.push_back(all_nodes[i]);
+        steps.push_back(all_steps[i]);
+        rows.push_back(i);
+    }
+    if (!hit_nodes.empty())
+    {
+        const size_t k = hit_nodes.size();
+        hit_meta_priors.resize(k * num_meta);
+        hit_special_priors.resize(k * 6);
+        mcts->evaluate(hit_nodes, PriorBlock::create(std::move(hit_meta_priors), std::move(hit_special_priors), k, opt.num_abc));
+    }
+    if (nodes.empty())
+        return values;
+
+    const size_t n = nodes.size();
+    const size_t nw = nodes[0]->size();
+    const size_t m = batcher.get_max_length(nodes);
+
+    batch.size = n;
+    batch.num_words = nw;
+    batch.max_length = m;
+    batch.max_end_length = opt.max_end_length;
+    // Padding is written by the batcher.
+    batch.ids.resize(n * nw * m);
+    batch.steps.assign(steps.begin(), steps.end());
+    if (opt.use_alignment)
+    {
+        batch.almts1.resize(n * nw * m);
+        batch.almts2.resize(n * nw * opt.max_end_length);
+        batcher.pack(nodes, m, batch.ids.data(), batch.almts1.data(), batch.almts2.data());
+    }
+    else
+        batcher.pack<int16_t>(nodes, m, batch.ids.data(), nullptr, nullptr);
+    batch.meta_priors.assign(n * 6 * opt.num_abc, 0.0);
+    batch.special_priors.assign(n * 6, 0.0);
+    batch.values.assign(n, 0.0);
+
+    evaluate_fn(context, batch);
+    if (batch.failed)
+        throw std::runtime_error("Evaluation callback failed.");
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[rows[i]] = batch.values[i];
+        if (cache != nullptr)
+            cache->insert(nodes[i], steps[i], batch.meta_priors.data() + i * num_meta, batch.special_priors.data() + i * 6, batch.values[i]);
+    }
+    // The outputs are moved into the block, and reallocated for the next batch. Duplicates and nodes visited due to
+    // rollout truncation are not leaves anymore, and are skipped.
+    mcts->evaluate(nodes, PriorBlock::create(std::move(batch.meta_priors), std::move(batch.special_priors), n, opt.num_abc));
+    return values;
+}
+
+void EpisodeRunner::add_noise(TreeNode *root)
+{
+    auto rng = RandomStream(opt.seed, stream::get_id(stream::NOISE, num_noises++));
+    auto gamma = std::gamma_distribution<float>(opt.dirichlet_alpha, 1.0);
+    auto noise = vec<float>(7 * opt.num_abc);
+    float total = 0.0;
+    for (auto &x : noise)
+    {
+        x = gamma(rng);
+        total += x;
+    }
+    auto meta_noise = vec<vec<float>>(6);
+    for (size_t k = 0; k < 6; ++k)
+    {
+        meta_noise[k] = vec<float>(opt.num_abc);
+        for (size_t i = 0; i < opt.num_abc; ++i)
+            meta_noise[k][i] = noise[k * opt.num_abc + i] / total;
+    }
+    auto special_noise = vec<float>(6);
+    for (size_t i = 0; i < 6; ++i)
+        special_noise[i] = noise[6 * opt.num_abc + i] / total;
+    env->add_noise(root, meta_noise, special_noise, opt.noise_ratio);
+}
+
+Path EpisodeRunner::run(TreeNode *root)
+{
+    assert(evaluate_fn != nullptr);
+    auto batch = EvaluationBatch();
+    if (root->is_leaf())
+        evaluate({root}, {0}, batch);
+
+    auto played_path = Path(root, 0);
+    for (int ri = 0; ri < opt.max_rollout_length; ++ri)
+    {
+        if (opt.add_noise)
+            add_noise(root);
+        const int num_batches = opt.num_sims / opt.batch_size;
+        for (int bi = 0; bi < num_batches; ++bi)
+        {
+            auto paths = mcts->select(root, opt.batch_size, ri, opt.max_rollout_length, played_path);
+
+            // Values of end states are already accounted for by the rewards. Everything else is evaluated once.
+            auto values = vec<float>(paths.size(), 0.0);
+            auto nodes = vec<TreeNode *>();
+            auto steps = vec<int>();
+            auto rows = vec<int>(paths.size(), -1);
+            // Duplicate (node, step) pairs share one row.
+            auto node2rows = map<TreeNode *, vec<int>>();
+            for (size_t i = 0; i < paths.size(); ++i)
+            {
+                auto node = paths[i].get_last_node();
+                if (node->stopped || node->is_done())
+                    continue;
+                int step = paths[i].get_depth();
+                auto &candidates = node2rows[node];
+                for (const int row : candidates)
+                    if (steps[row] == step)
+                        rows[i] = row;
+                if (rows[i] == -1)
+                {
+                    rows[i] = nodes.size();
+                    candidates.push_back(rows[i]);
+                    nodes.push_back(node);
+                    steps.push_back(step);
+                }
+            }
+            if (!nodes.empty())
+            {
+                auto node_values = evaluate(nodes, steps, batch);
+                for (size_t i = 0; i < paths.size(); ++i)
+                    if (rows[i] != -1)
+                        values[i] = node_values[rows[i]];
+            }
+            mcts->backup(paths, values);
+        }
+
+        auto new_path = mcts->play(root, ri, opt.play_strategy, opt.exponent);
+        played_path.merge(new_path);
+        root = played_path.get_last_node();
+        if (root->stopped || root->is_done())
+            break;
+    }
+    return played_path;
+}
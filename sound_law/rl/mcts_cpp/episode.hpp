@@ -0,0 +1,82 @@
+#pragma once
+
+#include <random>
+
+#include "common.hpp"
+#include "env.hpp"
+#include "eval_cache.hpp"
+#include "mcts.hpp"
+#include "state_batcher.hpp"
+
+struct EpisodeOpt
+{
+    int num_sims;
+    int batch_size;
+    int max_rollout_length;
+    PlayStrategy play_strategy;
+    float exponent;
+    // Dirichlet noise added to the root before every move.
+    bool add_noise;
+    float dirichlet_alpha;
+    float noise_ratio;
+    // Used to pack the states.
+    size_t num_abc;
+    abc_t pad_id;
+    bool use_alignment;
+    size_t max_end_length;
+    // Seed for the noise streams.
+    uint64_t seed = 0;
+};
+
+// Packed inputs and outputs of one evaluation batch. All arrays are flat and row-major.
+struct EvaluationBatch
+{
+    size_t size = 0;
+    size_t num_words = 0;
+    size_t max_length = 0;
+    size_t max_end_length = 0;
+
+    vec<int16_t> ids;    // [size, num_words, max_length], padded with `pad_id`.
+    vec<int16_t> almts1; // [size, num_words, max_length], padded with -1. Only filled if alignment is used.
+    vec<int16_t> almts2; // [size, num_words, max_end_length], padded with -1. Only filled if alignment is used.
+    vec<long> steps;     // [size]
+
+    vec<float> meta_priors;    // [size, 6, num_abc]
+    vec<float> special_priors; // [size, 6]
+    vec<float> values;         // [size]
+
+    // Set by the callback if it fails. The runner stops as soon as possible.
+    bool failed = false;
+};
+
+// The callback receives an opaque context (registered together with the callback) and a packed batch. It should fill
+// in all the outputs of the batch.
+using EvaluateFn = void (*)(void *, EvaluationBatch &);
+
+// Run whole episodes in C++. The only call back into the caller is `evaluate_fn`, once per batch.
+class EpisodeRunner
+{
+    Env *env;
+    Mcts *mcts;
+    EvaluateFn evaluate_fn = nullptr;
+    void *context = nullptr;
+    EvaluationCache *cache = nullptr;
+    StateBatcher batcher;
+    uint64_t num_noises = 0;
+
+    // Pack `nodes` that are not cached into `batch`, call the callback, and expand the nodes that are still leaves.
+    // Return the values of all nodes.
+    vec<float> evaluate(const vec<TreeNode *> &, const vec<int> &, EvaluationBatch &);
+    void add_noise(TreeNode *);
+
+public:
+    const EpisodeOpt opt;
+
+    EpisodeRunner(Env *, Mcts *, const EpisodeOpt &);
+
+    void register_callback(EvaluateFn, void *);
+    // Consult `cache` before calling the callback, and store the outputs of the callback in it. Pass null to disable.
+    void set_cache(EvaluationCache *);
+    // Run one episode from `root` and return the played path.
+    Path run(TreeNode *);
+};
@@ -0,0 +1,84 @@
+#include "eval_cache.hpp"
+
+EvaluationCache::EvaluationCache(size_t capacity, size_t num_abc, bool use_step) : capacity(capacity),
+                                                                                  num_abc(num_abc),
+                                                                                  use_step(use_step) {}
+
+EvalKey EvaluationCache::get_key(const TreeNode *node, int step) const { return EvalKey{node->words, use_step ? step : -1}; }
+
+bool EvaluationCache::lookup(const TreeNode *node, int step, float *meta_priors, float *special_priors, float &value)
+{
+    auto key = get_key(node, step);
+    std::lock_guard<std::mutex> lock(mtx);
+    auto found = entries.find(key);
+    if (found == entries.end())
+    {
+        ++num_misses;
+        return false;
+    }
+    ++num_hits;
+    auto &entry = found->second;
+    keys.splice(keys.begin(), keys, entry.it);
+    for (size_t i = 0; i < 6 * num_abc; ++i)
+        meta_priors[i] = bf16::to_float(entry.meta_priors[i]);
+    for (size_t i = 0; i < 6; ++i)
+        special_priors[i] = bf16::to_float(entry.special_priors[i]);
+    value = entry.value;
+    return true;
+}
+
+void EvaluationCache::insert(const TreeNode *node, int step, const float *meta_priors, const float *special_priors, float value)
+{
+    if (capacity == 0)
+        return;
+    auto key = get_key(node, step);
+    std::lock_guard<std::mutex> lock(mtx);
+    auto found = entries.find(key);
+    if (found != entries.end())
+    {
+        keys.splice(keys.begin(), keys, found->second.it);
+        return;
+    }
+    if (entries.size() >= capacity)
+    {
+        entries.erase(keys.back());
+        keys.pop_back();
+    }
+    keys.push_front(key);
+    auto &entry = entries[key];
+    entry.meta_priors.resize(6 * num_abc);
+    for (size_t i = 0; i < 6 * num_abc; ++i)
+        entry.meta_priors[i] = bf16::from_float(meta_priors[i]);
+    for (size_t i = 0; i < 6; ++i)
+        entry.special_priors[i] = bf16::from_float(special_priors[i]);
+    entry.value = value;
+    entry.it = keys.begin();
+}
+
+void EvaluationCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    SPDLOG_DEBUG("EvaluationCache: clearing {} entries.", entries.size());
+    entries.clear();
+    keys.clear();
+    num_hits = 0;
+    num_misses = 0;
+}
+
+size_t EvaluationCache::size()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return entries.size();
+}
+
+size_t EvaluationCache::get_num_hits()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return num_hits;
+}
+
+size_t EvaluationCache::get_num_misses()
+{
+    std::lock_guard<std::mutex> lock(mtx);
+    return num_misses;
+}
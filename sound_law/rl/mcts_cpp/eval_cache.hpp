@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstring>
+
+#include "common.hpp"
+#include "node.hpp"
+#include "word.hpp"
+
+// Priors are stored as bfloat16, i.e., the upper half of a float32 (rounded to nearest even).
+namespace bf16
+{
+    inline uint16_t from_float(float x)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        bits += 0x7fff + ((bits >> 16) & 1);
+        return static_cast<uint16_t>(bits >> 16);
+    }
+
+    inline float to_float(uint16_t x)
+    {
+        uint32_t bits = static_cast<uint32_t>(x) << 16;
+        float ret;
+        std::memcpy(&ret, &bits, sizeof(ret));
+        return ret;
+    }
+} // namespace bf16
+
+// States are identified by their words (which are never released by `WordSpace`) instead of tree nodes, so that
+// entries survive node eviction and search epochs.
+struct EvalKey
+{
+    vec<Word *> words;
+    int step;
+
+    inline bool operator==(const EvalKey &other) const { return (step == other.step) && (words == other.words); }
+};
+
+namespace std
+{
+    template <>
+    class hash<EvalKey>
+    {
+    public:
+        inline size_t operator()(const EvalKey &k) const
+        {
+            size_t seed = std::hash<int>()(k.step);
+            for (const auto word : k.words)
+                boost::hash_combine(seed, word);
+            return seed;
+        }
+    };
+}; // namespace std
+
+// A bounded LRU cache of agent outputs (priors and values) for evaluated states. It should be cleared whenever the
+// weights of the agent change.
+class EvaluationCache
+{
+    struct Entry
+    {
+        vec<uint16_t> meta_priors; // [6, num_abc]
+        array<uint16_t, 6> special_priors;
+        float value;
+        list<EvalKey>::iterator it;
+    };
+
+    // Most recently used first.
+    list<EvalKey> keys;
+    map<EvalKey, Entry> entries;
+    std::mutex mtx;
+    size_t num_hits = 0;
+    size_t num_misses = 0;
+
+    EvalKey get_key(const TreeNode *, int) const;
+
+public:
+    const size_t capacity;
+    const size_t num_abc;
+    // Whether values depend on the step (e.g., with a finite horizon). If not, steps are ignored.
+    const bool use_step;
+
+    EvaluationCache(size_t, size_t, bool);
+
+    // Write the cached meta priors ([6, num_abc]), special priors ([6]) and value of `node` at `step` to the given
+    // buffers, and return whether it was found.
+    bool lookup(const TreeNode *, int, float *, float *, float &);
+    void insert(const TreeNode *, int, const float *, const float *, float);
+    // Drop all entries and reset the counters, e.g., after the weights of the agent are updated, so that the hit rate is
+    // always that of the current weights.
+    void clear();
+    size_t size();
+    size_t get_num_hits();
+    size_t get_num_misses();
+};
@@ -18,12 +18,12 @@ class LruCache
     map<BaseNode *, list<CacheNode>::iterator> base2node_it;
     set<BaseNode *> persistent_nodes;
 
-    void evict(BaseNode *);
-
 public:
     size_t size() const;
     size_t persistent_size() const;
     void evict();
+    // Evict a specific node. Nothing happens if it is not in the cache (e.g., persistent nodes).
+    void evict(BaseNode *);
     void put(BaseNode *);
     void put_persistent(BaseNode *);
 };
\ No newline at end of file
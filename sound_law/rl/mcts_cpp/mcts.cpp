@@ -59,9 +59,17 @@ Mcts::Mcts(Env *env, const MctsOpt &opt) : env(env), opt(opt)
     else
         tp = nullptr;
     is_eval = false;
+    if (opt.root_parallel)
+        overlays = vec<StatsOverlay>(std::max(opt.num_threads, 1));
 }
 
-Path Mcts::select_single_thread(TreeNode *node, const int start_depth, const int depth_limit, const Path &old_path) const
+Path Mcts::select_single_thread(TreeNode *node,
+                               const int start_depth,
+                               const int depth_limit,
+                               const Path &old_path,
+                               uint64_t sim_index,
+                               StatsOverlay *overlay,
+                               bool defer_expansion) const
 {
     assert(!node->is_leaf());
     auto path = Path(old_path);              // This extends the old path. Used for detecting circles.
@@ -70,7 +78,10 @@ Path Mcts::select_single_thread(TreeNode *node, const int start_depth, const int
     // In `eval` mode, `add_noise` is turned off.
     if (is_eval)
         sel_opt.add_noise = false;
-    while ((new_path.get_depth() < depth_limit) && (!node->is_leaf()))
+    auto rng = RandomStream(opt.seed, stream::get_id(stream::SELECT, sim_index));
+    sel_opt.rng = &rng;
+    sel_opt.overlay = overlay;
+    while ((new_path.get_depth() < depth_limit) && !((overlay == nullptr) ? node->is_leaf() : overlay->is_leaf(node)))
     {
         // Complete sampling one action.
         SPDLOG_DEBUG("Mcts: node str\n{}", str::from(node));
@@ -78,11 +89,20 @@ Path Mcts::select_single_thread(TreeNode *node, const int start_depth, const int
         SPDLOG_DEBUG("Mcts: node subpath found.");
 
         // Add virtual loss.
-        StatsManager::virtual_select(node, subpath.chosen_seq[0].first, opt.game_count, opt.virtual_loss);
-        for (size_t i = 0; i < 6; ++i)
-            StatsManager::virtual_select(subpath.mini_node_seq[i], subpath.chosen_seq[i + 1].first, opt.game_count, opt.virtual_loss);
+        if (overlay == nullptr)
+        {
+            StatsManager::virtual_select(node, subpath.chosen_seq[0].first, opt.game_count, opt.virtual_loss);
+            for (size_t i = 0; i < 6; ++i)
+                StatsManager::virtual_select(subpath.mini_node_seq[i], subpath.chosen_seq[i + 1].first, opt.game_count, opt.virtual_loss);
+        }
+        else
+        {
+            overlay->virtual_select(node, subpath.chosen_seq[0].first, opt.game_count, opt.virtual_loss);
+            for (size_t i = 0; i < 6; ++i)
+                overlay->virtual_select(subpath.mini_node_seq[i], subpath.chosen_seq[i + 1].first, opt.game_count, opt.virtual_loss);
+        }
 
-        node = env->apply_action(node, subpath);
+        node = env->apply_action(node, subpath, defer_expansion);
         bool is_circle = path.forms_a_circle(node);
         if (is_circle)
         {
@@ -99,42 +119,169 @@ Path Mcts::select_single_thread(TreeNode *node, const int start_depth, const int
     return new_path;
 }
 
-vec<Path> Mcts::select(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit) const
+vec<Path> Mcts::select(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit)
 {
     assert(start_depth == 0);
     auto old_path = Path(root, 0);
     return select(root, num_sims, start_depth, depth_limit, old_path);
 }
 
-vec<Path> Mcts::select(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit, const Path &old_path) const
+vec<Path> Mcts::select(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit, const Path &old_path)
 {
     SPDLOG_DEBUG("Mcts: selecting...");
     auto paths = vec<Path>();
     paths.reserve(num_sims);
+    // Simulation indices are assigned before dispatching so that they don't depend on thread scheduling.
+    const uint64_t first_sim = num_sims_started;
+    num_sims_started += num_sims;
+    if (opt.root_parallel)
+        return select_root_parallel(root, num_sims, start_depth, depth_limit, old_path, first_sim);
+    // Simulations are selected in order so that the virtual losses they see never depend on thread scheduling. With a
+    // thread pool, new leaves are expanded in parallel afterwards, which gives the same nodes as expanding them right
+    // away since leaves are never selected from.
+    for (size_t i = 0; i < num_sims; ++i)
+        paths.push_back(select_single_thread(root, start_depth, depth_limit, old_path, first_sim + i, nullptr, tp != nullptr));
+    if (tp != nullptr)
+        expand_leaves(paths);
+    SPDLOG_DEBUG("Mcts: selected.");
+    return paths;
+}
+
+void Mcts::expand_leaves(const vec<Path> &paths) const
+{
+    auto leaves = vec<TreeNode *>();
+    auto seen = set<TreeNode *>();
+    for (const auto &path : paths)
+    {
+        auto node = path.get_last_node();
+        // Stopped nodes are never expanded by the selection.
+        if (seen.insert(node).second && !node->stopped && !node->is_expanded())
+            leaves.push_back(node);
+    }
+    const size_t num_leaves = leaves.size();
+    SPDLOG_DEBUG("Mcts: expanding {} leaves.", num_leaves);
+
+    // Leaves are distinct, and their parents have been expanded already.
+    auto apply = [this, &leaves](size_t start, size_t end) {
+        for (size_t j = start; j < end; ++j)
+            env->ensure_expanded(leaves[j]);
+    };
+    const size_t num_chunks = std::min(static_cast<size_t>(opt.num_threads), num_leaves);
+    if ((tp == nullptr) || (num_chunks <= 1))
+        apply(0, num_leaves);
+    else
+    {
+        const size_t chunk_size = (num_leaves + num_chunks - 1) / num_chunks;
+        vec<std::future<void>> results;
+        results.reserve(num_chunks);
+        for (size_t start = 0; start < num_leaves; start += chunk_size)
+        {
+            size_t end = std::min(start + chunk_size, num_leaves);
+            results.push_back(tp->push([&apply, start, end](int) { apply(start, end); }));
+        }
+        for (auto &result : results)
+            result.wait();
+    }
+}
+
+vec<Path> Mcts::select_root_parallel(TreeNode *root,
+                                     const int num_sims,
+                                     const int start_depth,
+                                     const int depth_limit,
+                                     const Path &old_path,
+                                     uint64_t first_sim)
+{
+    // Simulation `i` always goes to worker `i % num_workers`, and every worker runs its simulations in order with its
+    // own overlay. Workers only share the node graph (expansion, evaluation and pruning), never stats.
+    const size_t num_workers = overlays.size();
+    auto paths = vec<Path>(num_sims);
+    auto run = [this, root, num_sims, start_depth, depth_limit, first_sim, num_workers, &old_path, &paths](size_t w) {
+        for (size_t i = w; i < static_cast<size_t>(num_sims); i += num_workers)
+        {
+            paths[i] = select_single_thread(root, start_depth, depth_limit, old_path, first_sim + i, &overlays[w]);
+            paths[i].overlay_id = w;
+        }
+    };
     if (tp == nullptr)
-        for (size_t i = 0; i < num_sims; ++i)
-            paths.push_back(select_single_thread(root, start_depth, depth_limit, old_path));
+        for (size_t w = 0; w < num_workers; ++w)
+            run(w);
     else
     {
-        vec<std::future<void>> results(num_sims);
-        paths.resize(num_sims);
-        for (size_t i = 0; i < num_sims; ++i)
-            results[i] = tp->push(
-                [this, root, start_depth, depth_limit, i, &old_path, &paths](int) {
-                    paths[i] = this->select_single_thread(root, start_depth, depth_limit, old_path);
-                });
-        for (size_t i = 0; i < num_sims; ++i)
-            results[i].wait();
+        vec<std::future<void>> results;
+        results.reserve(num_workers);
+        for (size_t w = 0; w < num_workers; ++w)
+            results.push_back(tp->push([&run, w](int) { run(w); }));
+        for (auto &result : results)
+            result.wait();
+    }
+    SPDLOG_DEBUG("Mcts: selected with {} workers.", num_workers);
+    return paths;
+}
+
+void Mcts::start_lockstep(size_t num_episodes)
+{
+    if (opt.root_parallel)
+        throw std::runtime_error("Lockstep selection is not supported in root-parallel mode.");
+    overlays = vec<StatsOverlay>(num_episodes, StatsOverlay(true));
+}
+
+vec<vec<Path>> Mcts::select_lockstep(const vec<TreeNode *> &roots,
+                                     const int num_sims,
+                                     const vec<int> &start_depths,
+                                     const int depth_limit,
+                                     const vec<Path> &old_paths,
+                                     const vec<int> &episode_ids)
+{
+    assert(roots.size() == start_depths.size());
+    assert(roots.size() == old_paths.size());
+    assert(roots.size() == episode_ids.size());
+    if (opt.root_parallel)
+        throw std::runtime_error("Lockstep selection is not supported in root-parallel mode.");
+    for (const auto id : episode_ids)
+        if ((id < 0) || (static_cast<size_t>(id) >= overlays.size()))
+            throw std::out_of_range("Episode id out of range. Call `start_lockstep` first.");
+    SPDLOG_DEBUG("Mcts: selecting for {} roots in lockstep...", roots.size());
+    const size_t num_roots = roots.size();
+    auto paths = vec<vec<Path>>(num_roots, vec<Path>(num_sims));
+    // Simulation `j` of root `k` always gets the same random stream, regardless of thread scheduling.
+    const uint64_t first_sim = num_sims_started;
+    num_sims_started += num_roots * num_sims;
+    // Every episode runs its simulations in order with its own overlay, just like a search of its own.
+    auto run = [this, num_sims, depth_limit, first_sim, &roots, &start_depths, &old_paths, &episode_ids, &paths](size_t k) {
+        auto &overlay = overlays[episode_ids[k]];
+        // The root has been evaluated before the search, for this episode as well.
+        overlay.add_evaluated(roots[k]);
+        for (int j = 0; j < num_sims; ++j)
+        {
+            paths[k][j] = select_single_thread(roots[k], start_depths[k], depth_limit, old_paths[k], first_sim + k * num_sims + j, &overlay);
+            paths[k][j].overlay_id = episode_ids[k];
+        }
+    };
+    if (tp == nullptr)
+        for (size_t k = 0; k < num_roots; ++k)
+            run(k);
+    else
+    {
+        vec<std::future<void>> results;
+        results.reserve(num_roots);
+        for (size_t k = 0; k < num_roots; ++k)
+            results.push_back(tp->push([&run, k](int) { run(k); }));
+        for (auto &result : results)
+            result.wait();
     }
     SPDLOG_DEBUG("Mcts: selected.");
     return paths;
 }
 
-TreeNode *Mcts::select_one_step(TreeNode *root, bool policy_only, bool random_select) const
+void Mcts::store_episode_stats(int episode_id) { overlays.at(episode_id).store(); }
+
+TreeNode *Mcts::select_one_step(TreeNode *root, bool policy_only, bool random_select)
 {
     auto sel_opt = opt.selection_opt;
     sel_opt.policy_only = policy_only;
     sel_opt.random_select = random_select;
+    auto rng = RandomStream(opt.seed, stream::get_id(stream::ONE_STEP, num_one_steps++));
+    sel_opt.rng = &rng;
     auto subpath = env->action_space->get_best_subpath(root, sel_opt);
     auto new_node = env->apply_action(root, subpath);
     // HACK(j_luo)
@@ -148,8 +295,8 @@ TreeNode *Mcts::select_one_step(TreeNode *root, bool policy_only, bool random_se
     return new_node;
 }
 
-TreeNode *Mcts::select_one_pi_step(TreeNode *root) const { return select_one_step(root, true, false); }
-TreeNode *Mcts::select_one_random_step(TreeNode *root) const { return select_one_step(root, false, true); }
+TreeNode *Mcts::select_one_pi_step(TreeNode *root) { return select_one_step(root, true, false); }
+TreeNode *Mcts::select_one_random_step(TreeNode *root) { return select_one_step(root, false, true); }
 
 void Mcts::eval() { is_eval = true; }
 void Mcts::train() { is_eval = false; }
@@ -157,26 +304,161 @@ void Mcts::train() { is_eval = false; }
 void Mcts::backup(const vec<Path> &paths, const vec<float> &values) const
 {
     assert(paths.size() == values.size());
+    // Paths of lockstep episodes are selected with overlays as well.
+    if (opt.root_parallel || (!paths.empty() && (paths[0].overlay_id >= 0)))
+    {
+        overlay_backup(paths, values);
+        return;
+    }
     for (size_t i = 0; i < paths.size(); i++)
+        backup_path(paths[i], values[i]);
+}
+
+void Mcts::backup_path(const Path &path, float value) const
+{
+    StatsOverlay *overlay = (path.overlay_id >= 0) ? &overlays[path.overlay_id] : nullptr;
+    float rtg = 0.0;
+    // Since the edge points from child to parent, `parent` is `s1`.
+    path.for_each_edge_to_root([&](BaseNode *parent, size_t index) {
+        if (parent->is_transitional())
+            rtg += static_cast<TransitionNode *>(parent)->get_reward_at(index);
+        float new_value = value + rtg;
+        if (overlay == nullptr)
+            StatsManager::update_stats(parent, index, new_value, opt.game_count, opt.virtual_loss);
+        else
+            overlay->update_stats(parent, index, new_value, opt.game_count, opt.virtual_loss);
+    });
+    // The last node is evaluated (if it is a leaf) before the backup.
+    if (overlay != nullptr)
+        overlay->add_evaluated(path.get_last_node());
+}
+
+void Mcts::overlay_backup(const vec<Path> &paths, const vec<float> &values) const
+{
+    // Overlays are private to their workers (or episodes), so every overlay backs up its own paths (in order) without
+    // locking.
+    const size_t num_workers = overlays.size();
+    auto run = [this, num_workers, &paths, &values](size_t w) {
+        for (size_t i = 0; i < paths.size(); ++i)
+            if (static_cast<size_t>(paths[i].overlay_id) == w)
+                backup_path(paths[i], values[i]);
+    };
+    for (const auto &path : paths)
+        assert((path.overlay_id >= 0) && (static_cast<size_t>(path.overlay_id) < num_workers));
+    if (tp == nullptr)
+        for (size_t w = 0; w < num_workers; ++w)
+            run(w);
+    else
+    {
+        vec<std::future<void>> results;
+        results.reserve(num_workers);
+        for (size_t w = 0; w < num_workers; ++w)
+            results.push_back(tp->push([&run, w](int) { run(w); }));
+        for (auto &result : results)
+            result.wait();
+    }
+}
+
+void Mcts::merge_overlays()
+{
+    if (!opt.root_parallel)
+        return;
+    // The background selection might be using the overlays.
+    wait_in_flight();
+    StatsOverlay::merge(overlays);
+}
+
+void Mcts::evaluate(const vec<TreeNode *> &nodes, const PriorBlockPtr &block) const
+{
+    assert(nodes.size() == block->size);
+    auto rows = vec<size_t>();
+    rows.reserve(nodes.size());
+    auto seen = set<TreeNode *>();
+    for (size_t i = 0; i < nodes.size(); ++i)
     {
-        auto value = values[i];
-        auto edges = paths[i].get_edges_to_root();
+        auto node = nodes[i];
+        if (seen.insert(node).second && node->is_leaf())
+            rows.push_back(i);
+    }
+    const size_t num_rows = rows.size();
+    SPDLOG_DEBUG("Mcts: evaluating {} out of {} nodes.", num_rows, nodes.size());
 
-        float rtg = 0.0;
-        for (auto it = edges.begin(); it != edges.end(); ++it)
+    // Nodes are distinct, and the block is only read.
+    auto apply = [this, &nodes, &rows, &block](size_t start, size_t end) {
+        for (size_t j = start; j < end; ++j)
+            env->evaluate(nodes[rows[j]], block, rows[j]);
+    };
+    if ((tp == nullptr) || (num_rows < 64))
+        apply(0, num_rows);
+    else
+    {
+        const size_t num_chunks = opt.num_threads;
+        const size_t chunk_size = (num_rows + num_chunks - 1) / num_chunks;
+        vec<std::future<void>> results;
+        results.reserve(num_chunks);
+        for (size_t start = 0; start < num_rows; start += chunk_size)
         {
-            auto &edge = *it;
-            int index = edge.a.first;
-            // abc_t best_char = edge.a.second;
-            BaseNode *parent = edge.s1; // Since the edge points from child to parent, `s1` is used instead of `s0`.
-            if (parent->is_transitional())
-                rtg += static_cast<TransitionNode *>(parent)->get_reward_at(index);
-            float new_value = value + rtg;
-            StatsManager::update_stats(parent, index, new_value, opt.game_count, opt.virtual_loss);
+            size_t end = std::min(start + chunk_size, num_rows);
+            results.push_back(tp->push([&apply, start, end](int) { apply(start, end); }));
         }
+        for (auto &result : results)
+            result.wait();
     }
 }
 
+void Mcts::evaluate(const vec<TreeNode *> &nodes, const float *meta_priors, const float *special_priors, size_t num_abc) const
+{
+    if (nodes.size() > 0)
+        evaluate(nodes, PriorBlock::create(meta_priors, special_priors, nodes.size(), num_abc));
+}
+
+void Mcts::submit(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit)
+{
+    assert(start_depth == 0);
+    submit(root, num_sims, start_depth, depth_limit, Path(root, 0));
+}
+
+void Mcts::submit(TreeNode *root, const int num_sims, const int start_depth, const int depth_limit, const Path &old_path)
+{
+    // Only one selection can be in flight since selections share the counters for random streams.
+    wait_in_flight();
+    SPDLOG_DEBUG("Mcts: submitting a batch of size {}.", num_sims);
+    in_flight = std::async(std::launch::async,
+                           [this, root, num_sims, start_depth, depth_limit, old_path]() {
+                               return this->select(root, num_sims, start_depth, depth_limit, old_path);
+                           });
+}
+
+void Mcts::wait_in_flight()
+{
+    if (in_flight.valid())
+        pending.push_back(in_flight.get());
+}
+
+const vec<Path> &Mcts::retrieve()
+{
+    if (pending.empty())
+        wait_in_flight();
+    assert(!pending.empty());
+    return pending.front();
+}
+
+void Mcts::complete(const vec<TreeNode *> &nodes,
+                    const float *meta_priors,
+                    const float *special_priors,
+                    size_t num_abc,
+                    const vec<float> &values)
+{
+    wait_in_flight();
+    assert(!pending.empty());
+    // Duplicates (or nodes evaluated by an earlier batch) are skipped.
+    evaluate(nodes, meta_priors, special_priors, num_abc);
+    backup(pending.front(), values);
+    pending.pop_front();
+}
+
+size_t Mcts::get_num_pending() const { return pending.size() + (in_flight.valid() ? 1 : 0); }
+
 vec<BaseNode *> Path::get_all_nodes() const
 {
     auto ret = vec<BaseNode *>();
@@ -231,4 +513,63 @@ Path::Path(const Path &other)
     subpaths = other.subpaths;
     tree_nodes = other.tree_nodes;
     depth = other.depth;
-}
\ No newline at end of file
+    overlay_id = other.overlay_id;
+}
+
+SearchController::SearchController(TreeNode *root, const SearchControlOpt &opt) : root(root),
+                                                                                   start_time(std::chrono::steady_clock::now()),
+                                                                                   opt(opt) {}
+
+bool SearchController::update(int batch_size)
+{
+    num_sims += batch_size;
+    const auto &counts = root->get_action_counts();
+
+    // Track the most visited action.
+    int new_best_index = std::distance(counts.begin(), std::max_element(counts.begin(), counts.end()));
+    if (new_best_index == best_index)
+        ++num_stable;
+    else
+        num_stable = 0;
+    best_index = new_best_index;
+
+    // KL(new || old) between the smoothed visit distributions.
+    bool kl_converged = false;
+    if ((opt.kl_threshold > 0.0) && (last_counts.size() == counts.size()))
+    {
+        const float eps = 1e-3;
+        const size_t n = counts.size();
+        float new_total = 0.0;
+        float old_total = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            new_total += counts[i] + eps;
+            old_total += last_counts[i] + eps;
+        }
+        float kl = 0.0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            float p = (counts[i] + eps) / new_total;
+            float q = (last_counts[i] + eps) / old_total;
+            kl += p * log(p / q);
+        }
+        kl_converged = kl < opt.kl_threshold;
+        SPDLOG_DEBUG("SearchController: KL {}", kl);
+    }
+    last_counts = counts;
+
+    if (num_sims < opt.min_sims)
+        return false;
+    if ((opt.time_budget > 0.0) && (get_elapsed() >= opt.time_budget))
+        return true;
+    if ((opt.num_stable_batches > 0) && (num_stable >= opt.num_stable_batches))
+        return true;
+    return kl_converged;
+}
+
+int SearchController::get_num_sims() const { return num_sims; }
+
+float SearchController::get_elapsed() const
+{
+    return std::chrono::duration<float>(std::chrono::steady_clock::now() - start_time).count();
+}
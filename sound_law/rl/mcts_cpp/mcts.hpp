@@ -1,5 +1,9 @@
 #pragma once
 
+#include <chrono>
+#include <deque>
+#include <future>
+
 #include "common.hpp"
 #include "env.hpp"
 #include "node.hpp"
@@ -10,6 +14,59 @@ struct MctsOpt
     float virtual_loss;
     int num_threads;
     SelectionOpt selection_opt;
+    // Seed for all random streams used by the search.
+    uint64_t seed = 0;
+    // Keep the subtree of the played child and evict its siblings after every `play`.
+    bool retain_subtree = false;
+    // Root-parallel search: every thread searches with its own stats overlay instead of sharing stats (and virtual
+    // losses) with the other threads. The overlays are merged into the shared stats before `play`.
+    bool root_parallel = false;
+};
+
+// Random streams are identified by (domain, counter) so that streams for different purposes never collide.
+namespace stream
+{
+    constexpr uint64_t SELECT = 0;
+    constexpr uint64_t PLAY = 1;
+    constexpr uint64_t ONE_STEP = 2;
+    constexpr uint64_t NOISE = 3;
+
+    inline uint64_t get_id(uint64_t domain, uint64_t counter) { return (domain << 56) | counter; }
+} // namespace stream
+
+struct SearchControlOpt
+{
+    // Wall-clock budget per move in seconds. Disabled if not positive.
+    float time_budget = 0.0;
+    // Stop once the most visited root action stays the same for this many consecutive batches. Disabled if zero.
+    int num_stable_batches = 0;
+    // Stop once the KL divergence between the root visit distributions of two consecutive batches is below this
+    // threshold. Disabled if not positive.
+    float kl_threshold = 0.0;
+    // Never stop before this many simulations, no matter which criterion is met.
+    int min_sims = 0;
+};
+
+// Decides when to stop searching for one move. Call `update` after every batch is backed up.
+class SearchController
+{
+    TreeNode *root;
+    std::chrono::steady_clock::time_point start_time;
+    int num_sims = 0;
+    int best_index = -1;
+    int num_stable = 0;
+    vec<visit_t> last_counts;
+
+public:
+    const SearchControlOpt opt;
+
+    SearchController(TreeNode *, const SearchControlOpt &);
+
+    // Record a finished batch with the given number of simulations, and return whether the search should stop.
+    bool update(int);
+    // Number of simulations used so far.
+    int get_num_sims() const;
+    float get_elapsed() const;
 };
 
 struct Edge
@@ -27,13 +84,31 @@ private:
     int depth;
 
 public:
+    // Index of the stats overlay this path was selected with in root-parallel mode (the worker) or in lockstep mode (the
+    // episode), or -1 for the shared stats.
+    int overlay_id = -1;
+
     // FIXME(j_luo) This is hacky for cython.
     Path() = default;
     Path(const Path &);
+    Path &operator=(const Path &) = default;
     Path(TreeNode *, const int);
 
     // Return all edges (s0, a, s1) from the descendant to the root.
     vec<Edge> get_edges_to_root() const;
+    // Call `f(s1, index)` for every edge in the same order as `get_edges_to_root`, without materializing the edges.
+    template <class F>
+    void for_each_edge_to_root(F &&f) const
+    {
+        assert(subpaths.size() == tree_nodes.size() - 1);
+        for (int i = subpaths.size() - 1; i >= 0; --i)
+        {
+            const auto &subpath = subpaths[i];
+            for (int j = 5; j >= 0; --j)
+                f(static_cast<BaseNode *>(subpath.mini_node_seq[j]), subpath.chosen_seq[j + 1].first);
+            f(static_cast<BaseNode *>(tree_nodes[i]), subpath.chosen_seq[0].first);
+        }
+    }
     int get_depth() const;
     // Append both subpath and tree node at the back.
     void append(const Subpath &, TreeNode *);
@@ -50,32 +125,99 @@ public:
 
 class Mcts
 {
+    friend class EpisodeRunner; // The runner packs states on the same pool, between selection and evaluation.
+
     Pool *tp;
     Env *env;
     bool is_eval;
 
-    Path select_single_thread(TreeNode *, const int, const int, const Path &) const;
-    TreeNode *select_one_step(TreeNode *, bool, bool) const;
+    // Counters to index random streams. Every simulation gets its own stream based on its global index.
+    uint64_t num_sims_started = 0;
+    uint64_t num_plays = 0;
+    uint64_t num_one_steps = 0;
+
+    // Select one path. The expansion of new tree nodes is deferred if the last flag is set.
+    Path select_single_thread(TreeNode *, const int, const int, const Path &, uint64_t, StatsOverlay * = nullptr, bool = false) const;
+    // Expand the last nodes of the paths (if they are not expanded yet) in parallel.
+    void expand_leaves(const vec<Path> &) const;
+    vec<Path> select_root_parallel(TreeNode *, const int, const int, const int, const Path &, uint64_t);
+    void backup_path(const Path &, float) const;
+    void overlay_backup(const vec<Path> &, const vec<float> &) const;
+    TreeNode *select_one_step(TreeNode *, bool, bool);
+
+    // Pipelined evaluation: at most one selection runs in the background, and selected batches wait in `pending`
+    // (oldest first) until their leaves are evaluated and their values are backed up.
+    std::future<vec<Path>> in_flight;
+    std::deque<vec<Path>> pending;
+
+    // One stats overlay per worker in root-parallel mode, or per episode in lockstep mode. Each overlay is only touched
+    // by one task at a time.
+    mutable vec<StatsOverlay> overlays;
+
+    // Wait for the background selection (if any) and move its batch to `pending`.
+    void wait_in_flight();
 
 public:
     MctsOpt opt;
 
     Mcts(Env *, const MctsOpt &);
 
-    vec<Path> select(TreeNode *, const int, const int, const int) const;
-    vec<Path> select(TreeNode *, const int, const int, const int, const Path &) const;
-    TreeNode *select_one_pi_step(TreeNode *) const;
-    TreeNode *select_one_random_step(TreeNode *) const;
+    // Select a batch of paths with the shared stats. Every simulation sees the virtual losses of all earlier ones, so
+    // simulations are selected one after another, and the paths (and stats) are the same for any number of threads.
+    // Threads only expand the new leaves of the batch.
+    vec<Path> select(TreeNode *, const int, const int, const int);
+    vec<Path> select(TreeNode *, const int, const int, const int, const Path &);
+    // Start a group of episodes to be stepped in lockstep, each with its own stats overlay. Stats of one episode are
+    // never seen by another, so every episode searches as if it ran on its own, except that pruning is shared (as it is
+    // between episodes run one after another). Call it after `new_epoch`.
+    void start_lockstep(size_t);
+    // Select `num_sims` paths for every root (with its own start depth, old path and episode) in one parallel dispatch.
+    // This is used to step several episodes in lockstep and evaluate all their leaves in one batch.
+    vec<vec<Path>> select_lockstep(const vec<TreeNode *> &, const int, const vec<int> &, const int, const vec<Path> &, const vec<int> &);
+    // Overwrite the shared stats with the stats of one lockstep episode, e.g., to gather its trajectory.
+    void store_episode_stats(int);
+    TreeNode *select_one_pi_step(TreeNode *);
+    TreeNode *select_one_random_step(TreeNode *);
     void eval();
     void train();
     void backup(const vec<Path> &, const vec<float> &) const;
+    // Evaluate a batch of nodes, where node `i` takes row `i` of the priors. As in `ActionSpace::evaluate`, every leaf
+    // (stopped and done ones included) is evaluated, but only on its first occurrence. Leaves are evaluated in
+    // parallel. Meta priors are laid out as [n, 6, num_abc] and special priors as [n, 6].
+    void evaluate(const vec<TreeNode *> &, const PriorBlockPtr &) const;
+    void evaluate(const vec<TreeNode *> &, const float *, const float *, size_t) const;
+
+    // Start selecting a new batch in the background. Virtual losses of pending batches stay in place, so the new batch
+    // is steered away from the leaves that are still being evaluated.
+    void submit(TreeNode *, const int, const int, const int);
+    void submit(TreeNode *, const int, const int, const int, const Path &);
+    // Return the oldest batch that is not completed yet, waiting for the background selection if needed.
+    const vec<Path> &retrieve();
+    // Complete the oldest pending batch: evaluate the given nodes with their priors and back up one value per path.
+    // This waits for the background selection first so that the tree is never mutated during selection.
+    // Meta priors are laid out as [n, 6, num_abc] and special priors as [n, 6].
+    void complete(const vec<TreeNode *> &, const float *, const float *, size_t, const vec<float> &);
+    size_t get_num_pending() const;
+    // Fold the stats overlays into the shared stats. This is done by `play`, and is a no-op unless in root-parallel
+    // mode. Call it to read up-to-date stats in the middle of a search.
+    void merge_overlays();
     inline Path play(TreeNode *node, int start_depth, PlayStrategy ps, float exponent)
+    {
+        merge_overlays();
+        return play(node, start_depth, ps, exponent, -1);
+    };
+    // Play with the stats of one lockstep episode, or with the shared stats if `episode_id` is -1.
+    inline Path play(TreeNode *node, int start_depth, PlayStrategy ps, float exponent, int episode_id)
     {
         auto ret = Path(node, start_depth);
-        auto play_ret = node->play(ps, exponent);
+        auto rng = RandomStream(opt.seed, stream::get_id(stream::PLAY, num_plays++));
+        StatsOverlay *overlay = (episode_id >= 0) ? &overlays[episode_id] : nullptr;
+        auto play_ret = node->play(ps, exponent, rng, overlay);
         ret.append(play_ret.second, play_ret.first);
         for (const auto node : ret.get_all_nodes())
             env->cache.put_persistent(node);
+        if (opt.retain_subtree)
+            env->evict_siblings(node, ret.get_last_node());
         return ret;
     };
 };
@@ -24,15 +24,20 @@ TreeNode::TreeNode(const vec<Word *> &words,
                                    BaseNode(stopped, false) { common_init(words); }
 
 bool BaseNode::is_expanded() const { return (permissible_chars.size() > 0); }
-bool BaseNode::is_evaluated() const { return (priors.size() > 0); }
+bool BaseNode::is_evaluated() const
+{
+    refresh();
+    return (priors.size() > 0);
+}
 
 ChosenChar BaseNode::get_best_action(const SelectionOpt &sel_opt) const
 {
+    refresh();
     assert(is_expanded() && is_evaluated());
     int index;
     if (sel_opt.random_select)
     {
-        index = rand() % permissible_chars.size();
+        index = sel_opt.rng->randint(permissible_chars.size());
     }
     else if (sel_opt.policy_only)
     {
@@ -43,23 +48,103 @@ ChosenChar BaseNode::get_best_action(const SelectionOpt &sel_opt) const
     }
     else
     {
-        auto scores = get_scores(sel_opt);
-        auto it = std::max_element(scores.begin(), scores.end());
-        index = std::distance(scores.begin(), it);
+        assert(!sel_opt.add_noise || (sel_opt.rng != nullptr));
+        using Kernel = size_t (BaseNode::*)(const SelectionOpt &, const visit_t *, const float *, const float *, visit_t) const;
+        static const Kernel kernels[16] = {
+            &BaseNode::select_index<false, false, false, false>,
+            &BaseNode::select_index<false, false, false, true>,
+            &BaseNode::select_index<false, false, true, false>,
+            &BaseNode::select_index<false, false, true, true>,
+            &BaseNode::select_index<false, true, false, false>,
+            &BaseNode::select_index<false, true, false, true>,
+            &BaseNode::select_index<false, true, true, false>,
+            &BaseNode::select_index<false, true, true, true>,
+            &BaseNode::select_index<true, false, false, false>,
+            &BaseNode::select_index<true, false, false, true>,
+            &BaseNode::select_index<true, false, true, false>,
+            &BaseNode::select_index<true, false, true, true>,
+            &BaseNode::select_index<true, true, false, false>,
+            &BaseNode::select_index<true, true, false, true>,
+            &BaseNode::select_index<true, true, true, false>,
+            &BaseNode::select_index<true, true, true, true>};
+        size_t key = (sel_opt.use_max_value << 3) | ((sel_opt.heur_c > 0.0) << 2) | (sel_opt.use_num_misaligned << 1) | sel_opt.add_noise;
+        if (sel_opt.overlay == nullptr)
+            index = (this->*kernels[key])(sel_opt, action_counts.data(), total_values.data(), max_values.data(), visit_count);
+        else
+        {
+            const auto &stats = sel_opt.overlay->get(this);
+            index = (this->*kernels[key])(sel_opt, stats.action_counts.data(), stats.total_values.data(), stats.max_values.data(), stats.visit_count);
+        }
     }
     auto ret = ChosenChar(index, permissible_chars[index]);
     SPDLOG_DEBUG("BaseNode: getting best subaction ({0}, {1})", ret.first, ret.second);
     return ret;
 }
 
-inline float randf(float high)
+template <bool use_max_value, bool use_heur, bool use_num_misaligned, bool add_noise>
+size_t BaseNode::select_index(const SelectionOpt &sel_opt,
+                              const visit_t *ac,
+                              const float *tv,
+                              const float *mv,
+                              visit_t visit_count) const
 {
-    return high * static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
+    assert(!stopped || !is_tree_node());
+    assert(priors.size() == pruned.size());
+    // Scores are computed in fixed-size blocks on the stack so that the arithmetic vectorizes, and the argmax is
+    // taken right after each block. The arithmetic mirrors `get_scores` exactly, so that both agree bitwise.
+    constexpr size_t block_size = 16;
+    float block[block_size];
+    const size_t n = priors.size();
+    const float sqrt_ns = sqrt(static_cast<float>(visit_count));
+    const float puct_c = sel_opt.puct_c;
+    const float heur_c = sel_opt.heur_c;
+    const float *p = priors.data();
+    const float *heur = use_num_misaligned ? num_misaligned.data() : misalign_scores.data();
+
+    size_t best_index = 0;
+    float best_score = 0.0;
+    for (size_t start = 0; start < n; start += block_size)
+    {
+        const size_t m = std::min(block_size, n - start);
+#pragma omp simd
+        for (size_t j = 0; j < m; ++j)
+        {
+            const size_t i = start + j;
+            float nsa = static_cast<float>(ac[i]);
+            float q;
+            if (use_max_value)
+                q = nsa > 0 ? mv[i] : 0.0;
+            else
+                q = tv[i] / (nsa + 1e-8);
+            float score = q + puct_c * p[i] * sqrt_ns / (1 + nsa);
+            if (use_heur)
+                score += heur_c * heur[i] / (1 + nsa);
+            block[j] = score;
+        }
+        for (size_t j = 0; j < m; ++j)
+        {
+            const size_t i = start + j;
+            float score = block[j];
+            // Noise is drawn for every action (including pruned ones) to keep the random stream in sync with `get_scores`.
+            if (add_noise)
+                score += sel_opt.rng->randf(1e-8);
+            if (pruned[i])
+                score = -9999.9;
+            if ((i == 0) || (score > best_score))
+            {
+                best_score = score;
+                best_index = i;
+            }
+        }
+    }
+    return best_index;
 }
 
 vec<float> BaseNode::get_scores(const SelectionOpt &sel_opt) const
 {
+    refresh();
     assert(!stopped || !is_tree_node());
+    assert(!sel_opt.add_noise || (sel_opt.rng != nullptr));
     float sqrt_ns = sqrt(static_cast<float>(visit_count)); // + 1;
     auto scores = vec<float>(priors.size());
     assert(priors.size() == pruned.size());
@@ -93,7 +178,7 @@ vec<float> BaseNode::get_scores(const SelectionOpt &sel_opt) const
         // scores[i] = q + u + randf(0.001);
         // scores[i] = pruned[i] ? -9999.9 : (q + u);
         // scores[i] = pruned[i] ? -9999.9 : (q + u + h + randf(0.01));
-        float noise = sel_opt.add_noise ? randf(1e-8) : 0.0;
+        float noise = sel_opt.add_noise ? sel_opt.rng->randf(1e-8) : 0.0;
         scores[i] = pruned[i] ? -9999.9 : (q + u + h + noise);
         // scores[i] = pruned[i] ? -9999.9 : (mv + u + h + noise);
         // scores[i] = q + u; //+ h + randf(0.01);
@@ -125,19 +210,23 @@ void BaseNode::prune(size_t index)
 
 bool BaseNode::is_pruned() const { return num_unpruned_actions == 0; }
 
-bool TreeNode::is_leaf() const { return priors.size() == 0; }
+bool TreeNode::is_leaf() const
+{
+    refresh();
+    return priors.size() == 0;
+}
 
-pair<TreeNode *, Subpath> TreeNode::play(PlayStrategy ps, float exponent) const
+pair<TreeNode *, Subpath> TreeNode::play(PlayStrategy ps, float exponent, RandomStream &rng, StatsOverlay *overlay) const
 {
     SPDLOG_TRACE("Playing one step.");
     auto subpath = Subpath();
-    auto mini_ret = play_mini(ps, exponent);
+    auto mini_ret = play_mini(ps, exponent, rng, overlay);
     BaseNode *node = mini_ret.first;
     subpath.mini_node_seq[0] = static_cast<MiniNode *>(node);
     subpath.chosen_seq[0] = mini_ret.second;
     for (int i = 1; i < 7; ++i)
     {
-        auto mini_ret = node->play_mini(ps, exponent);
+        auto mini_ret = node->play_mini(ps, exponent, rng, overlay);
         if (i < 6)
             subpath.mini_node_seq[i] = static_cast<MiniNode *>(mini_ret.first);
         subpath.chosen_seq[i] = mini_ret.second;
@@ -147,8 +236,20 @@ pair<TreeNode *, Subpath> TreeNode::play(PlayStrategy ps, float exponent) const
     return std::make_pair(static_cast<TreeNode *>(node), subpath);
 }
 
-pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent) const
+pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent, RandomStream &rng, StatsOverlay *overlay) const
 {
+    refresh();
+    // Read the stats of the overlay if given. They are not touched again until the end of this call.
+    const vec<visit_t> *counts = &action_counts;
+    const vec<float> *values = &max_values;
+    int best_index = max_index;
+    if (overlay != nullptr)
+    {
+        const auto &stats = overlay->get(this);
+        counts = &stats.action_counts;
+        values = &stats.max_values;
+        best_index = stats.max_index;
+    }
     // int index = 0;
     // for (size_t i = 1; i < permissible_chars.size(); ++i)
     //     if (action_counts[i] > action_counts[index])
@@ -175,19 +276,19 @@ pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent
     size_t index;
     if (ps == PlayStrategy::MAX)
     {
-        assert(max_index != -1);
-        index = max_index;
+        assert(best_index != -1);
+        index = best_index;
     }
     else
     {
         auto probs = vec<float>();
-        probs.reserve(action_counts.size());
+        probs.reserve(counts->size());
         float sum = 0.0;
         if (ps == PlayStrategy::SAMPLE_AC)
         {
-            for (size_t i = 0; i < action_counts.size(); ++i)
+            for (size_t i = 0; i < counts->size(); ++i)
             {
-                auto ac = action_counts[i];
+                auto ac = (*counts)[i];
                 if (ac > 0)
                     probs.push_back(pruned[i] ? 1e-8 : pow(static_cast<float>(ac), exponent));
                 else
@@ -197,10 +298,10 @@ pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent
         }
         else if (ps == PlayStrategy::SAMPLE_MV)
         {
-            for (size_t i = 0; i < max_values.size(); ++i)
+            for (size_t i = 0; i < values->size(); ++i)
             {
-                auto mv = max_values[i];
-                auto ac = action_counts[i];
+                auto mv = (*values)[i];
+                auto ac = (*counts)[i];
                 if (ac > 0)
                     if (pruned[i])
                         probs.push_back(1e-8);
@@ -214,7 +315,7 @@ pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent
         for (auto &prob : probs)
             prob /= sum;
 
-        float r = randf(1.0);
+        float r = rng.randf(1.0);
         float low = 0.0;
         float high = 0.0;
         index = 0;
@@ -278,7 +379,7 @@ pair<BaseNode *, ChosenChar> BaseNode::play_mini(PlayStrategy ps, float exponent
     // return children[index];
 
     // auto probs = vec<float>();
-    // probs.reserve(action_counts.size());
+    // probs.reserve(counts->size());
     // float sum = 0.0;
 
     // for (size_t i = 0; i < max_values.size(); ++i)
@@ -354,6 +455,13 @@ TreeNode *TreeNode::get_tree_node(const vec<Word *> &words, bool stopped)
     return ret;
 }
 
+TreeNode *TreeNode::find_tree_node(const vec<Word *> &words)
+{
+    TreeNode *ret = nullptr;
+    TreeNode::t_table.find(words, ret);
+    return ret;
+}
+
 bool BaseNode::has_child(size_t index) const
 {
     assert(children.size() > index);
@@ -432,6 +540,8 @@ void BaseNode::init_edges()
 
 void BaseNode::update_stats(size_t index, float new_value, int game_count, float virtual_loss)
 {
+    refresh();
+    std::lock_guard<std::mutex> lock(mtx);
     action_counts[index] -= game_count - 1;
     if (action_counts[index] < 1)
     {
@@ -470,6 +580,12 @@ void BaseNode::add_action(abc_t action, const Affected &affected)
     this->affected.push_back(affected);
 }
 
+void BaseNode::add_action(abc_t action, Affected &&affected)
+{
+    permissible_chars.push_back(action);
+    this->affected.push_back(std::move(affected));
+}
+
 size_t BaseNode::get_num_affected_at(size_t index) const { return affected[index].size(); }
 
 abc_t BaseNode::get_action_at(size_t index) const { return permissible_chars[index]; }
@@ -497,7 +613,7 @@ inline void normalize(vec<float> &priors)
         prior /= sum;
 }
 
-inline vec<float> gather_priors(const vec<float> &values, const vec<abc_t> &indices)
+inline vec<float> gather_priors(const float *values, const vec<abc_t> &indices)
 {
     auto ret = vec<float>();
     ret.reserve(indices.size());
@@ -507,18 +623,115 @@ inline vec<float> gather_priors(const vec<float> &values, const vec<abc_t> &indi
     return ret;
 }
 
-void TreeNode::evaluate(const vec<vec<float>> &meta_priors, const vec<float> &special_priors)
+PriorBlock::PriorBlock(const float *meta_priors,
+                       const float *special_priors,
+                       size_t size,
+                       size_t num_abc) : meta_priors(meta_priors, meta_priors + size * 6 * num_abc),
+                                         special_priors(special_priors, special_priors + size * 6),
+                                         size(size),
+                                         num_abc(num_abc) {}
+
+PriorBlock::PriorBlock(vec<float> &&meta_priors,
+                       vec<float> &&special_priors,
+                       size_t size,
+                       size_t num_abc) : meta_priors(std::move(meta_priors)),
+                                         special_priors(std::move(special_priors)),
+                                         size(size),
+                                         num_abc(num_abc)
+{
+    assert(this->meta_priors.size() == size * 6 * num_abc);
+    assert(this->special_priors.size() == size * 6);
+}
+
+vec<std::weak_ptr<KeptPriors>> KeptPriors::live;
+size_t KeptPriors::live_limit = 1024;
+std::mutex KeptPriors::live_mtx;
+
+std::shared_ptr<KeptPriors> KeptPriors::create()
+{
+    auto kept = std::make_shared<KeptPriors>();
+    std::lock_guard<std::mutex> lock(live_mtx);
+    if (live.size() >= live_limit)
+    {
+        // Prune the ones that have already been released.
+        live.erase(std::remove_if(live.begin(), live.end(), [](const std::weak_ptr<KeptPriors> &k) { return k.expired(); }), live.end());
+        live_limit = std::max(live_limit, 2 * live.size());
+    }
+    live.push_back(kept);
+    return kept;
+}
+
+void KeptPriors::release_all()
+{
+    std::lock_guard<std::mutex> lock(live_mtx);
+    // Nodes of previous epochs are re-evaluated before their priors are read again, so only the (small) object itself
+    // needs to stay alive until they are reset.
+    for (auto &weak : live)
+        if (auto kept = weak.lock())
+        {
+            vec<abc_t>().swap(kept->after_chars);
+            vec<abc_t>().swap(kept->context_chars);
+            vec<float>().swap(kept->meta_priors);
+            vec<float>().swap(kept->special_priors);
+        }
+    live.clear();
+}
+
+vec<float> KeptPriors::gather(const float *values, const vec<abc_t> &chars, const vec<abc_t> &actions)
+{
+    auto ret = vec<float>();
+    ret.reserve(actions.size());
+    for (const auto action : actions)
+    {
+        auto it = std::lower_bound(chars.begin(), chars.end(), action);
+        ret.push_back(((it != chars.end()) && (*it == action)) ? values[it - chars.begin()] : 0.0);
+    }
+    normalize(ret);
+    return ret;
+}
+
+void TreeNode::evaluate(std::shared_ptr<KeptPriors> &&kept)
 {
     assert(is_expanded());
     if (is_evaluated())
         return;
 
-    this->meta_priors = meta_priors;
-    this->special_priors = special_priors;
-    priors = gather_priors(meta_priors[0], permissible_chars);
+    const size_t n = permissible_chars.size();
+    priors = vec<float>(kept->meta_priors.begin(), kept->meta_priors.begin() + n);
+    normalize(priors);
+    kept_priors = std::move(kept);
 }
 
-void BaseNode::clear_priors() { priors.clear(); }
+void TreeNode::evaluate(const PriorBlock &block, size_t row, vec<abc_t> &&after_chars, vec<abc_t> &&context_chars)
+{
+    if (is_evaluated())
+        return;
+
+    auto kept = KeptPriors::create();
+    auto &meta_priors = kept->meta_priors;
+    meta_priors.reserve(permissible_chars.size() + after_chars.size() + 4 * context_chars.size());
+    auto keep = [&meta_priors](const float *values, const vec<abc_t> &chars) {
+        for (const auto unit : chars)
+            meta_priors.push_back(values[unit]);
+    };
+    keep(block.get_meta_priors(row, 0), permissible_chars);
+    keep(block.get_meta_priors(row, 1), after_chars);
+    for (size_t i = 2; i < 6; ++i)
+        keep(block.get_meta_priors(row, i), context_chars);
+    const float *special_priors = block.get_special_priors(row);
+    kept->special_priors.assign(special_priors, special_priors + 6);
+    kept->after_chars = std::move(after_chars);
+    kept->context_chars = std::move(context_chars);
+    evaluate(std::move(kept));
+}
+
+void BaseNode::clear_priors()
+{
+    refresh();
+    priors.clear();
+    if (is_tree_node())
+        static_cast<TreeNode *>(this)->kept_priors.reset();
+}
 
 void MiniNode::evaluate()
 {
@@ -533,19 +746,84 @@ void MiniNode::evaluate()
 }
 
 const vec<abc_t> &BaseNode::get_actions() const { return permissible_chars; }
-const vec<visit_t> &BaseNode::get_action_counts() const { return action_counts; }
-const vec<float> &BaseNode::get_total_values() const { return total_values; }
-const vec<float> &BaseNode::get_max_values() const { return max_values; }
-visit_t BaseNode::get_visit_count() const { return visit_count; }
-const vec<float> &BaseNode::get_priors() const { return priors; }
+const vec<visit_t> &BaseNode::get_action_counts() const
+{
+    refresh();
+    return action_counts;
+}
+
+const vec<float> &BaseNode::get_total_values() const
+{
+    refresh();
+    return total_values;
+}
+
+const vec<float> &BaseNode::get_max_values() const
+{
+    refresh();
+    return max_values;
+}
+
+visit_t BaseNode::get_visit_count() const
+{
+    refresh();
+    return visit_count;
+}
+
+int BaseNode::get_max_index() const
+{
+    refresh();
+    return max_index;
+}
+
+const vec<float> &BaseNode::get_priors() const
+{
+    refresh();
+    return priors;
+}
+
+void BaseNode::new_epoch()
+{
+    global_epoch.fetch_add(1);
+    KeptPriors::release_all();
+}
+
+void BaseNode::reset_epoch()
+{
+    std::lock_guard<std::mutex> lock(epoch_mtx);
+    // Another thread might have reset it in the meantime.
+    uint32_t current = global_epoch.load();
+    if (epoch.load() == current)
+        return;
+    init_stats();
+    priors.clear();
+    // Priors of an older epoch are never read again, so they can be released.
+    if (is_tree_node())
+        static_cast<TreeNode *>(this)->kept_priors.reset();
+    epoch.store(current, std::memory_order_release);
+}
 
 void BaseNode::virtual_select(size_t index, int game_count, float virtual_loss)
 {
+    refresh();
+    std::lock_guard<std::mutex> lock(mtx);
     action_counts[index] += game_count;
     total_values[index] -= game_count * virtual_loss;
     visit_count += game_count;
 }
 
+void BaseNode::init_heuristics()
+{
+    size_t n = permissible_chars.size();
+    misalign_scores.resize(n);
+    num_misaligned.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        misalign_scores[i] = affected[i].get_misalignment_score();
+        num_misaligned[i] = static_cast<float>(affected[i].get_num_misaligned());
+    }
+}
+
 void BaseNode::init_pruned()
 {
     size_t n = permissible_chars.size();
@@ -555,7 +833,11 @@ void BaseNode::init_pruned()
 
 const vec<bool> &BaseNode::get_pruned() const { return pruned; }
 
-void BaseNode::dummy_evaluate() { priors = vec<float>(permissible_chars.size(), 0.0); }
+void BaseNode::dummy_evaluate()
+{
+    refresh();
+    priors = vec<float>(permissible_chars.size(), 0.0);
+}
 
 void TransitionNode::init_rewards() { rewards = vec<float>(permissible_chars.size(), 0.0); }
 
@@ -567,14 +849,24 @@ const vec<float> &TransitionNode::get_rewards() const { return rewards; }
 
 void TreeNode::add_noise(const vec<vec<float>> &meta_noise, const vec<float> &special_noise, float noise_ratio)
 {
-    auto new_meta_priors = meta_priors;
-    auto new_special_priors = special_priors;
-    for (size_t i = 0; i < meta_noise.size(); ++i)
-        for (size_t j = 0; j < meta_noise[i].size(); ++j)
-            new_meta_priors[i][j] = new_meta_priors[i][j] * (1.0 - noise_ratio) + meta_noise[i][j] * noise_ratio;
+    assert(kept_priors != nullptr);
+    auto noisy = KeptPriors::create();
+    *noisy = *kept_priors;
+    auto mix = [noise_ratio](float &prior, float noise) { prior = prior * (1.0 - noise_ratio) + noise * noise_ratio; };
+    auto mix_row = [&noisy, &mix](size_t offset, const vec<float> &noise, const vec<abc_t> &chars) {
+        for (size_t j = 0; j < chars.size(); ++j)
+            mix(noisy->meta_priors[offset + j], noise[chars[j]]);
+    };
+    const size_t nb = permissible_chars.size();
+    const size_t na = noisy->after_chars.size();
+    const size_t nc = noisy->context_chars.size();
+    mix_row(0, meta_noise[0], permissible_chars);
+    mix_row(nb, meta_noise[1], noisy->after_chars);
+    for (size_t i = 2; i < 6; ++i)
+        mix_row(nb + na + (i - 2) * nc, meta_noise[i], noisy->context_chars);
     for (size_t i = 0; i < special_noise.size(); ++i)
-        new_special_priors[i] = new_special_priors[i] * (1.0 - noise_ratio) + special_noise[i] * noise_ratio;
-    evaluate(new_meta_priors, new_special_priors);
+        mix(noisy->special_priors[i], special_noise[i]);
+    evaluate(std::move(noisy));
 }
 
 vec<float> TreeNode::evaluate_actions(const vec<abc_t> &actions, ActionPhase ap) const
@@ -598,15 +890,19 @@ vec<float> TreeNode::evaluate_actions(const vec<abc_t> &actions, ActionPhase ap)
         index = 5;
         break;
     }
-    const auto &full_priors = meta_priors.at(index);
-    // if (ap == ActionPhase::SPECIAL_TYPE)
-    //     std::cerr << full_priors.at(56) << " " << full_priors.at(4) << "\n";
-    return gather_priors(full_priors, actions);
+    assert(kept_priors != nullptr);
+    const auto &kept = *kept_priors;
+    const float *values = kept.meta_priors.data() + permissible_chars.size();
+    if (index == 1)
+        return KeptPriors::gather(values, kept.after_chars, actions);
+    values += kept.after_chars.size() + (index - 2) * kept.context_chars.size();
+    return KeptPriors::gather(values, kept.context_chars, actions);
 }
 
 vec<float> TreeNode::evaluate_special_actions(const vec<abc_t> &actions) const
 {
-    return gather_priors(special_priors, actions);
+    assert(kept_priors != nullptr);
+    return gather_priors(kept_priors->special_priors.data(), actions);
 }
 
 float TreeNode::get_dist() const { return dist; };
@@ -631,8 +927,161 @@ pair<vec<vec<size_t>>, vec<vec<size_t>>> TreeNode::get_alignments() const
 
 void BaseNode::show_action_stats() const
 {
+    refresh();
     assert(is_expanded());
     for (size_t i = 0; i < permissible_chars.size(); ++i)
         std::cerr << permissible_chars[i] << ":" << affected[i].size() << " ";
     std::cerr << "\n";
-}
\ No newline at end of file
+}
+
+StatsOverlay::StatsOverlay(bool track_leaves) : track_leaves(track_leaves) {}
+
+void StatsOverlay::check_epoch()
+{
+    const uint32_t current = BaseNode::global_epoch.load();
+    if (epoch != current)
+    {
+        entries.clear();
+        evaluated.clear();
+        epoch = current;
+    }
+}
+
+StatsOverlay::Stats &StatsOverlay::get(const BaseNode *node)
+{
+    check_epoch();
+    auto it = entries.find(node);
+    if (it != entries.end())
+        return it->second;
+    node->refresh();
+    auto &stats = entries[node];
+    stats.action_counts = node->action_counts;
+    stats.total_values = node->total_values;
+    stats.max_values = node->max_values;
+    stats.visit_count = node->visit_count;
+    stats.max_index = node->max_index;
+    stats.max_value = node->max_value;
+    return stats;
+}
+
+void StatsOverlay::virtual_select(const BaseNode *node, size_t index, int game_count, float virtual_loss)
+{
+    auto &stats = get(node);
+    stats.action_counts[index] += game_count;
+    stats.total_values[index] -= game_count * virtual_loss;
+    stats.visit_count += game_count;
+}
+
+void StatsOverlay::update_stats(const BaseNode *node, size_t index, float new_value, int game_count, float virtual_loss)
+{
+    // Same as `BaseNode::update_stats`.
+    auto &stats = get(node);
+    stats.action_counts[index] -= game_count - 1;
+    assert(stats.action_counts[index] >= 1);
+    if (new_value > stats.max_value)
+    {
+        stats.max_value = new_value;
+        stats.max_index = index;
+    }
+    if (new_value > stats.max_values[index])
+        stats.max_values[index] = new_value;
+    stats.total_values[index] += game_count * virtual_loss + new_value;
+    stats.visit_count -= game_count - 1;
+}
+
+size_t StatsOverlay::size() const { return entries.size(); }
+
+bool StatsOverlay::is_leaf(const TreeNode *node) const
+{
+    if (node->is_leaf())
+        return true;
+    if (!track_leaves)
+        return false;
+    return (epoch != BaseNode::global_epoch.load()) || !evaluated.contains(node);
+}
+
+void StatsOverlay::add_evaluated(const TreeNode *node)
+{
+    check_epoch();
+    if (track_leaves)
+        evaluated.insert(node);
+}
+
+void StatsOverlay::store() const
+{
+    if (epoch != BaseNode::global_epoch.load())
+        return;
+    for (const auto &item : entries)
+    {
+        auto node = const_cast<BaseNode *>(item.first);
+        const auto &stats = item.second;
+        node->refresh();
+        node->action_counts = stats.action_counts;
+        node->total_values = stats.total_values;
+        node->max_values = stats.max_values;
+        node->visit_count = stats.visit_count;
+        node->max_index = stats.max_index;
+        node->max_value = stats.max_value;
+    }
+}
+
+void StatsOverlay::merge(vec<StatsOverlay> &overlays)
+{
+    // Start from the first copy of every node and add the differences of the other copies from the shared stats. The
+    // shared stats are the common base of all copies and should not change until every overlay has been read. Taking the
+    // first copy as is (instead of adding its difference) keeps a single overlay exact, so that one worker gives the
+    // same stats as a search without overlays. Overlays are visited in a fixed order so that `max_index` ties are always
+    // broken the same way.
+    const uint32_t current = BaseNode::global_epoch.load();
+    auto merged = map<BaseNode *, Stats>();
+    auto nodes = vec<BaseNode *>();
+    for (const auto &overlay : overlays)
+    {
+        if (overlay.epoch != current)
+            continue;
+        for (const auto &item : overlay.entries)
+        {
+            auto node = const_cast<BaseNode *>(item.first);
+            const auto &stats = item.second;
+            const size_t n = stats.action_counts.size();
+            assert(node->action_counts.size() == n);
+            auto inserted = merged.insert({node, stats});
+            if (inserted.second)
+            {
+                nodes.push_back(node);
+                continue;
+            }
+            auto &sum = inserted.first->second;
+            for (size_t i = 0; i < n; ++i)
+            {
+                sum.action_counts[i] += stats.action_counts[i] - node->action_counts[i];
+                sum.total_values[i] += stats.total_values[i] - node->total_values[i];
+                sum.max_values[i] = std::max(sum.max_values[i], stats.max_values[i]);
+            }
+            sum.visit_count += stats.visit_count - node->visit_count;
+            if (stats.max_value > sum.max_value)
+            {
+                sum.max_value = stats.max_value;
+                sum.max_index = stats.max_index;
+            }
+        }
+    }
+
+    for (const auto node : nodes)
+    {
+        auto &sum = merged[node];
+        node->action_counts = std::move(sum.action_counts);
+        node->total_values = std::move(sum.total_values);
+        node->max_values = std::move(sum.max_values);
+        node->visit_count = sum.visit_count;
+        node->max_index = sum.max_index;
+        node->max_value = sum.max_value;
+    }
+    SPDLOG_DEBUG("StatsOverlay: merged {} nodes.", nodes.size());
+
+    for (auto &overlay : overlays)
+    {
+        overlay.entries.clear();
+        overlay.epoch = current;
+    }
+}
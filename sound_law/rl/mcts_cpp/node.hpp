@@ -1,8 +1,12 @@
 #pragma once
 
+#include <memory>
+
 #include "common.hpp"
 #include "word.hpp"
 
+class StatsOverlay;
+
 struct SelectionOpt
 {
     float puct_c;
@@ -12,6 +16,10 @@ struct SelectionOpt
     bool use_max_value;
     bool policy_only = false;
     bool random_select = false;
+    // Random stream used for noise and random selection. It is owned by the caller (one per simulation).
+    RandomStream *rng = nullptr;
+    // Stats overlay of the current root-parallel worker or lockstep episode. The shared stats are used if this is null.
+    StatsOverlay *overlay = nullptr;
 };
 
 // This enum class documents which phase a node is in, in terms of finishing sampling an action.
@@ -40,6 +48,12 @@ public:
 
     inline Affected(float start_dist) : start_dist(start_dist){};
     inline size_t size() const { return orders.size(); };
+    inline void reserve(size_t n)
+    {
+        orders.reserve(n);
+        positions.reserve(n);
+        misalign_scores.reserve(n);
+    }
     inline void push_back(int order, size_t position, float misalign_score)
     {
         orders.push_back(order);
@@ -53,6 +67,7 @@ public:
     inline size_t get_num_misaligned() const { return num_misaligned; }
     inline int get_order_at(size_t index) const { return orders[index]; };
     inline int get_position_at(size_t index) const { return positions[index]; };
+    inline float get_misalign_score_at(size_t index) const { return misalign_scores[index]; };
 };
 
 // using Affected = vec<pair<int, size_t>>;
@@ -112,12 +127,15 @@ public:
 
     /* ------------------ Multithreading-related ------------------ */
 private:
+    friend class LockManager;
+
     std::mutex mtx;
 
     /* ----------------------- Stats-related ---------------------- */
 
 private:
     friend class StatsManager;
+    friend class StatsOverlay;
 
     vec<visit_t> action_counts;
     vec<float> total_values;
@@ -130,11 +148,30 @@ private:
     void init_stats();
     void virtual_select(size_t, int, float);
 
+    // Search epochs. Starting a new epoch resets the stats and priors of all nodes, but lazily: a node is reset the
+    // first time it is touched in the new epoch.
+    inline static std::atomic<uint32_t> global_epoch{0};
+    // Only guards the (rare) lazy resets, so it never nests with `mtx`.
+    inline static std::mutex epoch_mtx;
+    mutable std::atomic<uint32_t> epoch{global_epoch.load()};
+
+    static void new_epoch();
+    void reset_epoch();
+
+protected:
+    // Reset stats and priors if this node is from an older epoch. Should be called before stats or priors are used.
+    inline void refresh() const
+    {
+        if (epoch.load(std::memory_order_acquire) != global_epoch.load(std::memory_order_relaxed))
+            const_cast<BaseNode *>(this)->reset_epoch();
+    }
+
 public:
     const vec<visit_t> &get_action_counts() const;
     const vec<float> &get_total_values() const;
     const vec<float> &get_max_values() const;
     visit_t get_visit_count() const;
+    int get_max_index() const;
 
     /* ---------------------- Action-related ---------------------- */
 
@@ -142,10 +179,23 @@ private:
     friend class ActionManager;
 
     void add_action(abc_t, const Affected &);
+    void add_action(abc_t, Affected &&);
     void update_affected_at(size_t, int, size_t, float);
     void clear_priors();
     // Set prior to 0.0.
     void dummy_evaluate();
+    // Cache the heuristics of all actions in flat arrays (should be called after node expansion).
+    void init_heuristics();
+
+    // Heuristics of `affected` stored contiguously so that the selection kernel can read them in one pass.
+    vec<float> misalign_scores;
+    vec<float> num_misaligned;
+
+    // Fused selection kernel that computes the PUCT scores and their argmax in one pass without allocation.
+    // There is one specialization per combination of `use_max_value`, `heur_c > 0`, `use_num_misaligned` and `add_noise`.
+    // Stats are passed in explicitly so that the kernel can also run on a stats overlay.
+    template <bool, bool, bool, bool>
+    size_t select_index(const SelectionOpt &, const visit_t *, const float *, const float *, visit_t) const;
 
 protected:
     vec<abc_t> permissible_chars; // What characters are permissible to act upon?
@@ -165,8 +215,8 @@ public:
     bool is_expanded() const;
     bool is_evaluated() const;
     const vec<float> &get_priors() const;
-    // Play one mini-step.
-    pair<BaseNode *, ChosenChar> play_mini(PlayStrategy, float) const;
+    // Play one mini-step, with the stats of the overlay if it is not null.
+    pair<BaseNode *, ChosenChar> play_mini(PlayStrategy, float, RandomStream &, StatsOverlay * = nullptr) const;
     void show_action_stats() const;
 
     /* --------------------- Pruning-related --------------------- */
@@ -246,6 +296,58 @@ public:
     const vec<float> &get_rewards() const;
 };
 
+/* ------------------------ Prior Block ----------------------- */
+
+// Meta priors and special priors of a batch of evaluated states, stored once for the whole batch instead of being
+// copied into every node. Tree nodes only gather the columns they might use, so the block is released once the batch
+// has been evaluated.
+class PriorBlock
+{
+    vec<float> meta_priors;    // [size, 6, num_abc]
+    vec<float> special_priors; // [size, 6]
+
+public:
+    const size_t size;
+    const size_t num_abc;
+
+    PriorBlock(const float *, const float *, size_t, size_t);
+    PriorBlock(vec<float> &&, vec<float> &&, size_t, size_t);
+
+    template <typename... Args>
+    static std::shared_ptr<const PriorBlock> create(Args &&...args) { return std::make_shared<const PriorBlock>(std::forward<Args>(args)...); }
+
+    // Priors of row `row` in meta phase `index`, with `num_abc` entries.
+    inline const float *get_meta_priors(size_t row, size_t index) const { return meta_priors.data() + (row * 6 + index) * num_abc; }
+    inline const float *get_special_priors(size_t row) const { return special_priors.data() + row * 6; }
+};
+
+using PriorBlockPtr = std::shared_ptr<const PriorBlock>;
+
+// Priors that a tree node keeps for itself and the mini nodes below it, only at the columns that their actions might
+// use (see `ActionSpace::get_prior_chars`). Since stale nodes are only reset lazily, the payloads of all of them are also
+// dropped eagerly when a new epoch starts.
+class KeptPriors
+{
+    friend class BaseNode;
+    friend class TreeNode;
+
+    vec<abc_t> after_chars;   // Sorted after ids.
+    vec<abc_t> context_chars; // Sorted units of the four contexts.
+    // Laid out as [befores, after_chars, 4 * context_chars], where befores are aligned with the actions of the node.
+    vec<float> meta_priors;
+    vec<float> special_priors;
+
+    // Created in the current epoch.
+    static vec<std::weak_ptr<KeptPriors>> live;
+    static size_t live_limit;
+    static std::mutex live_mtx;
+
+    static std::shared_ptr<KeptPriors> create();
+    static void release_all();
+    // Gather the priors of `actions` from the columns of `chars`. Actions without a column get zero.
+    static vec<float> gather(const float *, const vec<abc_t> &, const vec<abc_t> &);
+};
+
 /* ------------------------- Tree Node ------------------------ */
 
 // FIXME(j_luo) weird
@@ -276,6 +378,8 @@ private:
     // Create a new node if it is not in the trie.
     static TreeNode *get_tree_node(const vec<Word *> &);
     static TreeNode *get_tree_node(const vec<Word *> &, bool);
+    // Return the existing node with these words, or null.
+    static TreeNode *find_tree_node(const vec<Word *> &);
     static void remove_node_from_t_table(TreeNode *);
 
 public:
@@ -286,12 +390,22 @@ public:
 private:
     friend class ActionManager;
 
-    vec<vec<float>> meta_priors;
-    vec<float> special_priors;
+    friend class BaseNode; // Priors are released when they are cleared.
+
+    // Mini nodes gather their priors from the kept columns.
+    std::shared_ptr<KeptPriors> kept_priors;
     float dist = 0.0;
     bool done = false;
-
-    void evaluate(const vec<vec<float>> &, const vec<float> &);
+    // If expansion is deferred, the words of the parent at the orders that have been changed. The parent is looked up
+    // again on expansion since it might have been evicted in the meantime.
+    vec<pair<int, Word *>> deferred_parent_words;
+    // Set with release ordering once the action tables are complete, so that they can be read without the lock.
+    // `is_expanded` is already true after the first action has been added.
+    std::atomic<bool> expansion_done{false};
+
+    void evaluate(std::shared_ptr<KeptPriors> &&);
+    // Evaluate with one row of the block, keeping only the columns of the given after ids and context units.
+    void evaluate(const PriorBlock &, size_t, vec<abc_t> &&, vec<abc_t> &&);
     void add_noise(const vec<vec<float>> &, const vec<float> &, float);
 
 public:
@@ -304,7 +418,7 @@ public:
     float get_dist() const;
     bool is_done() const;
     bool is_leaf() const;
-    pair<TreeNode *, Subpath> play(PlayStrategy, float) const;
+    pair<TreeNode *, Subpath> play(PlayStrategy, float, RandomStream &, StatsOverlay * = nullptr) const;
     const IdSeq &get_id_seq(int) const;
     size_t size() const;
     bool is_transitional() const override;
@@ -364,11 +478,13 @@ class EdgeBuilder
 class Traverser
 {
     friend class ActionSpace;
+    friend class Env;
 
-    // Visit one node and append it to the queue if it hasn't been visited.
-    static void visit(BaseNode *node, vec<BaseNode *> &queue)
+    // Visit one node and append it to the queue if it hasn't been visited. Nodes without any visit are skipped unless
+    // `include_unvisited` is true.
+    static void visit(BaseNode *node, vec<BaseNode *> &queue, bool include_unvisited)
     {
-        if (!node->visited && (node->visit_count > 0))
+        if (!node->visited && (include_unvisited || (node->get_visit_count() > 0)))
         {
             node->visited = true;
             queue.push_back(node);
@@ -376,17 +492,17 @@ class Traverser
     };
 
     // Traverse from `start` using bfs.
-    static vec<BaseNode *> bfs(BaseNode *start)
+    static vec<BaseNode *> bfs(BaseNode *start, bool include_unvisited = false)
     {
         auto queue = vec<BaseNode *>();
-        visit(start, queue);
+        visit(start, queue, include_unvisited);
         size_t i = 0;
         while (i < queue.size())
         {
             auto selected = queue[i];
             for (const auto child : selected->children)
                 if (child != nullptr)
-                    visit(child, queue);
+                    visit(child, queue, include_unvisited);
             ++i;
         }
 
@@ -394,12 +510,38 @@ class Traverser
             node->visited = false;
         return queue;
     }
+
+    // Return the non-persistent nodes below `start` (other than `kept`) that are only reachable through `start`.
+    // A node is included once every edge into it comes from `start` or another included node, so the walk stops at
+    // nodes that have any other parent, e.g., anything reachable from the kept subtree. Nodes on cycles are left out.
+    // Persistent nodes (e.g., the played mini nodes) are walked through but never returned.
+    static vec<BaseNode *> orphans(BaseNode *start, const BaseNode *kept)
+    {
+        auto queue = vec<BaseNode *>();
+        // Number of edges into each node that come from `start` or from a node in the queue.
+        auto num_dropped = map<BaseNode *, size_t>();
+        auto drop_edges = [&](const BaseNode *parent) {
+            for (const auto child : parent->children)
+                if ((child != nullptr) && (child != start) && (child != kept) && (++num_dropped[child] == child->parents.size()))
+                    queue.push_back(child);
+        };
+        drop_edges(start);
+        for (size_t i = 0; i < queue.size(); ++i)
+            drop_edges(queue[i]);
+
+        auto ret = vec<BaseNode *>();
+        for (const auto node : queue)
+            if (!node->is_persistent())
+                ret.push_back(node);
+        return ret;
+    }
 };
 
 class LruCache;
 class MemoryManager
 {
     friend class LruCache;
+    friend class ActionSpace; // Mini nodes that are not materialized are released right after use.
 
     static void make_persistent(BaseNode *node) { node->make_persistent(); }
     // Release memory allocated to `node` by calling `delete`, and remove its entry in the `t_table` if needed.
@@ -416,9 +558,58 @@ class Mcts;
 class StatsManager
 {
     friend class Mcts;
+    friend class Env;
 
     static void update_stats(BaseNode *node, size_t index, float new_value, int game_count, float virtual_loss) { node->update_stats(index, new_value, game_count, virtual_loss); }
     static void virtual_select(BaseNode *node, size_t index, int game_count, float virtual_loss) { node->virtual_select(index, game_count, virtual_loss); }
+    static void new_epoch() { BaseNode::new_epoch(); }
+};
+
+// Private stats of one root-parallel worker (or lockstep episode) on top of the shared node graph. The first time the
+// worker touches a node, the shared stats of that node are copied, and all later reads and updates by this worker go to
+// the copy. Shared stats are never written during the search, so all copies of a node start from the same shared stats,
+// and `merge` can fold the copies back by adding up their differences.
+class StatsOverlay
+{
+public:
+    struct Stats
+    {
+        vec<visit_t> action_counts;
+        vec<float> total_values;
+        vec<float> max_values;
+        visit_t visit_count;
+        int max_index;
+        float max_value;
+    };
+
+private:
+    map<const BaseNode *, Stats> entries;
+    // Epoch of the entries. Nodes might have been evicted since an older epoch, so such entries are dropped unread.
+    uint32_t epoch = BaseNode::global_epoch.load();
+    // Lockstep episodes share evaluations, but a node that has only been evaluated for another episode is still a leaf
+    // to this one, as it would be in a search of its own. Only used if `track_leaves` is set.
+    bool track_leaves;
+    set<const TreeNode *> evaluated;
+
+    void check_epoch();
+
+public:
+    explicit StatsOverlay(bool track_leaves = false);
+
+    // Return the stats of `node`, copying them from the shared stats if needed. The reference is only valid until the
+    // next call.
+    Stats &get(const BaseNode *);
+    void virtual_select(const BaseNode *, size_t, int, float);
+    void update_stats(const BaseNode *, size_t, float, int, float);
+    size_t size() const;
+    bool is_leaf(const TreeNode *) const;
+    // Record that `node` has been evaluated for this overlay, i.e., that a path of this overlay has ended there.
+    void add_evaluated(const TreeNode *);
+    // Overwrite the shared stats of every node in this overlay with its copy.
+    void store() const;
+    // Fold all overlays into the shared stats and clear them. Pending virtual losses are carried over to the shared stats
+    // and removed from there by the later backup.
+    static void merge(vec<StatsOverlay> &);
 };
 
 // All useful methods invoked by ActionSpace, including initializing/evaluating nodes and action expansion.
@@ -427,14 +618,21 @@ class ActionManager
     friend class ActionSpace;
 
     static void add_action(BaseNode *node, abc_t action, const Affected &affected) { node->add_action(action, affected); }
+    static void add_action(BaseNode *node, abc_t action, Affected &&affected) { node->add_action(action, std::move(affected)); }
     static void update_affected_at(BaseNode *node, size_t index, int order, size_t pos, float misalign_score) { node->update_affected_at(index, order, pos, misalign_score); }
     static void init_pruned(BaseNode *node) { node->init_pruned(); }
+    static void init_heuristics(BaseNode *node) { node->init_heuristics(); }
     static void init_stats(BaseNode *node) { node->init_stats(); };
     static void init_rewards(TransitionNode *node) { node->init_rewards(); }
-    static void evaluate(TreeNode *node, const vec<vec<float>> &meta_priors, const vec<float> &special_priors) { node->evaluate(meta_priors, special_priors); }
+    static void evaluate(TreeNode *node, const PriorBlock &block, size_t row, vec<abc_t> &&after_chars, vec<abc_t> &&context_chars) { node->evaluate(block, row, std::move(after_chars), std::move(context_chars)); }
     static void evaluate(MiniNode *node) { node->evaluate(); }
     static void add_noise(TreeNode *node, const vec<vec<float>> &meta_noise, const vec<float> &special_noise, float noise_ratio) { node->add_noise(meta_noise, special_noise, noise_ratio); }
     static void dummy_evaluate(BaseNode *node) { node->dummy_evaluate(); }
+    static void defer_expansion(TreeNode *node, vec<pair<int, Word *>> &&parent_words) { node->deferred_parent_words = std::move(parent_words); }
+    static const vec<pair<int, Word *>> &get_deferred_parent_words(const TreeNode *node) { return node->deferred_parent_words; }
+    static void clear_deferred_parent_words(TreeNode *node) { vec<pair<int, Word *>>().swap(node->deferred_parent_words); }
+    static void finish_expansion(TreeNode *node) { node->expansion_done.store(true, std::memory_order_release); }
+    static bool is_expansion_done(const TreeNode *node) { return node->expansion_done.load(std::memory_order_acquire); }
     static void clear_priors(BaseNode *node) { node->clear_priors(); }
 };
 
@@ -443,7 +641,23 @@ class PruningManager
     friend class ActionSpace;
     friend class Mcts;
 
-    static void prune(BaseNode *node, size_t index) { node->prune(index); }
+    // Pruning propagates to parents, so all pruning is serialized through one lock.
+    inline static std::mutex mtx;
+
+    static void prune(BaseNode *node, size_t index)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        node->prune(index);
+    }
+};
+
+// Used to guard graph mutation (node creation, expansion and evaluation) during multithreaded selection.
+class LockManager
+{
+    friend class ActionSpace;
+    friend class Env;
+
+    static std::mutex &get_mutex(BaseNode *node) { return node->mtx; }
 };
 
 class NodeFactory
@@ -456,6 +670,7 @@ class NodeFactory
     static TransitionNode *get_transition_node(const TreeNode *base, bool stopped) { return new TransitionNode(base, stopped); }
     static TreeNode *get_tree_node(const vec<Word *> &words) { return TreeNode::get_tree_node(words); }
     static TreeNode *get_tree_node(const vec<Word *> &words, bool stopped) { return TreeNode::get_tree_node(words, stopped); };
+    static TreeNode *find_tree_node(const vec<Word *> &words) { return TreeNode::find_tree_node(words); }
     static TreeNode *get_stopped_node(const TreeNode *node) { return new TreeNode(node->words, true); }
 };
 
@@ -0,0 +1,104 @@
+#include "state_batcher.hpp"
+
+StateBatcher::StateBatcher(size_t num_threads, abc_t pad_id, size_t max_end_length) : owns_pool(true),
+                                                                                      num_threads(num_threads),
+                                                                                      pad_id(pad_id),
+                                                                                      max_end_length(max_end_length)
+{
+    if (num_threads > 1)
+        tp = new Pool(num_threads);
+    else
+        tp = nullptr;
+}
+
+StateBatcher::StateBatcher(Pool *tp, abc_t pad_id, size_t max_end_length) : tp(tp),
+                                                                             owns_pool(false),
+                                                                             num_threads((tp == nullptr) ? 1 : tp->size()),
+                                                                             pad_id(pad_id),
+                                                                             max_end_length(max_end_length) {}
+
+StateBatcher::~StateBatcher()
+{
+    if (owns_pool)
+        delete tp;
+}
+
+void StateBatcher::parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn) const
+{
+    // Small batches are not worth the dispatch.
+    if ((tp == nullptr) || (n < 64))
+    {
+        fn(0, n);
+        return;
+    }
+    const size_t chunk_size = (n + num_threads - 1) / num_threads;
+    vec<std::future<void>> results;
+    results.reserve(num_threads);
+    for (size_t start = 0; start < n; start += chunk_size)
+    {
+        size_t end = std::min(start + chunk_size, n);
+        results.push_back(tp->push([&fn, start, end](int) { fn(start, end); }));
+    }
+    for (auto &result : results)
+        result.wait();
+}
+
+size_t StateBatcher::get_max_length(const vec<TreeNode *> &nodes) const
+{
+    const size_t n = nodes.size();
+    if (n == 0)
+        return 0;
+    const size_t nw = nodes[0]->size();
+    std::mutex mtx;
+    size_t ret = 0;
+    parallel_for(n, [&](size_t start, size_t end) {
+        size_t m = 0;
+        for (size_t i = start; i < end; ++i)
+            for (size_t j = 0; j < nw; ++j)
+                m = std::max(m, nodes[i]->get_id_seq(j).size());
+        std::lock_guard<std::mutex> lock(mtx);
+        ret = std::max(ret, m);
+    });
+    return ret;
+}
+
+template <typename T>
+void StateBatcher::pack(const vec<TreeNode *> &nodes, size_t max_length, T *ids, T *almts1, T *almts2) const
+{
+    const size_t n = nodes.size();
+    if (n == 0)
+        return;
+    const size_t nw = nodes[0]->size();
+    const bool use_alignment = (almts1 != nullptr) && (almts2 != nullptr);
+    parallel_for(n, [&](size_t start, size_t end) {
+        for (size_t i = start; i < end; ++i)
+        {
+            const auto node = nodes[i];
+            for (size_t j = 0; j < nw; ++j)
+            {
+                const auto &id_seq = node->get_id_seq(j);
+                const size_t length = id_seq.size();
+                assert(length <= max_length);
+                T *row = ids + (i * nw + j) * max_length;
+                std::copy(id_seq.begin(), id_seq.end(), row);
+                std::fill(row + length, row + max_length, static_cast<T>(pad_id));
+                if (!use_alignment)
+                    continue;
+
+                // Read the alignments in place instead of going through `TreeNode::get_alignments`.
+                const auto &almt = node->words[j]->get_almt_at(j);
+                row = almts1 + (i * nw + j) * max_length;
+                std::copy(almt.pos_seq1.begin(), almt.pos_seq1.begin() + length, row);
+                std::fill(row + length, row + max_length, static_cast<T>(-1));
+                row = almts2 + (i * nw + j) * max_end_length;
+                assert(almt.pos_seq2.size() <= max_end_length);
+                std::copy(almt.pos_seq2.begin(), almt.pos_seq2.end(), row);
+                std::fill(row + almt.pos_seq2.size(), row + max_end_length, static_cast<T>(-1));
+            }
+        }
+    });
+}
+
+template void StateBatcher::pack<int16_t>(const vec<TreeNode *> &, size_t, int16_t *, int16_t *, int16_t *) const;
+template void StateBatcher::pack<int32_t>(const vec<TreeNode *> &, size_t, int32_t *, int32_t *, int32_t *) const;
+template void StateBatcher::pack<long>(const vec<TreeNode *> &, size_t, long *, long *, long *) const;
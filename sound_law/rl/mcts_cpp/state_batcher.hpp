@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.hpp"
+#include "node.hpp"
+
+// Pack tree nodes into padded id and alignment tensors for the agent. Rows are written directly into caller-provided
+// buffers (all flat and row-major) in parallel, without copying id sequences or alignments.
+class StateBatcher
+{
+    Pool *tp;
+    // Whether `tp` is owned by this batcher, or borrowed (e.g., from `Mcts`).
+    bool owns_pool;
+
+    // Run `fn(start, end)` over chunks of `[0, n)`, one chunk per thread.
+    void parallel_for(size_t, const std::function<void(size_t, size_t)> &) const;
+
+public:
+    const size_t num_threads;
+    const abc_t pad_id;
+    const size_t max_end_length;
+
+    // Run on a pool of its own with the given number of threads.
+    StateBatcher(size_t, abc_t, size_t);
+    // Run on a borrowed pool (serially if null), which should outlive the batcher.
+    StateBatcher(Pool *, abc_t, size_t);
+    ~StateBatcher();
+    StateBatcher(const StateBatcher &) = delete;
+    StateBatcher &operator=(const StateBatcher &) = delete;
+
+    // Return the max length of all id sequences of `nodes`.
+    size_t get_max_length(const vec<TreeNode *> &) const;
+    // Write ids ([n, num_words, max_length], padded with `pad_id`) to the first buffer. If the other buffers are not
+    // null, write alignments of the current words ([n, num_words, max_length]) and of the end words
+    // ([n, num_words, max_end_length]) to them, padded with -1. `T` is one of `int16_t`, `int32_t` and `long`.
+    template <typename T>
+    void pack(const vec<TreeNode *> &, size_t, T *, T *, T *) const;
+};
@@ -1,10 +1,18 @@
 #include <chrono>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <thread>
 
 #include "word.hpp"
 #include "action.hpp"
 #include "node.hpp"
 #include "env.hpp"
 #include "mcts.hpp"
+#include "beam.hpp"
+#include "episode.hpp"
+#include "eval_cache.hpp"
+#include "state_batcher.hpp"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "cxxopts.hpp"
 
@@ -69,6 +77,1675 @@ void add_flag(cxxopts::Options &options, const std::string &name, const std::str
     options.add_options()(name, desc);
 }
 
+// Every unit can change into the units close to it, or be deleted.
+void register_changes(Env *env, int num_abc, abc_t emp_id)
+{
+    for (int i = 4; i < num_abc; i++)
+    {
+        for (int j = std::max(0, i - 10); j < std::min(num_abc, i + 11); j++)
+            if ((i != j) && (j > 3))
+                env->register_permissible_change(i, j);
+        env->register_permissible_change(i, emp_id);
+    }
+}
+
+// Sample rules at random sites of an expanded node. The unit of the site changes into its lower neighbor or is deleted.
+// Every context unit is taken from the site or dropped, and once in a while the context is taken from another
+// position, so that some rules match nothing.
+vec<Rule> sample_rules(const TreeNode *node, abc_t null_id, abc_t emp_id, int num_rules)
+{
+    auto rules = vec<Rule>();
+    const size_t num_actions = node->get_num_actions();
+    // Skip STOP.
+    if (num_actions <= 1)
+        return rules;
+    for (int i = 0; i < num_rules; ++i)
+    {
+        const size_t index = 1 + static_cast<size_t>(randint(num_actions - 1));
+        const auto &aff = node->get_affected_at(index);
+        const size_t j = static_cast<size_t>(randint(aff.size()));
+        const auto &id_seq = node->get_id_seq(aff.get_order_at(j));
+        int pos = aff.get_position_at(j);
+        if (rand() % 4 == 0)
+            pos = 1 + static_cast<int>(randint(id_seq.size() - 2));
+        auto get_context = [&id_seq, pos, null_id](int offset) {
+            const int i = pos + offset;
+            if ((i < 0) || (i >= static_cast<int>(id_seq.size())) || (rand() % 2 == 0))
+                return null_id;
+            return id_seq[i];
+        };
+        auto rule = Rule();
+        rule.before_id = node->get_action_at(index);
+        rule.after_id = (rand() % 3 == 0) ? emp_id : static_cast<abc_t>(rule.before_id - 1);
+        rule.pre_id = get_context(-1);
+        rule.d_pre_id = (rule.pre_id == null_id) ? null_id : get_context(-2);
+        rule.post_id = get_context(1);
+        rule.d_post_id = (rule.post_id == null_id) ? null_id : get_context(2);
+        rule.st = SpecialType::NONE;
+        rules.push_back(rule);
+    }
+    return rules;
+}
+
+VocabIdSeq get_ids(const TreeNode *node)
+{
+    auto ids = VocabIdSeq();
+    for (size_t order = 0; order < node->size(); ++order)
+        ids.push_back(node->get_id_seq(order));
+    return ids;
+}
+
+TreeNode *apply_cascade(Env *env, const vec<Rule> &rules)
+{
+    auto node = env->start;
+    for (const auto &rule : rules)
+        node = env->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st);
+    return node;
+}
+
+// Sample cascades from the start, where every node gets (at most) `width` children through the rules that match
+// anything, `depth` levels deep. Every prefix of a cascade is a cascade as well, the empty one included.
+vec<vec<Rule>> sample_cascades(Env *env, abc_t null_id, abc_t emp_id, int depth, int width)
+{
+    auto cascades = vec<vec<Rule>>{vec<Rule>()};
+    size_t begin = 0;
+    for (int d = 0; d < depth; ++d)
+    {
+        const size_t end = cascades.size();
+        for (size_t i = begin; i < end; ++i)
+        {
+            auto node = apply_cascade(env, cascades[i]);
+            env->ensure_expanded(node);
+            for (const auto &rule : sample_rules(node, null_id, emp_id, width))
+            {
+                try
+                {
+                    env->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st);
+                }
+                catch (const std::runtime_error &)
+                {
+                    continue;
+                }
+                cascades.push_back(cascades[i]);
+                cascades.back().push_back(rule);
+            }
+        }
+        begin = end;
+    }
+    return cascades;
+}
+
+// Root actions should list every unit (and the base unit of every vowel) with its sites, in the order of a scan over
+// the words, just like the old expansion that went through the words site by site.
+bool check_occurrence_index(Env *env, const WordSpaceOpt &ws_opt, const vec<vec<Rule>> &cascades)
+{
+    for (const auto &cascade : cascades)
+    {
+        auto node = apply_cascade(env, cascade);
+        env->ensure_expanded(node);
+        auto units = vec<abc_t>();
+        auto unit2sites = map<abc_t, vec<pair<int, size_t>>>();
+        auto add_site = [&units, &unit2sites](abc_t unit, int order, size_t pos) {
+            auto &sites = unit2sites[unit];
+            if (sites.empty())
+                units.push_back(unit);
+            sites.push_back({order, pos});
+        };
+        for (size_t order = 0; order < node->size(); ++order)
+        {
+            const auto &id_seq = node->get_id_seq(order);
+            for (size_t pos = 1; pos + 1 < id_seq.size(); ++pos)
+            {
+                add_site(id_seq[pos], order, pos);
+                if (ws_opt.unit_stress[id_seq[pos]] != Stress::NOSTRESS)
+                    add_site(ws_opt.unit2base[id_seq[pos]], order, pos);
+            }
+        }
+        bool ok = (node->get_num_actions() == units.size() + 1);
+        for (size_t i = 0; ok && (i < units.size()); ++i)
+        {
+            const auto &aff = node->get_affected_at(i + 1);
+            const auto &sites = unit2sites[units[i]];
+            ok = (node->get_action_at(i + 1) == units[i]) && (aff.size() == sites.size());
+            for (size_t j = 0; ok && (j < sites.size()); ++j)
+                ok = (aff.get_order_at(j) == sites[j].first) && (static_cast<size_t>(aff.get_position_at(j)) == sites[j].second);
+        }
+        if (!ok)
+        {
+            SPDLOG_ERROR("Root actions differ from a scan over the words after {} rules.", cascade.size());
+            return false;
+        }
+    }
+    SPDLOG_INFO("Occurrence index checked on {} nodes.", cascades.size());
+    return true;
+}
+
+// Whether both nodes have the same actions with the same affected sites. Misalignment scores are compared per site since
+// the totals are normalized by the distance of the start state, which depends on the environment.
+bool same_actions(const TreeNode *node1, const TreeNode *node2)
+{
+    if (node1->get_num_actions() != node2->get_num_actions())
+        return false;
+    for (size_t i = 0; i < node1->get_num_actions(); ++i)
+    {
+        const auto &aff1 = node1->get_affected_at(i);
+        const auto &aff2 = node2->get_affected_at(i);
+        if ((node1->get_action_at(i) != node2->get_action_at(i)) || (aff1.size() != aff2.size()) || (aff1.get_num_misaligned() != aff2.get_num_misaligned()))
+            return false;
+        for (size_t j = 0; j < aff1.size(); ++j)
+            if ((aff1.get_order_at(j) != aff2.get_order_at(j)) || (aff1.get_position_at(j) != aff2.get_position_at(j)) || (aff1.get_misalign_score_at(j) != aff2.get_misalign_score_at(j)))
+                return false;
+    }
+    return true;
+}
+
+// Actions of a child are derived from its parent. They should be the same as a full expansion of the same words, done
+// by an environment that starts from them.
+bool check_derived_actions(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const vec<vec<Rule>> &cascades)
+{
+    for (const auto &cascade : cascades)
+    {
+        if (cascade.empty())
+            continue;
+        auto node = apply_cascade(env, cascade);
+        env->ensure_expanded(node);
+        auto env_opt = env->opt;
+        env_opt.start_ids = get_ids(node);
+        auto fresh = Env(env_opt, as_opt, ws_opt);
+        if ((fresh.start->get_dist() != node->get_dist()) || !same_actions(node, fresh.start))
+        {
+            SPDLOG_ERROR("Derived actions differ from a full expansion after {} rules.", cascade.size());
+            return false;
+        }
+    }
+    SPDLOG_INFO("Derived actions checked on {} nodes.", cascades.size() - 1);
+    return true;
+}
+
+// Nodes created with deferred expansion are expanded when they are first needed, from their parents if these have been
+// expanded already. Expand them in a random order, so that both happen, and check them against the eager nodes.
+bool check_deferred_expansion(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const vec<vec<Rule>> &cascades)
+{
+    auto deferred_opt = as_opt;
+    deferred_opt.defer_expansion = true;
+    auto deferred = Env(env->opt, deferred_opt, ws_opt);
+    auto nodes = vec<pair<TreeNode *, TreeNode *>>();
+    for (const auto &cascade : cascades)
+        nodes.push_back({apply_cascade(env, cascade), apply_cascade(&deferred, cascade)});
+    std::shuffle(nodes.begin(), nodes.end(), std::mt19937(0));
+    for (const auto &item : nodes)
+    {
+        env->ensure_expanded(item.first);
+        deferred.ensure_expanded(item.second);
+        if ((item.first->get_dist() != item.second->get_dist()) || !same_actions(item.first, item.second))
+        {
+            SPDLOG_ERROR("Deferred expansion differs from the eager one.");
+            return false;
+        }
+    }
+    SPDLOG_INFO("Deferred expansion checked on {} nodes.", nodes.size());
+    return true;
+}
+
+// Apply a rule directly and through the mini nodes. Both should reach the same node, or both should fail.
+bool check_direct_apply(Env *env, abc_t null_id, abc_t emp_id, const vec<vec<Rule>> &cascades)
+{
+    size_t num_rules = 0;
+    size_t num_matched = 0;
+    for (const auto &cascade : cascades)
+    {
+        auto node = apply_cascade(env, cascade);
+        env->ensure_expanded(node);
+        for (const auto &rule : sample_rules(node, null_id, emp_id, 8))
+        {
+            TreeNode *direct = nullptr;
+            TreeNode *reference = nullptr;
+            try
+            {
+                direct = env->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st);
+            }
+            catch (const std::runtime_error &)
+            {
+            }
+            try
+            {
+                auto subpath = Subpath();
+                reference = env->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st, subpath);
+            }
+            catch (const std::runtime_error &)
+            {
+            }
+            if (direct != reference)
+            {
+                SPDLOG_ERROR("Direct application of {} -> {} differs from the one through the mini nodes.", rule.before_id, rule.after_id);
+                return false;
+            }
+            ++num_rules;
+            num_matched += (direct != nullptr);
+        }
+    }
+    SPDLOG_INFO("Direct application checked with {} rules ({} matched).", num_rules, num_matched);
+    return true;
+}
+
+// Apply every cascade (followed by a few rules that might match nothing) to the vocabularies of all sampled nodes at
+// once. Results should be the same as applying the rules one by one to the nodes, skipping the rules that fail.
+bool check_cascades(Env *env, abc_t null_id, abc_t emp_id, const vec<vec<Rule>> &cascades, int num_threads)
+{
+    auto nodes = vec<TreeNode *>();
+    auto vocabs = vec<VocabIdSeq>();
+    for (const auto &cascade : cascades)
+    {
+        nodes.push_back(apply_cascade(env, cascade));
+        vocabs.push_back(get_ids(nodes.back()));
+    }
+    for (const auto &cascade : cascades)
+    {
+        auto rules = cascade;
+        auto last = apply_cascade(env, cascade);
+        env->ensure_expanded(last);
+        for (const auto &rule : sample_rules(last, null_id, emp_id, 4))
+            rules.push_back(rule);
+        const auto results = env->apply_rules(vocabs, rules, num_threads);
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto node = nodes[i];
+            auto dists = vec<float>{node->get_dist()};
+            auto applied = vec<bool>();
+            for (const auto &rule : rules)
+            {
+                try
+                {
+                    node = env->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st);
+                    applied.push_back(true);
+                }
+                catch (const std::runtime_error &)
+                {
+                    applied.push_back(false);
+                }
+                dists.push_back(node->get_dist());
+            }
+            if ((results[i].ids != get_ids(node)) || (results[i].dists != dists) || (results[i].applied != applied))
+            {
+                SPDLOG_ERROR("Cascade of {} rules differs from applying them one by one.", rules.size());
+                return false;
+            }
+        }
+    }
+    SPDLOG_INFO("Cascades checked on {} vocabularies.", nodes.size());
+    return true;
+}
+
+// Count the sites affected by sampled rules, one by one and in a batch, on eager nodes and on deferred nodes that have
+// not been expanded yet. Counts should be the ones of the last mini node, or zero if the mini nodes do not have the rule.
+// Rules sampled from the previous node are counted as well, whose before units might not be found at all.
+bool check_num_affected(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const vec<vec<Rule>> &cascades, int num_abc)
+{
+    auto deferred_opt = as_opt;
+    deferred_opt.defer_expansion = true;
+    auto deferred = Env(env->opt, deferred_opt, ws_opt);
+    register_changes(&deferred, num_abc, as_opt.emp_id);
+    auto prev_rules = vec<Rule>();
+    size_t num_rules = 0;
+    for (const auto &cascade : cascades)
+    {
+        auto node = apply_cascade(env, cascade);
+        env->ensure_expanded(node);
+        auto rules = sample_rules(node, as_opt.null_id, as_opt.emp_id, 8);
+        const size_t num_sampled = rules.size();
+        rules.insert(rules.end(), prev_rules.begin(), prev_rules.end());
+        prev_rules = vec<Rule>(rules.begin(), rules.begin() + num_sampled);
+        for (auto e : {env, &deferred})
+        {
+            node = apply_cascade(e, cascade);
+            auto counts = vec<int>();
+            for (const auto &rule : rules)
+                counts.push_back(e->get_num_affected(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st));
+            const auto batch_counts = e->get_num_affected(node, rules);
+            for (size_t i = 0; i < rules.size(); ++i)
+            {
+                const auto &rule = rules[i];
+                int expected = 0;
+                try
+                {
+                    auto subpath = Subpath();
+                    e->apply_action(node, rule.before_id, rule.after_id, rule.pre_id, rule.d_pre_id, rule.post_id, rule.d_post_id, rule.st, subpath);
+                    expected = static_cast<int>(subpath.mini_node_seq[5]->get_num_affected_at(subpath.chosen_seq[6].first));
+                }
+                catch (const std::runtime_error &)
+                {
+                }
+                if ((counts[i] != expected) || (batch_counts[i] != expected))
+                {
+                    SPDLOG_ERROR("Count of sites affected by {} -> {} differs from the mini nodes.", rule.before_id, rule.after_id);
+                    return false;
+                }
+            }
+        }
+        num_rules += rules.size();
+    }
+    SPDLOG_INFO("Affected counts checked with {} rules.", num_rules);
+    return true;
+}
+
+// Enumerate the actions of a few nodes with streamed mini nodes (in parallel), with materialized ones, and through
+// `expand_all_actions`. All should agree, and every action should then reach the same node through the mini nodes as
+// through the direct application. Applying an action through the mini nodes lets its special type have any after unit,
+// so the enumeration is done in a fresh environment, before any action is applied.
+bool check_enumeration(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const vec<vec<Rule>> &cascades, size_t num_nodes, int num_threads, int num_abc)
+{
+    auto fresh = Env(env->opt, as_opt, ws_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto nodes = vec<TreeNode *>();
+    auto enumerated = vec<vec<vec<ActionVec>>>();
+    size_t num_actions = 0;
+    for (size_t c = 0; c < std::min(num_nodes, cascades.size()); ++c)
+    {
+        auto node = apply_cascade(&fresh, cascades[c]);
+        fresh.ensure_expanded(node);
+        auto indices = vec<size_t>();
+        for (size_t index = 0; index < node->get_num_actions(); ++index)
+            indices.push_back(index);
+        const auto streamed = fresh.enumerate_actions(node, indices, false, num_threads);
+        const auto materialized = fresh.enumerate_actions(node, indices, true, 1);
+        const auto all_actions = fresh.expand_all_actions(node);
+        auto flattened = vec<vec<abc_t>>();
+        for (const auto &actions : streamed)
+            for (const auto &a : actions)
+                flattened.push_back(vec<abc_t>(a.begin(), a.end()));
+        if ((streamed != materialized) || (flattened != all_actions))
+        {
+            SPDLOG_ERROR("Enumerated actions differ after {} rules.", cascades[c].size());
+            return false;
+        }
+        nodes.push_back(node);
+        enumerated.push_back(streamed);
+        num_actions += all_actions.size();
+    }
+    for (size_t c = 0; c < nodes.size(); ++c)
+        // Skip STOP.
+        for (size_t i = 1; i < enumerated[c].size(); ++i)
+            for (const auto &a : enumerated[c][i])
+            {
+                auto subpath = Subpath();
+                const auto st = static_cast<SpecialType>(a[1]);
+                auto reference = fresh.apply_action(nodes[c], a[0], a[2], a[3], a[4], a[5], a[6], st, subpath);
+                if (fresh.apply_action(nodes[c], a[0], a[2], a[3], a[4], a[5], a[6], st) != reference)
+                {
+                    SPDLOG_ERROR("Enumerated action {} -> {} reaches a different node when applied directly.", a[0], a[2]);
+                    return false;
+                }
+            }
+    SPDLOG_INFO("Enumeration checked with {} actions.", num_actions);
+    return true;
+}
+
+// The lookahead of a few nodes should list the actions of `expand_all_actions` with the exact distances of the nodes
+// they lead to. Stopping keeps the distance.
+bool check_lookahead(Env *env, abc_t null_id, const vec<vec<Rule>> &cascades, size_t num_nodes, int num_threads)
+{
+    size_t num_actions = 0;
+    for (size_t c = 0; c < std::min(num_nodes, cascades.size()); ++c)
+    {
+        auto node = apply_cascade(env, cascades[c]);
+        const auto lookahead = env->get_lookahead(node, num_threads);
+        const auto all_actions = env->expand_all_actions(node);
+        bool ok = (lookahead.actions.size() == all_actions.size()) && (lookahead.dists.size() == all_actions.size());
+        for (size_t i = 0; ok && (i < all_actions.size()); ++i)
+        {
+            const auto &a = lookahead.actions[i];
+            ok = (vec<abc_t>(a.begin(), a.end()) == all_actions[i]);
+            if (ok && (a[0] == null_id))
+                ok = (lookahead.dists[i] == node->get_dist());
+            else if (ok)
+                ok = (lookahead.dists[i] == env->apply_action(node, a[0], a[2], a[3], a[4], a[5], a[6], static_cast<SpecialType>(a[1]))->get_dist());
+        }
+        if (!ok)
+        {
+            SPDLOG_ERROR("Lookahead differs from applying the actions after {} rules.", cascades[c].size());
+            return false;
+        }
+        num_actions += all_actions.size();
+    }
+    SPDLOG_INFO("Lookahead checked with {} actions.", num_actions);
+    return true;
+}
+
+// Beam search by brute force: every action of every hypothesis is applied, candidates are ranked by distance (then by
+// hypothesis and by the order of `expand_all_actions`), and the best ones that reach new nodes are kept.
+vec<Hypothesis> brute_force_beam(Env *env, abc_t null_id, TreeNode *node, size_t beam_size, int depth)
+{
+    struct Candidate
+    {
+        float dist;
+        size_t hyp_index;
+        size_t seq;
+        TreeNode *node;
+        ActionVec action;
+    };
+    auto beam = vec<Hypothesis>{Hypothesis{node, vec<ActionVec>()}};
+    for (int d = 0; d < depth; ++d)
+    {
+        bool all_done = true;
+        for (const auto &hyp : beam)
+            all_done = all_done && hyp.node->is_done();
+        if (all_done)
+            break;
+        auto next = vec<Hypothesis>();
+        auto seen = set<TreeNode *>();
+        auto candidates = vec<Candidate>();
+        for (size_t i = 0; i < beam.size(); ++i)
+        {
+            if (beam[i].node->is_done())
+            {
+                if (seen.insert(beam[i].node).second)
+                    next.push_back(beam[i]);
+                continue;
+            }
+            const auto all_actions = env->expand_all_actions(beam[i].node);
+            for (size_t seq = 0; seq < all_actions.size(); ++seq)
+            {
+                auto action = ActionVec();
+                std::copy(all_actions[seq].begin(), all_actions[seq].end(), action.begin());
+                if (action[0] == null_id)
+                    continue;
+                auto child = env->apply_action(beam[i].node, action[0], action[2], action[3], action[4], action[5], action[6], static_cast<SpecialType>(action[1]));
+                candidates.push_back(Candidate{child->get_dist(), i, seq, child, action});
+            }
+        }
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate &c1, const Candidate &c2) {
+            return std::tie(c1.dist, c1.hyp_index, c1.seq) < std::tie(c2.dist, c2.hyp_index, c2.seq);
+        });
+        for (size_t i = 0; (i < candidates.size()) && (next.size() < beam_size); ++i)
+            if (seen.insert(candidates[i].node).second)
+            {
+                auto hyp = Hypothesis{candidates[i].node, beam[candidates[i].hyp_index].actions};
+                hyp.actions.push_back(candidates[i].action);
+                next.push_back(std::move(hyp));
+            }
+        std::stable_sort(next.begin(), next.end(), [](const Hypothesis &h1, const Hypothesis &h2) { return h1.node->get_dist() < h2.node->get_dist(); });
+        if (next.empty())
+            break;
+        beam = std::move(next);
+    }
+    return beam;
+}
+
+// Beam search (greedy search with one hypothesis) should find the same hypotheses as the brute-force one, with or
+// without threads.
+bool check_beam_search(Env *env, abc_t null_id, const vec<vec<Rule>> &cascades, size_t num_nodes, int depth, int num_threads)
+{
+    for (size_t c = 0; c < std::min(num_nodes, cascades.size()); ++c)
+    {
+        auto node = apply_cascade(env, cascades[c]);
+        for (const size_t beam_size : {1, 3})
+        {
+            const auto expected = brute_force_beam(env, null_id, node, beam_size, depth);
+            for (const int threads : {1, num_threads})
+            {
+                auto beam = BeamSearch(env, BeamSearchOpt{beam_size, threads}).search(node, depth);
+                bool ok = (beam.size() == expected.size());
+                for (size_t i = 0; ok && (i < beam.size()); ++i)
+                    ok = (beam[i].node == expected[i].node) && (beam[i].actions == expected[i].actions);
+                if (!ok)
+                {
+                    SPDLOG_ERROR("Beam search of size {} differs from the brute-force one after {} rules.", beam_size, cascades[c].size());
+                    return false;
+                }
+            }
+        }
+    }
+    SPDLOG_INFO("Beam search checked on {} nodes.", std::min(num_nodes, cascades.size()));
+    return true;
+}
+
+void evaluate_uniform(Env *env, const vec<TreeNode *> &nodes, int num_abc)
+{
+    for (const auto node : nodes)
+        if ((!node->is_done()) && (!node->stopped) && (node->is_leaf()))
+            env->evaluate(node,
+                          vec<vec<float>>{
+                              uniform(num_abc), uniform(num_abc), uniform(num_abc), uniform(num_abc), uniform(num_abc), uniform(num_abc)},
+                          uniform(6));
+}
+
+// Play one episode from every root in eval mode, either one after another or all in lockstep. Return the played nodes
+// of every episode and their stats, which differ as soon as one episode sees the stats of another.
+vec<vec<size_t>> run_episodes(Env *env, const MctsOpt &mcts_opt, const vec<TreeNode *> &starts, int num_steps, int num_sims, int batch_size, int num_abc, bool lockstep)
+{
+    auto mcts = Mcts(env, mcts_opt);
+    mcts.eval();
+    auto groups = vec<vec<size_t>>();
+    if (lockstep)
+    {
+        groups.push_back(vec<size_t>());
+        for (size_t i = 0; i < starts.size(); ++i)
+            groups.back().push_back(i);
+    }
+    else
+        for (size_t i = 0; i < starts.size(); ++i)
+            groups.push_back(vec<size_t>{i});
+
+    auto ret = vec<vec<size_t>>();
+    for (const auto &group : groups)
+    {
+        env->new_epoch();
+        const size_t k = group.size();
+        auto roots = vec<TreeNode *>();
+        for (const auto i : group)
+            roots.push_back(starts[i]);
+        evaluate_uniform(env, roots, num_abc);
+        if (lockstep)
+            mcts.start_lockstep(k);
+        auto played_paths = vec<Path>();
+        for (const auto root : roots)
+            played_paths.push_back(Path(root, 0));
+        auto active = vec<int>();
+        for (size_t i = 0; i < k; ++i)
+            active.push_back(i);
+        for (int step = 0; (step < num_steps) && !active.empty(); ++step)
+        {
+            for (int j = 0; j < num_sims / batch_size; ++j)
+            {
+                auto paths = vec<Path>();
+                if (lockstep)
+                {
+                    auto active_roots = vec<TreeNode *>();
+                    auto active_paths = vec<Path>();
+                    for (const auto i : active)
+                    {
+                        active_roots.push_back(roots[i]);
+                        active_paths.push_back(played_paths[i]);
+                    }
+                    for (const auto &root_paths : mcts.select_lockstep(active_roots, batch_size, vec<int>(active.size(), step), num_steps, active_paths, active))
+                        paths.insert(paths.end(), root_paths.begin(), root_paths.end());
+                }
+                else
+                    paths = mcts.select(roots[0], batch_size, step, num_steps, played_paths[0]);
+                auto selected = vec<TreeNode *>();
+                for (const auto &path : paths)
+                    selected.push_back(path.get_last_node());
+                evaluate_uniform(env, selected, num_abc);
+                mcts.backup(paths, vec<float>(paths.size(), 0.0));
+            }
+            auto next_active = vec<int>();
+            for (const auto i : active)
+            {
+                played_paths[i].merge(mcts.play(roots[i], step, PlayStrategy::MAX, 1.0, lockstep ? i : -1));
+                roots[i] = played_paths[i].get_last_node();
+                if ((!roots[i]->stopped) && (!roots[i]->is_done()))
+                    next_active.push_back(i);
+            }
+            active = next_active;
+        }
+        for (size_t i = 0; i < k; ++i)
+        {
+            if (lockstep)
+                mcts.store_episode_stats(i);
+            auto record = vec<size_t>();
+            for (const auto node : played_paths[i].get_all_nodes())
+            {
+                record.push_back(reinterpret_cast<size_t>(node));
+                record.push_back(node->get_visit_count());
+                for (const auto count : node->get_action_counts())
+                    record.push_back(count);
+            }
+            ret.push_back(record);
+        }
+    }
+    return ret;
+}
+
+// Episodes stepped in lockstep should play exactly like episodes run one after another. Roots are different so that
+// one episode might run into nodes that have only been evaluated for another.
+bool check_lockstep(Env *env, const MctsOpt &mcts_opt, abc_t null_id, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto starts = vec<TreeNode *>{env->start};
+    for (int i = 0; i < 3; ++i)
+    {
+        const abc_t before = env->start->get_id_seq(i)[1];
+        starts.push_back(env->apply_action(env->start, before, before - 1, null_id, null_id, null_id, null_id, SpecialType::NONE));
+    }
+    // Selection with shared stats is only deterministic on one thread.
+    auto sequential_opt = mcts_opt;
+    sequential_opt.num_threads = 1;
+    auto sequential = run_episodes(env, sequential_opt, starts, num_steps, num_sims, batch_size, num_abc, false);
+    auto lockstep = run_episodes(env, mcts_opt, starts, num_steps, num_sims, batch_size, num_abc, true);
+    for (size_t i = 0; i < starts.size(); ++i)
+        if (sequential[i] != lockstep[i])
+        {
+            SPDLOG_ERROR("Lockstep episode {} differs from the sequential one.", i);
+            return false;
+        }
+    SPDLOG_INFO("Lockstep episodes checked.");
+    return true;
+}
+
+// Evaluate the leaves among `nodes` with random priors drawn from `rng`. The priors (six meta rows and the special row)
+// are also recorded in `drawn` if it is not null.
+void evaluate_random(Env *env, const vec<TreeNode *> &nodes, int num_abc, RandomStream &rng, map<const TreeNode *, vec<vec<float>>> *drawn = nullptr)
+{
+    auto draw = [&rng](int n) {
+        auto p = vec<float>(n);
+        for (auto &x : p)
+            x = rng.randf(1.0);
+        return p;
+    };
+    for (const auto node : nodes)
+        if ((!node->is_done()) && (!node->stopped) && (node->is_leaf()))
+        {
+            auto meta_priors = vec<vec<float>>();
+            for (int i = 0; i < 6; ++i)
+                meta_priors.push_back(draw(num_abc));
+            const auto special_priors = draw(6);
+            if ((drawn != nullptr) && !drawn->contains(node))
+            {
+                (*drawn)[node] = meta_priors;
+                (*drawn)[node].push_back(special_priors);
+            }
+            env->evaluate(node, meta_priors, special_priors);
+        }
+}
+
+// Every visited node reachable from `root`, in bfs order with children taken by index.
+vec<BaseNode *> get_visited_nodes(BaseNode *root)
+{
+    auto queue = vec<BaseNode *>{root};
+    auto seen = set<BaseNode *>{root};
+    for (size_t i = 0; i < queue.size(); ++i)
+        for (size_t j = 0; j < queue[i]->get_action_counts().size(); ++j)
+        {
+            auto child = queue[i]->get_child(j);
+            if ((child != nullptr) && (child->get_visit_count() > 0) && seen.insert(child).second)
+                queue.push_back(child);
+        }
+    return queue;
+}
+
+// Every node reachable from `root`, visited or not, without going through `skipped`.
+set<BaseNode *> get_reachable_nodes(BaseNode *root, const BaseNode *skipped = nullptr)
+{
+    auto queue = vec<BaseNode *>{root};
+    auto seen = set<BaseNode *>{root};
+    for (size_t i = 0; i < queue.size(); ++i)
+        for (size_t j = 0; j < queue[i]->get_num_actions(); ++j)
+        {
+            auto child = queue[i]->get_child(j);
+            if ((child != nullptr) && (child != skipped) && seen.insert(child).second)
+                queue.push_back(child);
+        }
+    return seen;
+}
+
+// Every complete action from a tree node whose mini nodes are materialized, with the tree node it leads to.
+void get_child_actions(BaseNode *node, size_t depth, ActionVec &action, vec<pair<ActionVec, BaseNode *>> &ret)
+{
+    for (size_t j = 0; j < node->get_num_actions(); ++j)
+    {
+        auto child = node->get_child(j);
+        if (child == nullptr)
+            continue;
+        action[depth] = node->get_action_at(j);
+        if (depth == 6)
+            ret.push_back({action, child});
+        else
+            get_child_actions(child, depth + 1, action, ret);
+    }
+}
+
+// Hash the stats of every visited node reachable from `root`. Float stats are hashed bitwise.
+size_t get_stats_digest(BaseNode *root)
+{
+    size_t digest = 0;
+    auto hash_float = [&digest](float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        boost::hash_combine(digest, bits);
+    };
+    for (const auto node : get_visited_nodes(root))
+    {
+        boost::hash_combine(digest, node->get_visit_count());
+        boost::hash_combine(digest, node->get_max_index());
+        const auto &counts = node->get_action_counts();
+        for (size_t j = 0; j < counts.size(); ++j)
+        {
+            boost::hash_combine(digest, counts[j]);
+            hash_float(node->get_total_values()[j]);
+            hash_float(node->get_max_values()[j]);
+        }
+    }
+    return digest;
+}
+
+// Search for up to `num_steps` moves from `root`, evaluating leaves with random priors and backing up random values, all
+// drawn from `rng` in simulation order. Return the played path.
+Path run_search(Env *env, Mcts &mcts, TreeNode *root, int num_steps, int num_sims, int batch_size, int num_abc, RandomStream &rng, map<const TreeNode *, vec<vec<float>>> *drawn = nullptr)
+{
+    auto played_path = Path(root, 0);
+    for (int step = 0; (step < num_steps) && !root->stopped && !root->is_done(); ++step)
+    {
+        evaluate_random(env, vec<TreeNode *>{root}, num_abc, rng, drawn);
+        for (int j = 0; j < num_sims / batch_size; ++j)
+        {
+            auto paths = mcts.select(root, batch_size, step, num_steps, played_path);
+            auto selected = vec<TreeNode *>();
+            auto values = vec<float>();
+            for (const auto &path : paths)
+            {
+                selected.push_back(path.get_last_node());
+                values.push_back(rng.randf(2.0) - 1.0);
+            }
+            evaluate_random(env, selected, num_abc, rng, drawn);
+            mcts.backup(paths, values);
+        }
+        played_path.merge(mcts.play(root, step, PlayStrategy::MAX, 1.0));
+        root = played_path.get_last_node();
+    }
+    return played_path;
+}
+
+// The same search (with noise) should end up with exactly the same stats on one thread and on several, every time.
+bool check_determinism(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_threads, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto digests = vec<size_t>();
+    for (const int threads : {1, num_threads, num_threads})
+    {
+        auto fresh = Env(env->opt, as_opt, ws_opt);
+        register_changes(&fresh, num_abc, as_opt.emp_id);
+        auto opt = mcts_opt;
+        opt.num_threads = threads;
+        opt.selection_opt.add_noise = true;
+        auto mcts = Mcts(&fresh, opt);
+        auto rng = RandomStream(opt.seed, 0);
+        run_search(&fresh, mcts, fresh.start, num_steps, num_sims, batch_size, num_abc, rng);
+        digests.push_back(get_stats_digest(fresh.start));
+    }
+    if ((digests[1] != digests[0]) || (digests[2] != digests[0]))
+    {
+        SPDLOG_ERROR("Search stats differ with {} threads: {} vs {} and {}.", num_threads, digests[0], digests[1], digests[2]);
+        return false;
+    }
+    SPDLOG_INFO("Determinism checked with {} threads (digest {}).", num_threads, digests[0]);
+    return true;
+}
+
+// Search twice on the same tree, resetting it in between either with a new epoch or eagerly with a bfs. The second
+// search should end up with the same stats and play the same path both ways. It is not compared with the first one,
+// since pruning is kept across resets.
+bool check_epoch_reset(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    auto digests = vec<size_t>();
+    auto played = vec<vec<size_t>>();
+    for (const bool use_epoch : {true, false})
+    {
+        auto fresh = Env(env->opt, as_opt, ws_opt);
+        register_changes(&fresh, num_abc, as_opt.emp_id);
+        for (int run = 0; run < 2; ++run)
+        {
+            if (run > 0)
+            {
+                if (use_epoch)
+                    fresh.new_epoch();
+                else
+                {
+                    fresh.clear_stats(fresh.start, true);
+                    fresh.clear_priors(fresh.start, true);
+                }
+            }
+            auto mcts = Mcts(&fresh, opt);
+            auto rng = RandomStream(opt.seed, 0);
+            const auto played_path = run_search(&fresh, mcts, fresh.start, num_steps, num_sims, batch_size, num_abc, rng);
+            if (run == 0)
+                continue;
+            digests.push_back(get_stats_digest(fresh.start));
+            auto record = vec<size_t>();
+            for (const auto node : played_path.get_all_nodes())
+                record.push_back(node->get_visit_count());
+            played.push_back(record);
+        }
+    }
+    if ((digests[0] != digests[1]) || (played[0] != played[1]))
+    {
+        SPDLOG_ERROR("Search after a new epoch differs from the search after a bfs reset: digest {} vs {}.", digests[0], digests[1]);
+        return false;
+    }
+    SPDLOG_INFO("Epoch reset checked against the bfs reset (digest {}).", digests[0]);
+    return true;
+}
+
+// After every move, evicting the siblings of the played action should keep the subtree of the new root (with its
+// stats) and the played path, and should only free nodes below the old root. Released nodes are disconnected from
+// the graph, so nodes that are still reachable are alive.
+bool check_evict_siblings(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto fresh = Env(env->opt, as_opt, ws_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    // Evicted by hand below, so that the graph can be inspected in between.
+    opt.retain_subtree = false;
+    auto mcts = Mcts(&fresh, opt);
+    auto rng = RandomStream(opt.seed, 0);
+
+    TreeNode *root = fresh.start;
+    auto played_path = Path(root, 0);
+    auto search = [&](TreeNode *node, int step) {
+        evaluate_random(&fresh, vec<TreeNode *>{node}, num_abc, rng);
+        for (int j = 0; j < num_sims / batch_size; ++j)
+        {
+            auto paths = mcts.select(node, batch_size, step, num_steps, played_path);
+            auto selected = vec<TreeNode *>();
+            auto values = vec<float>();
+            for (const auto &path : paths)
+            {
+                selected.push_back(path.get_last_node());
+                values.push_back(rng.randf(2.0) - 1.0);
+            }
+            evaluate_random(&fresh, selected, num_abc, rng);
+            mcts.backup(paths, values);
+        }
+    };
+
+    size_t total_evicted = 0;
+    size_t num_shared = 0;
+    search(root, 0);
+    for (int step = 0; (step < num_steps) && !root->stopped && !root->is_done(); ++step)
+    {
+        const auto new_path = mcts.play(root, step, PlayStrategy::MAX, 1.0);
+        played_path.merge(new_path);
+        auto new_root = played_path.get_last_node();
+        // The new root is searched before the eviction, so that the kept subtree has searched children.
+        if (!new_root->stopped && !new_root->is_done())
+            search(new_root, step + 1);
+
+        // Make the searched children of the new root reachable from the siblings as well, by applying their actions
+        // to the old root first and the played action after that. Actions that do not commute lead elsewhere.
+        const auto played = new_path.get_last_action_vec();
+        auto child_actions = vec<pair<ActionVec, BaseNode *>>();
+        auto action = ActionVec();
+        get_child_actions(new_root, 0, action, child_actions);
+        for (const auto &[a, child] : child_actions)
+        {
+            if (static_cast<TreeNode *>(child)->stopped)
+                continue;
+            try
+            {
+                auto subpath = Subpath();
+                auto sibling = fresh.apply_action(root, a[0], a[2], a[3], a[4], a[5], a[6], static_cast<SpecialType>(a[1]), subpath);
+                if ((sibling == new_root) || sibling->stopped)
+                    continue;
+                fresh.ensure_expanded(sibling);
+                subpath = Subpath();
+                fresh.apply_action(sibling, played[0], played[2], played[3], played[4], played[5], played[6], static_cast<SpecialType>(played[1]), subpath);
+            }
+            catch (const std::runtime_error &)
+            {
+            }
+        }
+
+        const auto kept = get_reachable_nodes(new_root);
+        // Nodes of the kept subtree that are also reachable from the siblings.
+        for (const auto node : get_reachable_nodes(root, new_root))
+            num_shared += kept.contains(node);
+        const auto digest = get_stats_digest(new_root);
+        const size_t num_below = get_reachable_nodes(root).size();
+        const size_t num_evicted = fresh.evict_siblings(root, new_root);
+        total_evicted += num_evicted;
+
+        if ((get_reachable_nodes(new_root) != kept) || (get_stats_digest(new_root) != digest))
+        {
+            SPDLOG_ERROR("Evicting siblings at step {} changed the kept subtree ({} nodes).", step, kept.size());
+            return false;
+        }
+        const auto all_nodes = get_reachable_nodes(fresh.start);
+        for (const auto node : played_path.get_all_nodes())
+            if (!all_nodes.contains(node))
+            {
+                SPDLOG_ERROR("Evicting siblings at step {} freed a node on the played path.", step);
+                return false;
+            }
+        if (get_reachable_nodes(root).size() + num_evicted > num_below)
+        {
+            SPDLOG_ERROR("Evicting siblings at step {} freed {} nodes, but only {} were below the old root.", step, num_evicted, num_below);
+            return false;
+        }
+        root = new_root;
+    }
+    if ((total_evicted == 0) || (num_shared == 0))
+    {
+        SPDLOG_ERROR("Sibling eviction is not exercised: {} nodes evicted, {} shared nodes.", total_evicted, num_shared);
+        return false;
+    }
+    SPDLOG_INFO("Sibling eviction checked ({} nodes evicted, {} shared nodes kept).", total_evicted, num_shared);
+    return true;
+}
+// Tree nodes only keep the columns of the priors that their actions might use. The priors of every evaluated node
+// (tree or mini) should still be the same as if they were gathered from the full rows.
+bool check_kept_priors(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto fresh = Env(env->opt, as_opt, ws_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    auto mcts = Mcts(&fresh, opt);
+    auto rng = RandomStream(opt.seed, 0);
+    auto drawn = map<const TreeNode *, vec<vec<float>>>();
+    run_search(&fresh, mcts, fresh.start, num_steps, num_sims, batch_size, num_abc, rng, &drawn);
+
+    size_t num_checked = 0;
+    for (const auto node : get_visited_nodes(fresh.start))
+    {
+        if (!node->is_evaluated())
+            continue;
+        const TreeNode *base;
+        // Row of the meta priors (or the special priors) the actions are gathered from.
+        size_t row;
+        if (node->is_tree_node())
+        {
+            base = static_cast<const TreeNode *>(node);
+            row = 0;
+        }
+        else
+        {
+            const auto mini = static_cast<const MiniNode *>(node);
+            base = mini->base;
+            // See `TreeNode::evaluate_actions`: special types are chosen after BEFORE, and after ids after SPECIAL_TYPE.
+            if (mini->ap == ActionPhase::BEFORE)
+                row = 6;
+            else if (mini->ap == ActionPhase::SPECIAL_TYPE)
+                row = 1;
+            else
+                row = static_cast<size_t>(mini->ap) + 1;
+        }
+        if (!drawn.contains(base))
+            continue;
+        const auto &values = drawn.at(base)[row];
+        auto expected = vec<float>();
+        float sum = 1e-8;
+        for (const auto action : node->get_actions())
+        {
+            expected.push_back(values[action]);
+            sum += values[action];
+        }
+        for (auto &prior : expected)
+            prior /= sum;
+        if (node->get_priors() != expected)
+        {
+            SPDLOG_ERROR("Priors of a {} node (row {}) differ from the ones gathered from the full row.", node->is_tree_node() ? "tree" : "mini", row);
+            return false;
+        }
+        ++num_checked;
+    }
+    SPDLOG_INFO("Kept priors checked on {} nodes.", num_checked);
+    return true;
+}
+
+
+// Root-parallel search with one worker should end up with exactly the same stats as the search with shared stats. When
+// several overlays are merged, the shared stats should move by the sum of the differences of every overlay.
+bool check_root_parallel(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_workers, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto digests = vec<size_t>();
+    auto fresh = vec<std::unique_ptr<Env>>();
+    for (const bool root_parallel : {false, true})
+    {
+        fresh.push_back(std::make_unique<Env>(env->opt, as_opt, ws_opt));
+        register_changes(fresh.back().get(), num_abc, as_opt.emp_id);
+        auto opt = mcts_opt;
+        opt.num_threads = 1;
+        opt.root_parallel = root_parallel;
+        auto mcts = Mcts(fresh.back().get(), opt);
+        auto rng = RandomStream(opt.seed, 0);
+        run_search(fresh.back().get(), mcts, fresh.back()->start, num_steps, num_sims, batch_size, num_abc, rng);
+        digests.push_back(get_stats_digest(fresh.back()->start));
+    }
+    if (digests[0] != digests[1])
+    {
+        SPDLOG_ERROR("Root-parallel search with one worker differs from the shared search: digest {} vs {}.", digests[1], digests[0]);
+        return false;
+    }
+
+    // Every worker runs simulations at random visited nodes of the searched tree, each with a virtual loss first.
+    const auto nodes = get_visited_nodes(fresh.back()->start);
+    auto before = map<BaseNode *, StatsOverlay::Stats>();
+    for (const auto node : nodes)
+        before[node] = StatsOverlay::Stats{node->get_action_counts(), node->get_total_values(), node->get_max_values(), node->get_visit_count(), node->get_max_index(), 0.0};
+    auto overlays = vec<StatsOverlay>(num_workers);
+    auto rng = RandomStream(mcts_opt.seed, 1);
+    for (auto &overlay : overlays)
+        for (int i = 0; i < num_sims; ++i)
+        {
+            auto node = nodes[static_cast<size_t>(rng.randf(nodes.size() - 1e-3))];
+            const size_t index = static_cast<size_t>(rng.randf(node->get_action_counts().size() - 1e-3));
+            overlay.virtual_select(node, index, mcts_opt.game_count, mcts_opt.virtual_loss);
+            overlay.update_stats(node, index, rng.randf(2.0) - 1.0, mcts_opt.game_count, mcts_opt.virtual_loss);
+        }
+    auto expected = before;
+    for (auto &overlay : overlays)
+        for (const auto node : nodes)
+        {
+            const auto &stats = overlay.get(node);
+            auto &target = expected[node];
+            const auto &base = before[node];
+            for (size_t j = 0; j < stats.action_counts.size(); ++j)
+            {
+                target.action_counts[j] += stats.action_counts[j] - base.action_counts[j];
+                target.total_values[j] += stats.total_values[j] - base.total_values[j];
+                target.max_values[j] = std::max(target.max_values[j], stats.max_values[j]);
+            }
+            target.visit_count += stats.visit_count - base.visit_count;
+        }
+    StatsOverlay::merge(overlays);
+    for (const auto node : nodes)
+    {
+        const auto &target = expected[node];
+        bool ok = (node->get_action_counts() == target.action_counts) && (node->get_max_values() == target.max_values) && (node->get_visit_count() == target.visit_count);
+        for (size_t j = 0; ok && (j < target.total_values.size()); ++j)
+            ok = std::abs(node->get_total_values()[j] - target.total_values[j]) < 1e-3;
+        if (!ok)
+        {
+            SPDLOG_ERROR("Merged stats differ from the sum of the overlay differences.");
+            return false;
+        }
+    }
+    SPDLOG_INFO("Root-parallel search checked (digest {}), and {} overlays merged on {} nodes.", digests[0], num_workers, nodes.size());
+    return true;
+}
+
+// Search with batches submitted ahead through `submit`/`complete`, and without the pipeline: either selecting the same
+// number of batches ahead before backing up the oldest one (which is what the pipeline does), or selecting and backing
+// up one batch at a time. Batches should come out of `pending` in the order they were submitted, with the same paths and stats as the
+// synchronous search that overlaps batches the same way, and every search should add the same number of visits.
+bool check_pipeline(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    enum class Mode
+    {
+        PIPELINED,
+        OVERLAPPED,
+        SEQUENTIAL
+    };
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    const int num_batches = std::max(num_sims / batch_size, 3);
+    // Two batches wait in `pending` while a third one is in flight.
+    const int num_ahead = 2;
+    auto digests = vec<size_t>();
+    auto batches = vec<vec<vec<size_t>>>();
+    auto visit_counts = vec<vec<visit_t>>();
+    for (const auto mode : {Mode::PIPELINED, Mode::OVERLAPPED, Mode::SEQUENTIAL})
+    {
+        auto fresh = Env(env->opt, as_opt, ws_opt);
+        register_changes(&fresh, num_abc, as_opt.emp_id);
+        auto mcts = Mcts(&fresh, opt);
+        auto rng = RandomStream(opt.seed, 0);
+        batches.push_back(vec<vec<size_t>>());
+        visit_counts.push_back(vec<visit_t>());
+        // Evaluate every last node with random priors, and back up random values.
+        auto finish = [&](const vec<Path> &paths) {
+            auto nodes = vec<TreeNode *>();
+            auto values = vec<float>();
+            for (const auto &path : paths)
+            {
+                nodes.push_back(path.get_last_node());
+                values.push_back(rng.randf(2.0) - 1.0);
+                batches.back().push_back(path.get_all_chosen_indices());
+            }
+            auto meta_priors = vec<float>(nodes.size() * 6 * num_abc);
+            auto special_priors = vec<float>(nodes.size() * 6);
+            for (auto &x : meta_priors)
+                x = rng.randf(1.0);
+            for (auto &x : special_priors)
+                x = rng.randf(1.0);
+            if (mode == Mode::PIPELINED)
+                mcts.complete(nodes, meta_priors.data(), special_priors.data(), num_abc, values);
+            else
+            {
+                mcts.evaluate(nodes, meta_priors.data(), special_priors.data(), num_abc);
+                mcts.backup(paths, values);
+            }
+        };
+
+        auto root = fresh.start;
+        auto played_path = Path(root, 0);
+        for (int step = 0; (step < num_steps) && !root->stopped && !root->is_done(); ++step)
+        {
+            evaluate_random(&fresh, vec<TreeNode *>{root}, num_abc, rng);
+            const visit_t old_count = root->get_visit_count();
+            if (mode == Mode::PIPELINED)
+            {
+                for (int j = 0; j < std::min(num_ahead, num_batches); ++j)
+                    mcts.submit(root, batch_size, step, num_steps, played_path);
+                for (int j = 0; j < num_batches; ++j)
+                {
+                    if (j + num_ahead < num_batches)
+                        mcts.submit(root, batch_size, step, num_steps, played_path);
+                    const size_t num_pending = std::min(num_batches - j, num_ahead + 1);
+                    if (mcts.get_num_pending() != num_pending)
+                    {
+                        SPDLOG_ERROR("Pipeline has {} batches pending instead of {}.", mcts.get_num_pending(), num_pending);
+                        return false;
+                    }
+                    const auto paths = mcts.retrieve();
+                    finish(paths);
+                }
+            }
+            else if (mode == Mode::OVERLAPPED)
+            {
+                auto queue = std::deque<vec<Path>>();
+                for (int j = 0; j < std::min(num_ahead, num_batches); ++j)
+                    queue.push_back(mcts.select(root, batch_size, step, num_steps, played_path));
+                for (int j = 0; j < num_batches; ++j)
+                {
+                    if (j + num_ahead < num_batches)
+                        queue.push_back(mcts.select(root, batch_size, step, num_steps, played_path));
+                    finish(queue.front());
+                    queue.pop_front();
+                }
+            }
+            else
+                for (int j = 0; j < num_batches; ++j)
+                    finish(mcts.select(root, batch_size, step, num_steps, played_path));
+            visit_counts.back().push_back(root->get_visit_count() - old_count);
+            played_path.merge(mcts.play(root, step, PlayStrategy::MAX, 1.0));
+            root = played_path.get_last_node();
+        }
+        digests.push_back(get_stats_digest(fresh.start));
+    }
+    if ((digests[0] != digests[1]) || (batches[0] != batches[1]))
+    {
+        SPDLOG_ERROR("Pipelined search differs from the overlapped synchronous search: digest {} vs {}.", digests[0], digests[1]);
+        return false;
+    }
+    // Played paths differ from the sequential search, so only the visits added at the root in every step are compared.
+    for (size_t i = 0; i < std::min(visit_counts[0].size(), visit_counts[2].size()); ++i)
+        if (visit_counts[0][i] != visit_counts[2][i])
+        {
+            SPDLOG_ERROR("Pipelined search adds {} visits at step {} instead of {}.", visit_counts[0][i], i, visit_counts[2][i]);
+            return false;
+        }
+    SPDLOG_INFO("Pipeline checked on {} batches (digest {}).", batches[0].size() / batch_size, digests[0]);
+    return true;
+}
+
+// The controller should stop once the most visited root action has stayed the same for K batches in a row (tracked
+// here on the side), once the deadline has passed, and never before the minimum number of simulations. The reported
+// number of simulations should add up the batches.
+bool check_search_controller(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int batch_size, int num_abc)
+{
+    auto fresh = Env(env->opt, as_opt, ws_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    auto mcts = Mcts(&fresh, opt);
+    auto rng = RandomStream(opt.seed, 0);
+    auto root = fresh.start;
+    evaluate_random(&fresh, vec<TreeNode *>{root}, num_abc, rng);
+    auto run_batch = [&]() {
+        auto paths = mcts.select(root, batch_size, 0, 10);
+        auto selected = vec<TreeNode *>();
+        auto values = vec<float>();
+        for (const auto &path : paths)
+        {
+            selected.push_back(path.get_last_node());
+            values.push_back(rng.randf(2.0) - 1.0);
+        }
+        evaluate_random(&fresh, selected, num_abc, rng);
+        mcts.backup(paths, values);
+    };
+
+    const int num_stable_batches = 3;
+    auto stable_opt = SearchControlOpt();
+    stable_opt.num_stable_batches = num_stable_batches;
+    auto stable = SearchController(root, stable_opt);
+    int best_index = -1;
+    int num_stable = 0;
+    bool stopped = false;
+    for (int b = 0; !stopped && (b < 1000); ++b)
+    {
+        run_batch();
+        const auto &counts = root->get_action_counts();
+        const int new_best_index = std::distance(counts.begin(), std::max_element(counts.begin(), counts.end()));
+        num_stable = (new_best_index == best_index) ? num_stable + 1 : 0;
+        best_index = new_best_index;
+        stopped = stable.update(batch_size);
+        if ((stopped != (num_stable >= num_stable_batches)) || (stable.get_num_sims() != (b + 1) * batch_size))
+        {
+            SPDLOG_ERROR("Controller stopped: {} after batch {} with {} sims, expected {}.", stopped, b, stable.get_num_sims(), num_stable >= num_stable_batches);
+            return false;
+        }
+    }
+    if (!stopped)
+    {
+        SPDLOG_ERROR("Controller never stopped on a stable best action.");
+        return false;
+    }
+
+    // No criterion is met within an hour.
+    auto late_opt = SearchControlOpt();
+    late_opt.time_budget = 3600.0;
+    auto late = SearchController(root, late_opt);
+    for (int b = 0; b < 5; ++b)
+    {
+        run_batch();
+        if (late.update(batch_size))
+        {
+            SPDLOG_ERROR("Controller stopped before its deadline.");
+            return false;
+        }
+    }
+    // The deadline has passed before the first batch, but the first batch is short of the minimum.
+    auto early_opt = SearchControlOpt();
+    early_opt.time_budget = 0.01;
+    early_opt.min_sims = 2 * batch_size;
+    auto early = SearchController(root, early_opt);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    run_batch();
+    const bool first = early.update(batch_size);
+    run_batch();
+    const bool second = early.update(batch_size);
+    if (first || !second || (early.get_num_sims() != 2 * batch_size) || (early.get_elapsed() < early_opt.time_budget))
+    {
+        SPDLOG_ERROR("Controller with a passed deadline stopped: {} then {}, with {} sims.", first, second, early.get_num_sims());
+        return false;
+    }
+    SPDLOG_INFO("Search controller checked (stable after {} sims).", stable.get_num_sims());
+    return true;
+}
+
+// The evaluation cache should evict the least recently used entry at capacity, tell steps apart only if asked to,
+// round priors to bfloat16 (within half a unit in the last place, i.e., a relative error of 2^-8) while keeping values
+// exact, and count hits and misses until it is cleared.
+bool check_eval_cache(Env *env, abc_t null_id, int num_abc)
+{
+    auto nodes = vec<TreeNode *>{env->start};
+    for (int i = 0; i < 2; ++i)
+    {
+        const abc_t before = env->start->get_id_seq(i)[1];
+        nodes.push_back(env->apply_action(env->start, before, before - 1, null_id, null_id, null_id, null_id, SpecialType::NONE));
+    }
+    auto rng = RandomStream(0, 0);
+    auto meta_priors = vec<vec<float>>();
+    auto special_priors = vec<vec<float>>();
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        meta_priors.push_back(vec<float>(6 * num_abc));
+        special_priors.push_back(vec<float>(6));
+        for (auto &x : meta_priors.back())
+            x = rng.randf(1.0);
+        for (auto &x : special_priors.back())
+            x = rng.randf(1.0);
+    }
+    auto meta_buf = vec<float>(6 * num_abc);
+    auto special_buf = vec<float>(6);
+    float value;
+    auto lookup = [&](EvaluationCache &cache, size_t i, int step) {
+        return cache.lookup(nodes[i], step, meta_buf.data(), special_buf.data(), value);
+    };
+
+    auto cache = EvaluationCache(2, num_abc, false);
+    cache.insert(nodes[0], 0, meta_priors[0].data(), special_priors[0].data(), 0.25);
+    cache.insert(nodes[1], 0, meta_priors[1].data(), special_priors[1].data(), 0.5);
+    // Node 0 is used again, so node 1 is evicted by node 2. Steps are ignored.
+    bool ok = lookup(cache, 0, 3) && (value == 0.25);
+    float max_error = 0.0;
+    for (size_t j = 0; ok && (j < meta_buf.size()); ++j)
+    {
+        max_error = std::max(max_error, std::abs(meta_buf[j] - meta_priors[0][j]));
+        ok = std::abs(meta_buf[j] - meta_priors[0][j]) <= std::ldexp(std::abs(meta_priors[0][j]), -8);
+    }
+    for (size_t j = 0; ok && (j < special_buf.size()); ++j)
+        ok = std::abs(special_buf[j] - special_priors[0][j]) <= std::ldexp(std::abs(special_priors[0][j]), -8);
+    cache.insert(nodes[2], 0, meta_priors[2].data(), special_priors[2].data(), 0.75);
+    ok = ok && !lookup(cache, 1, 0) && lookup(cache, 0, 0) && lookup(cache, 2, 0) && (value == 0.75);
+    ok = ok && (cache.size() == 2) && (cache.get_num_hits() == 3) && (cache.get_num_misses() == 1);
+    cache.clear();
+    ok = ok && (cache.size() == 0) && (cache.get_num_hits() == 0) && (cache.get_num_misses() == 0) && !lookup(cache, 0, 0);
+    if (!ok)
+    {
+        SPDLOG_ERROR("Evaluation cache failed on eviction, rounding or counters.");
+        return false;
+    }
+
+    auto step_cache = EvaluationCache(2, num_abc, true);
+    step_cache.insert(nodes[0], 3, meta_priors[0].data(), special_priors[0].data(), 0.25);
+    if (!lookup(step_cache, 0, 3) || lookup(step_cache, 0, 4))
+    {
+        SPDLOG_ERROR("Evaluation cache does not tell steps apart.");
+        return false;
+    }
+    SPDLOG_INFO("Evaluation cache checked (max prior error {}).", max_error);
+    return true;
+}
+
+// A deterministic stand-in for the agent: priors and values only depend on the ids of the state and the step.
+struct FakeAgent
+{
+    size_t num_abc;
+    abc_t pad_id;
+    // The callback fails on this call (counting from zero). Never if negative.
+    int fail_at = -1;
+    int num_calls = 0;
+
+    static void fill(size_t seed, size_t num_abc, float *meta_priors, float *special_priors, float &value)
+    {
+        auto rng = RandomStream(seed, 0);
+        for (size_t j = 0; j < 6 * num_abc; ++j)
+            meta_priors[j] = rng.randf(1.0);
+        for (size_t j = 0; j < 6; ++j)
+            special_priors[j] = rng.randf(1.0);
+        value = rng.randf(2.0) - 1.0;
+    }
+
+    static size_t get_seed(const TreeNode *node, int step)
+    {
+        size_t seed = std::hash<int>()(step);
+        for (size_t order = 0; order < node->size(); ++order)
+        {
+            boost::hash_combine(seed, order);
+            for (const auto id : node->get_id_seq(order))
+                boost::hash_combine(seed, id);
+        }
+        return seed;
+    }
+
+    // Hash the packed ids the same way as `get_seed`, skipping the padding.
+    static void evaluate(void *context, EvaluationBatch &batch)
+    {
+        auto agent = static_cast<FakeAgent *>(context);
+        if (agent->num_calls++ == agent->fail_at)
+        {
+            batch.failed = true;
+            return;
+        }
+        const size_t m = batch.max_length;
+        for (size_t i = 0; i < batch.size; ++i)
+        {
+            size_t seed = std::hash<int>()(static_cast<int>(batch.steps[i]));
+            for (size_t order = 0; order < batch.num_words; ++order)
+            {
+                boost::hash_combine(seed, order);
+                for (size_t pos = 0; pos < m; ++pos)
+                {
+                    const auto id = static_cast<abc_t>(batch.ids[(i * batch.num_words + order) * m + pos]);
+                    if (id != agent->pad_id)
+                        boost::hash_combine(seed, id);
+                }
+            }
+            fill(seed, agent->num_abc, batch.meta_priors.data() + i * 6 * agent->num_abc, batch.special_priors.data() + i * 6, batch.values[i]);
+        }
+    }
+};
+
+// The native episode runner should play exactly like a loop that selects, evaluates every new state with the agent,
+// backs up and plays on its own (as the Python side does without the runner). A failing callback should surface as an
+// exception.
+bool check_episode_runner(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto ep_opt = EpisodeOpt();
+    ep_opt.num_sims = num_sims;
+    ep_opt.batch_size = batch_size;
+    ep_opt.max_rollout_length = num_steps;
+    ep_opt.play_strategy = PlayStrategy::MAX;
+    ep_opt.exponent = 1.0;
+    ep_opt.add_noise = false;
+    ep_opt.num_abc = num_abc;
+    // Never a real id.
+    ep_opt.pad_id = num_abc;
+    ep_opt.use_alignment = false;
+    ep_opt.max_end_length = 0;
+    ep_opt.seed = mcts_opt.seed;
+
+    auto native_env = Env(env->opt, as_opt, ws_opt);
+    register_changes(&native_env, num_abc, as_opt.emp_id);
+    auto native_mcts = Mcts(&native_env, mcts_opt);
+    auto runner = EpisodeRunner(&native_env, &native_mcts, ep_opt);
+    auto agent = FakeAgent{static_cast<size_t>(num_abc), ep_opt.pad_id};
+    runner.register_callback(FakeAgent::evaluate, &agent);
+    const auto native_path = runner.run(native_env.start);
+
+    auto manual_env = Env(env->opt, as_opt, ws_opt);
+    register_changes(&manual_env, num_abc, as_opt.emp_id);
+    auto manual_mcts = Mcts(&manual_env, mcts_opt);
+    // Evaluate the leaves among `nodes` and return the values of all of them.
+    auto evaluate = [&manual_mcts, num_abc](const vec<TreeNode *> &nodes, const vec<int> &steps) {
+        const size_t n = nodes.size();
+        auto meta_priors = vec<float>(n * 6 * num_abc);
+        auto special_priors = vec<float>(n * 6);
+        auto values = vec<float>(n);
+        for (size_t i = 0; i < n; ++i)
+            FakeAgent::fill(FakeAgent::get_seed(nodes[i], steps[i]), num_abc, meta_priors.data() + i * 6 * num_abc, special_priors.data() + i * 6, values[i]);
+        manual_mcts.evaluate(nodes, meta_priors.data(), special_priors.data(), num_abc);
+        return values;
+    };
+    auto root = manual_env.start;
+    evaluate(vec<TreeNode *>{root}, vec<int>{0});
+    auto manual_path = Path(root, 0);
+    for (int step = 0; step < num_steps; ++step)
+    {
+        for (int j = 0; j < num_sims / batch_size; ++j)
+        {
+            auto paths = manual_mcts.select(root, batch_size, step, num_steps, manual_path);
+            auto nodes = vec<TreeNode *>();
+            auto steps = vec<int>();
+            auto rows = vec<int>();
+            for (const auto &path : paths)
+            {
+                auto node = path.get_last_node();
+                // End states are accounted for by the rewards.
+                if (node->stopped || node->is_done())
+                    rows.push_back(-1);
+                else
+                {
+                    rows.push_back(nodes.size());
+                    nodes.push_back(node);
+                    steps.push_back(path.get_depth());
+                }
+            }
+            const auto node_values = evaluate(nodes, steps);
+            auto values = vec<float>();
+            for (const int row : rows)
+                values.push_back((row == -1) ? 0.0 : node_values[row]);
+            manual_mcts.backup(paths, values);
+        }
+        manual_path.merge(manual_mcts.play(root, step, PlayStrategy::MAX, 1.0));
+        root = manual_path.get_last_node();
+        if (root->stopped || root->is_done())
+            break;
+    }
+    if ((native_path.get_all_chosen_indices() != manual_path.get_all_chosen_indices()) || (get_stats_digest(native_env.start) != get_stats_digest(manual_env.start)))
+    {
+        SPDLOG_ERROR("Episode runner plays differently from the manual loop.");
+        return false;
+    }
+
+    // The second batch fails.
+    auto failing_env = Env(env->opt, as_opt, ws_opt);
+    register_changes(&failing_env, num_abc, as_opt.emp_id);
+    auto failing_mcts = Mcts(&failing_env, mcts_opt);
+    auto failing_runner = EpisodeRunner(&failing_env, &failing_mcts, ep_opt);
+    auto failing_agent = FakeAgent{static_cast<size_t>(num_abc), ep_opt.pad_id, 1};
+    failing_runner.register_callback(FakeAgent::evaluate, &failing_agent);
+    try
+    {
+        failing_runner.run(failing_env.start);
+        SPDLOG_ERROR("Episode runner ignored a failed callback.");
+        return false;
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+    if (failing_agent.num_calls != 2)
+    {
+        SPDLOG_ERROR("Episode runner called back {} times after a failure.", failing_agent.num_calls);
+        return false;
+    }
+    SPDLOG_INFO("Episode runner checked on {} moves.", native_path.get_depth());
+    return true;
+}
+
+// Stack ids and alignments as `c_parallel_stack_ids` does on the Python side: fill with padding, then copy every id
+// sequence and alignment (through `get_alignments`) from the start of its row.
+vec<vec<long>> stack_ids(const vec<TreeNode *> &nodes, abc_t pad_id, size_t max_length, size_t max_end_length)
+{
+    const size_t n = nodes.size();
+    const size_t nw = nodes[0]->size();
+    auto ids = vec<long>(n * nw * max_length, pad_id);
+    auto almts1 = vec<long>(n * nw * max_length, -1);
+    auto almts2 = vec<long>(n * nw * max_end_length, -1);
+    for (size_t i = 0; i < n; ++i)
+    {
+        const auto almts = nodes[i]->get_alignments();
+        for (size_t j = 0; j < nw; ++j)
+        {
+            const auto &id_seq = nodes[i]->get_id_seq(j);
+            for (size_t k = 0; k < id_seq.size(); ++k)
+            {
+                ids[(i * nw + j) * max_length + k] = id_seq[k];
+                almts1[(i * nw + j) * max_length + k] = almts.first[j][k];
+            }
+            for (size_t k = 0; k < almts.second[j].size(); ++k)
+                almts2[(i * nw + j) * max_end_length + k] = almts.second[j][k];
+        }
+    }
+    return {ids, almts1, almts2};
+}
+
+// Pack with the batcher into buffers of type `T` (filled with garbage first, since padding should be written as well),
+// and compare with the reference stacking.
+template <typename T>
+bool same_packing(const StateBatcher &batcher, const vec<TreeNode *> &nodes, size_t max_length, bool use_alignment, const vec<vec<long>> &expected)
+{
+    auto ids = vec<T>(expected[0].size(), 7);
+    auto almts1 = vec<T>(expected[1].size(), 7);
+    auto almts2 = vec<T>(expected[2].size(), 7);
+    if (use_alignment)
+        batcher.pack(nodes, max_length, ids.data(), almts1.data(), almts2.data());
+    else
+        batcher.pack<T>(nodes, max_length, ids.data(), nullptr, nullptr);
+    auto same = [](const vec<T> &packed, const vec<long> &reference) {
+        return std::equal(packed.begin(), packed.end(), reference.begin(), reference.end(), [](T x, long y) { return static_cast<long>(x) == y; });
+    };
+    return same(ids, expected[0]) && (!use_alignment || (same(almts1, expected[1]) && same(almts2, expected[2])));
+}
+
+// The batcher should pack states exactly like the reference stacking, for both dtypes sent to the agent, with and
+// without alignments, serially and on a pool (owned or borrowed from a search).
+bool check_state_batcher(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_threads, int num_sims, int batch_size, int num_abc)
+{
+    auto aligned_opt = ws_opt;
+    aligned_opt.use_alignment = true;
+    auto fresh = Env(env->opt, as_opt, aligned_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto opt = mcts_opt;
+    opt.num_threads = num_threads;
+    auto mcts = Mcts(&fresh, opt);
+    auto rng = RandomStream(opt.seed, 0);
+    run_search(&fresh, mcts, fresh.start, 1, num_sims, batch_size, num_abc, rng);
+    // Every tree node reached by the search, leaves included.
+    auto nodes = vec<TreeNode *>{fresh.start};
+    auto seen = set<BaseNode *>{fresh.start};
+    for (const auto node : get_visited_nodes(fresh.start))
+        for (size_t j = 0; j < node->get_action_counts().size(); ++j)
+        {
+            auto child = node->get_child(j);
+            if ((child != nullptr) && child->is_tree_node() && seen.insert(child).second)
+                nodes.push_back(static_cast<TreeNode *>(child));
+        }
+
+    const abc_t pad_id = as_opt.null_id;
+    // End words might all be of the same length, so some padding is added.
+    const size_t max_end_length = fresh.get_max_end_length() + 2;
+    auto pool = Pool(num_threads);
+    auto batchers = vec<std::unique_ptr<StateBatcher>>();
+    batchers.push_back(std::make_unique<StateBatcher>(1, pad_id, max_end_length));
+    batchers.push_back(std::make_unique<StateBatcher>(num_threads, pad_id, max_end_length));
+    batchers.push_back(std::make_unique<StateBatcher>(&pool, pad_id, max_end_length));
+    for (const auto &batcher : batchers)
+    {
+        // Rows might be longer than needed.
+        const size_t max_length = batcher->get_max_length(nodes);
+        for (const size_t length : {max_length, max_length + 3})
+        {
+            const auto expected = stack_ids(nodes, pad_id, length, max_end_length);
+            for (const bool use_alignment : {false, true})
+                if (!same_packing<int16_t>(*batcher, nodes, length, use_alignment, expected) || !same_packing<int32_t>(*batcher, nodes, length, use_alignment, expected))
+                {
+                    SPDLOG_ERROR("Packed states differ from the reference (alignment {}, length {} for {}).", use_alignment, length, max_length);
+                    return false;
+                }
+        }
+    }
+    SPDLOG_INFO("State batcher checked on {} nodes.", nodes.size());
+    return true;
+}
+
+// Reference selection: score every action, and take the first maximum.
+size_t select_by_scores(const BaseNode *node, const SelectionOpt &sel_opt)
+{
+    const auto scores = node->get_scores(sel_opt);
+    return std::distance(scores.begin(), std::max_element(scores.begin(), scores.end()));
+}
+
+// Every specialization of the selection kernel should pick the same action as the reference scorer with the same random
+// stream. Nodes come from a search with random priors and values, stopped right after a selection so that virtual
+// losses are still in place. Actions with fewer than two sites are pruned, and alignments are used so that the heuristics
+// are not all zero.
+bool check_selection(Env *env, const ActionSpaceOpt &as_opt, const WordSpaceOpt &ws_opt, const MctsOpt &mcts_opt, int num_steps, int num_sims, int batch_size, int num_abc)
+{
+    auto pruning_opt = as_opt;
+    pruning_opt.site_threshold = 2;
+    auto aligned_opt = ws_opt;
+    aligned_opt.use_alignment = true;
+    auto fresh = Env(env->opt, pruning_opt, aligned_opt);
+    register_changes(&fresh, num_abc, as_opt.emp_id);
+    auto opt = mcts_opt;
+    opt.num_threads = 1;
+    auto mcts = Mcts(&fresh, opt);
+    auto rng = RandomStream(opt.seed, 0);
+    const auto played_path = run_search(&fresh, mcts, fresh.start, num_steps, num_sims, batch_size, num_abc, rng);
+    auto root = played_path.get_last_node();
+    if (!root->stopped && !root->is_done())
+        mcts.select(root, batch_size, played_path.get_depth(), played_path.get_depth() + num_steps, played_path);
+
+    size_t num_nodes = 0;
+    size_t num_pruned = 0;
+    for (const auto node : get_visited_nodes(fresh.start))
+    {
+        if (!node->is_evaluated() || (node->stopped && node->is_tree_node()))
+            continue;
+        for (int key = 0; key < 16; ++key)
+        {
+            auto sel_opt = opt.selection_opt;
+            sel_opt.use_max_value = key & 8;
+            sel_opt.heur_c = (key & 4) ? 0.5 : 0.0;
+            sel_opt.use_num_misaligned = key & 2;
+            sel_opt.add_noise = key & 1;
+            auto rng1 = RandomStream(opt.seed, num_nodes);
+            auto rng2 = RandomStream(opt.seed, num_nodes);
+            sel_opt.rng = &rng1;
+            const size_t expected = select_by_scores(node, sel_opt);
+            sel_opt.rng = &rng2;
+            if (static_cast<size_t>(node->get_best_action(sel_opt).first) != expected)
+            {
+                SPDLOG_ERROR("Selection kernel {} differs from the reference scorer.", key);
+                return false;
+            }
+        }
+        ++num_nodes;
+        const auto &pruned = node->get_pruned();
+        num_pruned += (std::find(pruned.begin(), pruned.end(), true) != pruned.end());
+    }
+    if (num_pruned == 0)
+    {
+        SPDLOG_ERROR("No node with pruned actions to check the selection kernels on.");
+        return false;
+    }
+    SPDLOG_INFO("Selection kernels checked on {} nodes ({} with pruned actions).", num_nodes, num_pruned);
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     cxxopts::Options parser("test", "test program");
@@ -87,6 +1764,7 @@ int main(int argc, char *argv[])
     add_flag(parser, "quiet", "Set log level to error to disable info logging.");
     add_flag(parser, "syncope", "Use one syncopation.");
     add_flag(parser, "use_alignment", "Use alignment.");
+    add_flag(parser, "check", "Check the optimized code paths against the reference ones and exit.");
     auto args = parser.parse(argc, argv);
     const int num_threads = args["num_threads"].as<int>();
     const int num_words = args["num_words"].as<int>();
@@ -100,6 +1778,7 @@ int main(int argc, char *argv[])
     const bool quiet = args["quiet"].as<bool>();
     const bool syncope = args["syncope"].as<bool>();
     const bool use_alignment = args["use_alignment"].as<bool>();
+    const bool check = args["check"].as<bool>();
     const int num_sims = args["num_sims"].as<int>();
     const int batch_size = args["batch_size"].as<int>();
     const int num_episodes = args["num_episodes"].as<int>();
@@ -147,13 +1826,19 @@ int main(int argc, char *argv[])
     as_opt.any_id = 4;
     as_opt.any_s_id = 5;
     as_opt.any_uns_id = 6;
+    as_opt.glide_j = num_abc - 5;
+    as_opt.glide_w = num_abc - 4;
     as_opt.site_threshold = 1;
-    as_opt.dist_threshold = dist_threshold;
+    // Pruning is shared by all episodes (and kept across epochs), so nothing is pruned by distance in the checks. Circles
+    // are pruned as well, so the lockstep check needs an alphabet where they are rare, like the default one.
+    as_opt.dist_threshold = check ? -std::numeric_limits<float>::infinity() : dist_threshold;
+    as_opt.num_abc = num_abc;
     auto ws_opt = WordSpaceOpt();
     ws_opt.dist_mat = dist_mat;
     ws_opt.ins_cost = ins_cost;
     ws_opt.use_alignment = use_alignment;
     ws_opt.is_vowel = vec<bool>(num_abc);
+    ws_opt.is_consonant = vec<bool>(num_abc);
     ws_opt.unit_stress = vec<Stress>(num_abc);
     ws_opt.unit2base = vec<abc_t>(num_abc);
     ws_opt.unit2stressed = vec<abc_t>(num_abc);
@@ -161,6 +1846,7 @@ int main(int argc, char *argv[])
     for (abc_t i = 0; i < num_abc; ++i)
     {
         ws_opt.is_vowel[i] = false;
+        ws_opt.is_consonant[i] = true;
         ws_opt.unit_stress[i] = Stress::NOSTRESS;
         ws_opt.unit2base[i] = i;
         ws_opt.unit2stressed[i] = i;
@@ -171,6 +1857,9 @@ int main(int argc, char *argv[])
         ws_opt.is_vowel[num_abc - 3] = true;
         ws_opt.is_vowel[num_abc - 2] = true;
         ws_opt.is_vowel[num_abc - 1] = true;
+        ws_opt.is_consonant[num_abc - 3] = false;
+        ws_opt.is_consonant[num_abc - 2] = false;
+        ws_opt.is_consonant[num_abc - 1] = false;
         ws_opt.unit_stress[num_abc - 2] = Stress::STRESSED;
         ws_opt.unit_stress[num_abc - 1] = Stress::UNSTRESSED;
         ws_opt.unit2base[num_abc - 2] = num_abc - 3;
@@ -179,20 +1868,44 @@ int main(int argc, char *argv[])
         ws_opt.unit2unstressed[num_abc - 3] = num_abc - 1;
     }
     auto env = new Env(env_opt, as_opt, ws_opt);
-    for (int i = 4; i < num_abc; i++)
-    {
-        for (int j = std::max(0, i - 10); j < std::min(num_abc, i + 11); j++)
-            if ((i != j) && (j > 3))
-                env->register_permissible_change(i, j);
-        env->register_permissible_change(i, as_opt.emp_id);
-    }
+    register_changes(env, num_abc, as_opt.emp_id);
 
     auto mcts_opt = MctsOpt();
-    mcts_opt.puct_c = puct_c;
+    mcts_opt.selection_opt.puct_c = puct_c;
+    mcts_opt.selection_opt.heur_c = 0.0;
+    mcts_opt.selection_opt.add_noise = false;
+    mcts_opt.selection_opt.use_num_misaligned = false;
+    mcts_opt.selection_opt.use_max_value = true;
     mcts_opt.game_count = 3;
     mcts_opt.virtual_loss = 0.5;
     mcts_opt.num_threads = num_threads;
-    mcts_opt.add_noise = false;
+    mcts_opt.seed = random_seed;
+    if (check)
+    {
+        const auto cascades = sample_cascades(env, as_opt.null_id, as_opt.emp_id, 3, 4);
+        bool ok = check_occurrence_index(env, ws_opt, cascades);
+        ok = check_derived_actions(env, as_opt, ws_opt, cascades) && ok;
+        ok = check_deferred_expansion(env, as_opt, ws_opt, cascades) && ok;
+        ok = check_direct_apply(env, as_opt.null_id, as_opt.emp_id, cascades) && ok;
+        ok = check_cascades(env, as_opt.null_id, as_opt.emp_id, cascades, num_threads) && ok;
+        ok = check_num_affected(env, as_opt, ws_opt, cascades, num_abc) && ok;
+        ok = check_enumeration(env, as_opt, ws_opt, cascades, 4, num_threads, num_abc) && ok;
+        ok = check_lookahead(env, as_opt.null_id, cascades, 4, num_threads) && ok;
+        ok = check_beam_search(env, as_opt.null_id, cascades, 2, 2, num_threads) && ok;
+        ok = check_lockstep(env, mcts_opt, as_opt.null_id, num_steps, num_sims, batch_size, num_abc) && ok;
+        ok = check_selection(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_determinism(env, as_opt, ws_opt, mcts_opt, std::max(num_threads, 4), std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_epoch_reset(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_evict_siblings(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_kept_priors(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_root_parallel(env, as_opt, ws_opt, mcts_opt, std::max(num_threads, 4), std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_pipeline(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_search_controller(env, as_opt, ws_opt, mcts_opt, batch_size, num_abc) && ok;
+        ok = check_eval_cache(env, as_opt.null_id, num_abc) && ok;
+        ok = check_episode_runner(env, as_opt, ws_opt, mcts_opt, std::min(num_steps, 5), num_sims, batch_size, num_abc) && ok;
+        ok = check_state_batcher(env, as_opt, ws_opt, mcts_opt, std::max(num_threads, 4), num_sims, batch_size, num_abc) && ok;
+        return ok ? 0 : 1;
+    }
     auto mcts = new Mcts(env, mcts_opt);
     SPDLOG_INFO("Start node str:\n{}", str::from(env->start));
     SPDLOG_INFO("End node str:\n{}", str::from(env->end));
@@ -240,7 +1953,7 @@ int main(int argc, char *argv[])
             //     std::cerr << root->permissible_chars[i] << ":" << scores[i] << " ";
             // std::cerr << "\n";
             // std::cerr << "max index: " << root->max_index << " max_value: " << root->max_value << "\n";
-            auto extended_path = mcts->play(root, i);
+            auto extended_path = mcts->play(root, i, PlayStrategy::MAX, 1.0);
             root = extended_path.get_last_node();
             std::cerr << str::from(root);
             played_path.merge(extended_path);
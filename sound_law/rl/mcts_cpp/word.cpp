@@ -4,7 +4,23 @@ Word::Word(const IdSeq &id_seq,
            const IdSeq &vowel_seq,
            const vec<size_t> &id2vowel) : id_seq(id_seq),
                                           vowel_seq(vowel_seq),
-                                          id2vowel(id2vowel) {}
+                                          id2vowel(id2vowel)
+{
+    // Precompute the neighbors of every position so that expansion does not need to check bounds.
+    const int n = id_seq.size();
+    const int nv = vowel_seq.size();
+    id_neighbors = vec<array<abc_t, 5>>(n);
+    vowel_neighbors = vec<array<abc_t, 5>>(n);
+    for (int pos = 0; pos < n; ++pos)
+        for (int offset = -2; offset <= 2; ++offset)
+        {
+            int i = pos + offset;
+            id_neighbors[pos][offset + 2] = ((i >= 0) && (i < n)) ? id_seq[i] : abc::NONE;
+            // `id2vowel` does not cover the last position.
+            int j = (static_cast<size_t>(pos) < id2vowel.size()) ? static_cast<int>(id2vowel[pos]) + offset : -1;
+            vowel_neighbors[pos][offset + 2] = ((j >= 0) && (j < nv)) ? vowel_seq[j] : abc::NONE;
+        }
+}
 
 float Word::get_edit_dist_at(int order) const { return dists.at(order); }
 
@@ -72,6 +88,16 @@ void WordSpace::set_edit_dist_at(Word *word, int order) const
             order, [](Alignment &almt) {}, almt);
 };
 
+float WordSpace::get_edit_dist_at(const IdSeq &id_seq, int order) const
+{
+    float dist;
+    Word *word = nullptr;
+    if (words.if_contains(id_seq, [&word](Word *const &value) { word = value; }) &&
+        word->dists.if_contains(order, [&dist](const float &value) { dist = value; }))
+        return dist;
+    return get_edit_dist(id_seq, end_words[order]->id_seq);
+}
+
 float WordSpace::get_edit_dist(const IdSeq &seq1, const IdSeq &seq2) const
 {
     auto almt = Alignment();
@@ -25,11 +25,22 @@ class Word
     paramap<int, float> dists;
     paramap<int, Alignment> almts;
 
+    vec<array<abc_t, 5>> id_neighbors;
+    vec<array<abc_t, 5>> vowel_neighbors;
+
 public:
     const IdSeq id_seq;
     const IdSeq vowel_seq;
     const vec<size_t> id2vowel;
 
+    // Get the unit at `offset` (between -2 and 2) from `position`, either in `id_seq` or in `vowel_seq` (through
+    // `id2vowel`). Return `abc::NONE` if out of bound.
+    inline abc_t get_neighbor(size_t position, int offset, bool use_vowel_seq) const
+    {
+        assert((offset >= -2) && (offset <= 2));
+        return use_vowel_seq ? vowel_neighbors[position][offset + 2] : id_neighbors[position][offset + 2];
+    }
+
     // Get edit distance at a given `order`.
     float get_edit_dist_at(int) const;
     // Get alignment at a given `order`.
@@ -61,6 +72,9 @@ public:
     const vec<Word *> end_words;
 
     void set_edit_dist_at(Word *, int) const;
+    // Get the edit distance of an id sequence with the end state at `order`, from its word if it exists. No word is
+    // created otherwise.
+    float get_edit_dist_at(const IdSeq &, int) const;
     Word *get_word(const IdSeq &);
     vec<Word *> get_words(const VocabIdSeq &);
     float get_edit_dist(const IdSeq &, const IdSeq &) const;
@@ -57,6 +57,8 @@ add_argument('use_conditional', dtype=bool, default=True, msg='Flag to use condi
 add_argument('use_pruning', dtype=bool, default=True, msg='Flag to use pruning.')
 add_argument('dist_threshold', dtype=float, default=0.0, msg='Distance threshold for pruning.')
 add_argument('site_threshold', dtype=int, default=1, msg='Site threshold for pruning.')
+add_argument('defer_expansion', dtype=bool, default=False,
+             msg='Flag to expand new tree nodes only when they are evaluated instead of when they are created.')
 add_argument('mcts_verbose_level', dtype=int, default=0, msg="Verbose level for debugging MCTS.")
 add_argument('mcts_log_to_file', dtype=bool, default=False, msg="Flag to log to file for debugging MCTS.")
 add_argument('add_noise', dtype=bool, default=False, msg="Flag to add noise to rewards.")
@@ -152,7 +154,7 @@ class OnePairManager:
             env_opt = PyEnvOpt(s_arr, s_lengths, t_arr, t_lengths, g.final_reward, g.step_penalty)
             as_opt = PyActionSpaceOpt(NULL_ID, EMP_ID, SOT_ID, EOT_ID, ANY_ID, ANY_S_ID,
                                       ANY_UNS_ID, self.tgt_abc['j'], self.tgt_abc['w'], g.site_threshold, g.dist_threshold,
-                                      len(self.tgt_abc))
+                                      len(self.tgt_abc), defer_expansion=g.defer_expansion)
             ws_opt = PyWordSpaceOpt(self.tgt_abc.dist_mat, 1.0,
                                     g.use_alignment,
                                     self.tgt_abc.is_vowel,
@@ -166,7 +168,8 @@ class OnePairManager:
             self.model = self._get_model(dl=dl)
             # if g.use_mcts:
             mcts_opt = PyMctsOpt(g.puct_c, g.game_count, g.virtual_loss, g.num_workers,
-                                 g.heur_c, g.add_noise, g.use_num_misaligned, g.use_max_value)
+                                 g.heur_c, g.add_noise, g.use_num_misaligned, g.use_max_value, g.random_seed,
+                                 g.retain_subtree, g.root_parallel)
             self.mcts = Mcts(self.env, mcts_opt, agent=self.model)
 
     def _get_model(self, dl=None):
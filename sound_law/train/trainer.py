@@ -279,6 +279,7 @@ class MctsTrainer(RLTrainer):
             if g.improved_player_only:
                 logging.imp('Loading old state dict.')
                 self.agent.load_state_dict(self._old_state)
+                self.mcts.clear_eval_cache()
         else:
             self.tracker.reset('tolerance')
         self.metric_writer.add_metrics(self.best_metrics, self.tracker['step'].value)
@@ -368,5 +369,7 @@ class MctsTrainer(RLTrainer):
                 metrics += Metrics(total_loss, pi_ce_loss, grad_norm)
                 self.optimizer.step()
                 self.tracker.update('inner_step')
+        # Cached evaluations are stale after the update.
+        self.mcts.clear_eval_cache()
 
         return metrics